@@ -14,15 +14,306 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <endian.h>
 
 #define MAX_FILES 100
 #define FILE_PATH_BUFFER_SIZE 512
 #define MAX_FILENAME_LENGTH 100
+#define MAX_OWNERS 32   // most owners the registry returns for a SEARCH_META
+#define OWNER_RECORD 26 // id, ipv4, port, size and hash of an owner
 
 int sock;
 unsigned int peer_id;
 char peerIPStrGlobal[INET_ADDRSTRLEN]; // to store the peer's IP address as a string
 unsigned short peerPortGlobal;         // to store the peer's port number
+char *standbyAddr = NULL;              // standby registry as "host:port", NULL if none
+int joined = 0;                        // set once a JOIN has been sent so it can be replayed on failover
+char *udpHost = NULL;                  // registry host that answers SEARCH datagrams
+char *udpPort = NULL;                  // registry udp port, NULL to only search over tcp
+unsigned int publishTTL = 0;           // seconds the registry keeps our catalog without a heartbeat, 0 for forever
+int useMeta = 0;                       // publish file sizes and hashes and use them to plan fetches
+int frontCoded = 0;                    // publish sorted names that share their prefix with the one before
+char *registryHost = NULL;             // kept so WATCH can open its own connection
+char *registryPort = NULL;
+uint64_t resumeToken = 0;              // handed out by REGISTER to take our catalog back after a reconnect, 0 if none
+uint64_t publishedHash = 0;            // hash of the last catalog we published, 0 if nothing has been published
+
+// an owner of a file as returned by SEARCH_META
+struct owner
+{
+    unsigned int id;
+    unsigned int ipv4; // network byte order
+    unsigned short port;
+    uint64_t size;
+    uint64_t hash; // 0 if the owner published without metadata
+};
+
+// FNV-1a over the content of the file. returns 0 if the file can not be read
+uint64_t hashFile(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char chunk[4096];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            hash ^= chunk[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    fclose(file);
+
+    // 0 is reserved for no metadata
+    return hash ? hash : 1;
+}
+
+// FNV-1a over a publish body from the count to the end of the names, the
+// same hash the registry keeps for our catalog
+uint64_t hashCatalog(const unsigned char *body, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= body[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash ? hash : 1;
+}
+
+// sends a HEARTBEAT so the registry keeps our catalog. runs from SIGALRM, so
+// it is blocked while a request is being written to keep requests whole
+void heartbeat(int signo)
+{
+    unsigned char action = 7; // action code for HEARTBEAT
+    int saved = errno;
+
+    send(sock, &action, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    errno = saved;
+}
+
+void blockHeartbeat(int block)
+{
+    static int depth = 0; // calls nest, only the outermost one unblocks
+
+    depth += block ? 1 : -1;
+    if (!block && depth > 0)
+    {
+        return;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+int connectRegistry(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+    {
+        fprintf(stderr, "ERROR: No such host\n");
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (s < 0)
+        {
+            continue;
+        }
+
+        if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0)
+        {
+            break;
+        }
+
+        close(s);
+    }
+
+    freeaddrinfo(result);
+
+    if (rp == NULL)
+    {
+        return -1;
+    }
+
+    return s;
+}
+
+// switch over to the standby registry. the standby already mirrors our
+// catalog so only the JOIN has to be replayed, not the PUBLISH
+int failover()
+{
+    if (standbyAddr == NULL)
+    {
+        return -1;
+    }
+
+    char host[256];
+    char *sep = strrchr(standbyAddr, ':');
+    if (sep == NULL || sep - standbyAddr >= sizeof(host))
+    {
+        fprintf(stderr, "Invalid standby address: %s\n", standbyAddr);
+        return -1;
+    }
+
+    memcpy(host, standbyAddr, sep - standbyAddr);
+    host[sep - standbyAddr] = '\0';
+
+    // the standby answers datagrams on the same udp port
+    static char standbyHost[256];
+    strcpy(standbyHost, host);
+    udpHost = standbyHost;
+
+    close(sock);
+    sock = connectRegistry(host, sep + 1);
+    if (sock < 0)
+    {
+        perror("Failed to connect to standby registry");
+        return -1;
+    }
+
+    printf("Failed over to standby registry at %s\n", standbyAddr);
+
+    // only fail over once, there is nothing behind the standby
+    standbyAddr = NULL;
+
+    if (joined)
+    {
+        unsigned char buffer[5];
+        buffer[0] = 0;
+        *(unsigned int *)(buffer + 1) = htonl(peer_id);
+
+        if (send(sock, buffer, sizeof(buffer), MSG_NOSIGNAL) < 0)
+        {
+            perror("send");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// reconnect to the same registry and take back the catalog it kept for us
+// since the connection dropped, so nothing has to be published again
+int resumeSession()
+{
+    if (resumeToken == 0)
+    {
+        return -1;
+    }
+
+    int resumed = connectRegistry(registryHost, registryPort);
+    if (resumed < 0)
+    {
+        return -1;
+    }
+
+    unsigned char request[9];
+    unsigned char response[9];
+    uint64_t token = htobe64(resumeToken);
+
+    request[0] = 17; // action code for RESUME
+    memcpy(request + 1, &token, 8);
+
+    if (send(resumed, request, sizeof(request), MSG_NOSIGNAL) < 0 ||
+        recv(resumed, response, sizeof(response), MSG_WAITALL) != sizeof(response) ||
+        response[0] != 0)
+    {
+        // the registry let our session go, a failover or a REGISTER has to
+        // start over
+        close(resumed);
+        resumeToken = 0;
+        return -1;
+    }
+
+    close(sock);
+    sock = resumed;
+
+    printf("Resumed session with registry at %s:%s\n", registryHost, registryPort);
+
+    return 0;
+}
+
+// get a working connection back, resuming our session if the registry still
+// has it before falling over to the standby
+int reconnect()
+{
+    if (resumeSession() == 0)
+    {
+        return 0;
+    }
+
+    return failover();
+}
+
+// the registry never sends anything unsolicited so a readable socket with no
+// data means the registry has gone away
+int registryAlive()
+{
+    char b;
+    ssize_t peeked = recv(sock, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (peeked == 0)
+    {
+        return 0;
+    }
+
+    if (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+int sendRegistry(const void *buffer, size_t len)
+{
+    int result = 0;
+
+    blockHeartbeat(1);
+
+    if (!registryAlive() && reconnect() != 0)
+    {
+        result = -1;
+    }
+    else if (send(sock, buffer, len, MSG_NOSIGNAL) < 0)
+    {
+        if (reconnect() != 0 || send(sock, buffer, len, MSG_NOSIGNAL) < 0)
+        {
+            result = -1;
+        }
+    }
+
+    blockHeartbeat(0);
+
+    return result;
+}
 
 void join()
 {
@@ -32,32 +323,167 @@ void join()
     *(unsigned int *)(buffer + 1) = htonl(peer_id);
 
     // send the JOIN request to the registry
-    if (send(sock, buffer, sizeof(buffer), 0) < 0)
+    if (sendRegistry(buffer, sizeof(buffer)) < 0)
     {
         perror("send failed");
         return;
     }
 
+    joined = 1;
+
     printf("JOIN request sent. Peer ID: %u\n", peer_id);
 }
 
-void publish()
+int compareNames(const void *a, const void *b)
 {
-    DIR *dir;
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// asks the registry if it still has the catalog we published last. if it
+// does then only the hash goes over the wire and the catalog is kept as is.
+// returns the PUBLISH_IF status: 0 unchanged, 1 changed and 2 busy
+int publishIf(const unsigned char *body, size_t len)
+{
+    uint64_t hash = hashCatalog(body, len);
+
+    if (hash != publishedHash)
+    {
+        return 1;
+    }
+
+    unsigned char request[13];
+    unsigned char status;
+    uint64_t netHash = htobe64(hash);
+
+    request[0] = 18; // action code for PUBLISH_IF
+    *(unsigned int *)(request + 1) = htonl(publishTTL);
+    memcpy(request + 5, &netHash, 8);
+
+    blockHeartbeat(1);
+
+    if (sendRegistry(request, sizeof(request)) < 0 || recv(sock, &status, 1, MSG_WAITALL) != 1)
+    {
+        blockHeartbeat(0);
+        return 1;
+    }
+
+    blockHeartbeat(0);
+
+    return status;
+}
+
+// sends the names sorted and front coded as [shared][suffix length][suffix],
+// names under the same directory then only cost their last component
+void publishFrontCoded()
+{
+    DIR *dir = opendir("./SharedFiles");
     struct dirent *ent;
-    char buffer[1200];
-    int offset = 5; // start after action and count bytes
+    char *names[MAX_FILES];
+    int nameCount = 0;
+    char filePath[FILE_PATH_BUFFER_SIZE];
+
+    if (dir == NULL)
+    {
+        perror("Unable to open directory");
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL && nameCount < MAX_FILES)
+    {
+        snprintf(filePath, sizeof(filePath), "./SharedFiles/%s", ent->d_name);
+        struct stat statbuf;
+        if (stat(filePath, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+        {
+            if (strlen(ent->d_name) > 255)
+            {
+                fprintf(stderr, "Name too long to publish: %s\n", ent->d_name);
+                continue;
+            }
+            names[nameCount++] = strdup(ent->d_name);
+        }
+    }
+
+    closedir(dir);
+
+    qsort(names, nameCount, sizeof(char *), compareNames);
+
+    unsigned char buffer[1200];
+    int offset = 9; // action, ttl and count
     unsigned int fileCount = 0;
+    const char *prev = "";
+
+    for (int i = 0; i < nameCount; i++)
+    {
+        int shared = 0;
+        int nameLen = strlen(names[i]);
+        while (prev[shared] != '\0' && prev[shared] == names[i][shared])
+        {
+            shared++;
+        }
+
+        if (offset + 2 + nameLen - shared >= sizeof(buffer))
+        {
+            fprintf(stderr, "Buffer full, some files may not be published.\n");
+            break;
+        }
+
+        buffer[offset] = shared;
+        buffer[offset + 1] = nameLen - shared;
+        memcpy(buffer + offset + 2, names[i] + shared, nameLen - shared);
+        offset += 2 + nameLen - shared;
+        fileCount++;
+        prev = names[i];
+    }
+
+    buffer[0] = 15; // action code for the front coded PUBLISH
+    *(unsigned int *)(buffer + 1) = htonl(publishTTL);
+    *(unsigned int *)(buffer + 5) = htonl(fileCount);
+
+    int status = publishIf(buffer + 5, offset - 5);
+
+    if (status == 0)
+    {
+        printf("Catalog of %u files is unchanged.\n", fileCount);
+    }
+    else if (status == 2)
+    {
+        printf("Registry is busy, try publishing again later.\n");
+    }
+    else if (sendRegistry(buffer, offset) < 0)
+    {
+        perror("send");
+    }
+    else
+    {
+        publishedHash = hashCatalog(buffer + 5, offset - 5);
+        printf("Successfully published %u files.\n", fileCount);
+    }
+
+    for (int i = 0; i < nameCount; i++)
+    {
+        free(names[i]);
+    }
+}
+
+// appends the names of the files in SharedFiles to the buffer, each preceded
+// by its size and hash if withMeta is set. returns the new offset or -1 if
+// the directory can not be read
+int appendCatalog(char *buffer, int offset, int limit, int withMeta, unsigned int *fileCount)
+{
+    DIR *dir;
+    struct dirent *ent;
     char filePath[FILE_PATH_BUFFER_SIZE]; // buffer for constructing file paths
 
+    *fileCount = 0;
+
     // open the SharedFiles directory
     dir = opendir("./SharedFiles");
     if (dir == NULL)
     {
         perror("Unable to open directory");
-        return;
+        return -1;
     }
-    while ((ent = readdir(dir)) != NULL && offset < sizeof(buffer))
+    while ((ent = readdir(dir)) != NULL && offset < limit)
     {
         snprintf(filePath, sizeof(filePath), "./SharedFiles/%s", ent->d_name);
         struct stat statbuf;
@@ -66,11 +492,20 @@ void publish()
             if (S_ISREG(statbuf.st_mode))
             {
                 int nameLen = strlen(ent->d_name);
-                if (offset + nameLen + 1 < sizeof(buffer))
+                int metaLen = withMeta ? 16 : 0; // size and hash in front of the name
+                if (offset + metaLen + nameLen + 1 < limit)
                 {
+                    if (withMeta)
+                    {
+                        uint64_t size = htobe64(statbuf.st_size);
+                        uint64_t hash = htobe64(hashFile(filePath));
+                        memcpy(buffer + offset, &size, 8);
+                        memcpy(buffer + offset + 8, &hash, 8);
+                        offset += metaLen;
+                    }
                     strcpy(buffer + offset, ent->d_name); // copy the file name
                     offset += nameLen + 1;                // move offset, account for null terminator
-                    fileCount++;
+                    (*fileCount)++;
                 }
                 else
                 {
@@ -83,63 +518,259 @@ void publish()
 
     closedir(dir);
 
-    buffer[0] = 1;                                    // action code for PUBLISH
-    *(unsigned int *)(buffer + 1) = htonl(fileCount); // place the file count at the beginning of the buffer, in network byte order
+    return offset;
+}
+
+void publish()
+{
+    char buffer[1360];
+    int limit = useMeta ? sizeof(buffer) : 1200; // the registry allows 16 bytes of metadata for each of its 10 files
+    int header = publishTTL ? 9 : 5;             // action, optional ttl and count bytes
+    unsigned int fileCount = 0;
+
+    if (frontCoded && !useMeta)
+    {
+        publishFrontCoded();
+        return;
+    }
+
+    int offset = appendCatalog(buffer, header, limit, useMeta, &fileCount); // names go after the header
+    if (offset < 0)
+    {
+        return;
+    }
+
+    if (publishTTL)
+    {
+        buffer[0] = useMeta ? 9 : 6; // action code for PUBLISH(_META) with a ttl
+        *(unsigned int *)(buffer + 1) = htonl(publishTTL);
+    }
+    else
+    {
+        buffer[0] = useMeta ? 8 : 1; // action code for PUBLISH_META or PUBLISH
+    }
+    *(unsigned int *)(buffer + header - 4) = htonl(fileCount); // place the file count right before the names, in network byte order
 
+    unsigned char *body = (unsigned char *)buffer + header - 4;
+
+    int status = publishIf(body, offset - (header - 4));
+
+    if (status == 0)
+    {
+        printf("Catalog of %u files is unchanged.\n", fileCount);
+    }
+    else if (status == 2)
+    {
+        printf("Registry is busy, try publishing again later.\n");
+    }
     // send the PUBLISH request to the registry
-    if (send(sock, buffer, offset, 0) < 0)
+    else if (sendRegistry(buffer, offset) < 0)
     {
         perror("send");
     }
     else
     {
-        printf("Successfully published %u files.\n", fileCount);
+        publishedHash = hashCatalog(body, offset - (header - 4));
+        printf("Successfully published %u files.\n", fileCount);
+    }
+}
+
+// joins and publishes in a single request and waits for the registry to
+// acknowledge both. a ttl or metadata need their own PUBLISH so those fall
+// back to a JOIN followed by a PUBLISH
+void registerPeer()
+{
+    if (publishTTL || useMeta || frontCoded)
+    {
+        join();
+        publish();
+        return;
+    }
+
+    char buffer[1204];
+    unsigned int fileCount = 0;
+
+    // [action][peer id][count][names]
+    int offset = appendCatalog(buffer, 9, sizeof(buffer), 0, &fileCount);
+    if (offset < 0)
+    {
+        return;
+    }
+
+    buffer[0] = 16; // action code for REGISTER
+    *(unsigned int *)(buffer + 1) = htonl(peer_id);
+    *(unsigned int *)(buffer + 5) = htonl(fileCount);
+
+    // [status][resume token]
+    unsigned char response[9];
+
+    blockHeartbeat(1);
+
+    if (sendRegistry(buffer, offset) < 0 || recv(sock, response, sizeof(response), MSG_WAITALL) != sizeof(response))
+    {
+        perror("register");
+        blockHeartbeat(0);
+        return;
+    }
+
+    blockHeartbeat(0);
+
+    unsigned char status = response[0];
+
+    if (status == 0)
+    {
+        uint64_t token;
+        memcpy(&token, response + 1, 8);
+        resumeToken = be64toh(token);
+        publishedHash = hashCatalog((unsigned char *)buffer + 5, offset - 5);
+
+        joined = 1;
+        printf("Registered as peer %u with %u files.\n", peer_id, fileCount);
+    }
+    else if (status == 1)
+    {
+        printf("Peer ID %u is already in use.\n", peer_id);
+    }
+    else if (status == 4)
+    {
+        printf("Registry is busy, try registering again later.\n");
+    }
+    else
+    {
+        printf("Registry rejected the registration.\n");
+    }
+}
+
+// sends a single SEARCH datagram to the registry's udp port. returns -1 if
+// there was no answer in time so the caller can fall back to tcp
+int searchUdp(const char *buffer, int len, unsigned char *response)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(udpHost, udpPort, &hints, &result) != 0)
+    {
+        return -1;
+    }
+
+    int udpSock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (udpSock < 0)
+    {
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    // the answer is a single datagram, if it is lost we just use tcp
+    struct timeval timeout = {0, 200000};
+    setsockopt(udpSock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ssize_t received = -1;
+
+    if (connect(udpSock, result->ai_addr, result->ai_addrlen) == 0 &&
+        send(udpSock, buffer, len, 0) == len)
+    {
+        received = recv(udpSock, response, 10, 0);
     }
+
+    freeaddrinfo(result);
+    close(udpSock);
+
+    return received == 10 ? 0 : -1;
 }
 
-void search()
+// sends a SEARCH request and reads the 10 byte response. if the registry goes
+// away mid request then the request is retried once after resuming the
+// session or failing over to the standby
+int searchRegistry(const char *fileName, unsigned int *peerID, unsigned int *peerIPv4, unsigned short *peerPort)
 {
-    char fileName[101]; // buffer to hold file name
-    printf("Enter a file name: \n");
-    scanf("%100s", fileName); // read file name, ensuring not to overflow buffer
     char buffer[1024];
     int fileNameLength = strlen(fileName);
     buffer[0] = 2; // action code for SEARCH
     strcpy(buffer + 1, fileName);
-    buffer[fileNameLength + 1] = '\0';
+    buffer[fileNameLength + 1] = '\0'; // ensure null-termination
 
-    // send the SEARCH request to the registry
-    if (send(sock, buffer, fileNameLength + 2, 0) < 0)
+    unsigned char response[10];
+    int attempts = 2;
+
+    if (udpPort != NULL && searchUdp(buffer, fileNameLength + 2, response) == 0)
     {
-        perror("send");
-        return;
+        attempts = 0;
     }
 
-    // receive the response from the registry
-    unsigned int peerID;
-    unsigned int peerIPv4;
-    unsigned short peerPort;
+    // a heartbeat landing in the middle of the exchange would cut the
+    // response short
+    blockHeartbeat(1);
 
-    int bytesReceived = recv(sock, &peerID, sizeof(peerID), 0);
-    if (bytesReceived <= 0)
+    while (attempts-- > 0)
     {
-        perror("recv");
-        return;
+        // send the SEARCH request to the registry
+        if (sendRegistry(buffer, fileNameLength + 2) < 0)
+        {
+            perror("send");
+            blockHeartbeat(0);
+            return -1;
+        }
+
+        // receive the response from the registry
+        ssize_t bytesReceived = recv(sock, response, sizeof(response), MSG_WAITALL);
+        if (bytesReceived == sizeof(response))
+        {
+            break;
+        }
+
+        if (bytesReceived > 0)
+        {
+            fprintf(stderr, "Incomplete response from registry.\n");
+            blockHeartbeat(0);
+            return -1;
+        }
+
+        if (reconnect() != 0)
+        {
+            perror("recv");
+            blockHeartbeat(0);
+            return -1;
+        }
+
+        if (attempts == 0)
+        {
+            blockHeartbeat(0);
+            return -1;
+        }
     }
 
-    bytesReceived += recv(sock, &peerIPv4, sizeof(peerIPv4), 0);
-    bytesReceived += recv(sock, &peerPort, sizeof(peerPort), 0);
+    blockHeartbeat(0);
+
+    memcpy(peerID, response, 4);
+    memcpy(peerIPv4, response + 4, 4);
+    memcpy(peerPort, response + 8, 2);
+
+    // convert network byte order to host byte order
+    *peerID = ntohl(*peerID);
+    *peerPort = ntohs(*peerPort);
+
+    return 0;
+}
+
+void search()
+{
+    char fileName[101]; // buffer to hold file name
+    printf("Enter a file name: \n");
+    scanf("%100s", fileName); // read file name, ensuring not to overflow buffer
+
+    unsigned int peerID;
+    unsigned int peerIPv4;
+    unsigned short peerPort;
 
-    if (bytesReceived < sizeof(peerID) + sizeof(peerIPv4) + sizeof(peerPort))
+    if (searchRegistry(fileName, &peerID, &peerIPv4, &peerPort) < 0)
     {
-        fprintf(stderr, "Incomplete response from registry.\n");
         return;
     }
 
-    // convert network byte order to host byte order
-    peerID = ntohl(peerID);
-    peerPort = ntohs(peerPort);
-
     // check if file was found
     if (peerID == 0 && peerIPv4 == 0 && peerPort == 0)
     {
@@ -156,54 +787,142 @@ void search()
 }
 
 void searchForFetch(char *fileName)
+{
+    // expecting to receive peer information: peerID, peerIPv4, peerPort
+    unsigned int peerID;
+    unsigned int peerIPv4;
+    unsigned short peerPort;
+
+    if (searchRegistry(fileName, &peerID, &peerIPv4, &peerPort) < 0)
+    {
+        return;
+    }
+
+    // store the peer's address and port for fetching the file
+    if (peerID != 0 && peerIPv4 != 0 && peerPort != 0)
+    {
+        inet_ntop(AF_INET, &peerIPv4, peerIPStrGlobal, INET_ADDRSTRLEN);
+        peerPortGlobal = peerPort;
+    }
+    else
+    {
+        printf("File not found in the registry.\n");
+    }
+}
+
+// sends a SEARCH_META request and reads every owner of the file. the owners
+// come back ordered by hash so owners with the same content are adjacent
+int searchMeta(const char *fileName, struct owner *owners)
 {
     char buffer[1024];
     int fileNameLength = strlen(fileName);
-    buffer[0] = 2; // action code for SEARCH
+    buffer[0] = 10; // action code for SEARCH_META
     strcpy(buffer + 1, fileName);
-    buffer[fileNameLength + 1] = '\0'; // ensure null-termination
 
-    // send the SEARCH request to the registry
-    if (send(sock, buffer, fileNameLength + 2, 0) < 0)
+    unsigned char response[OWNER_RECORD * MAX_OWNERS];
+    unsigned short count;
+
+    blockHeartbeat(1);
+
+    if (sendRegistry(buffer, fileNameLength + 2) < 0 ||
+        recv(sock, &count, 2, MSG_WAITALL) != 2)
     {
-        perror("send");
-        return;
+        perror("search");
+        blockHeartbeat(0);
+        return -1;
     }
 
-    // expecting to receive peer information: peerID, peerIPv4, peerPort
-    unsigned int peerID;
-    unsigned int peerIPv4;
-    unsigned short peerPort;
+    count = ntohs(count);
+    if (count > MAX_OWNERS ||
+        (count && recv(sock, response, count * OWNER_RECORD, MSG_WAITALL) != count * OWNER_RECORD))
+    {
+        fprintf(stderr, "Incomplete response from registry.\n");
+        blockHeartbeat(0);
+        return -1;
+    }
+
+    blockHeartbeat(0);
 
-    int bytesReceived = recv(sock, &peerID, sizeof(peerID), 0);
-    if (bytesReceived <= 0)
+    for (int i = 0; i < count; i++)
     {
-        perror("recv");
-        return;
+        unsigned char *r = response + i * OWNER_RECORD;
+        memcpy(&owners[i].id, r, 4);
+        memcpy(&owners[i].ipv4, r + 4, 4);
+        memcpy(&owners[i].port, r + 8, 2);
+        memcpy(&owners[i].size, r + 10, 8);
+        memcpy(&owners[i].hash, r + 18, 8);
+
+        owners[i].id = ntohl(owners[i].id);
+        owners[i].port = ntohs(owners[i].port);
+        owners[i].size = be64toh(owners[i].size);
+        owners[i].hash = be64toh(owners[i].hash);
     }
 
-    bytesReceived += recv(sock, &peerIPv4, sizeof(peerIPv4), 0);
-    bytesReceived += recv(sock, &peerPort, sizeof(peerPort), 0);
+    return count;
+}
+
+// picks the owner to fetch from using the published metadata. the version
+// held by the most owners wins, owners without metadata are a last resort.
+// returns 1 if we already have the same content and the fetch can be skipped
+int planFetch(const char *fileName, uint64_t *size, uint64_t *hash)
+{
+    struct owner owners[MAX_OWNERS];
+    int count = searchMeta(fileName, owners);
 
-    if (bytesReceived < sizeof(peerID) + sizeof(peerIPv4) + sizeof(peerPort))
+    if (count <= 0)
     {
-        fprintf(stderr, "Incomplete response from registry.\n");
-        return;
+        if (count == 0)
+        {
+            printf("File not found in the registry.\n");
+        }
+        return -1;
     }
 
-    peerID = ntohl(peerID);
-    peerPort = ntohs(peerPort);
+    int best = 0, bestLen = 0, versions = 0;
 
-    // store the peer's address and port for fetching the file
-    if (peerID != 0 && peerIPv4 != 0 && peerPort != 0)
+    for (int start = 0; start < count;)
     {
-        inet_ntop(AF_INET, &peerIPv4, peerIPStrGlobal, INET_ADDRSTRLEN);
-        peerPortGlobal = peerPort;
+        int end = start;
+        while (end < count && owners[end].hash == owners[start].hash)
+        {
+            end++;
+        }
+
+        if (owners[start].hash != 0)
+        {
+            versions++;
+        }
+
+        int len = owners[start].hash == 0 ? 0 : end - start;
+        if (len > bestLen || bestLen == 0)
+        {
+            best = start;
+            bestLen = len;
+        }
+
+        start = end;
     }
-    else
+
+    if (versions > 1)
     {
-        printf("File not found in the registry.\n");
+        printf("Owners hold %d different versions of '%s'.\n", versions, fileName);
+    }
+
+    *size = owners[best].size;
+    *hash = owners[best].hash;
+
+    struct stat statbuf;
+    if (*hash != 0 && stat(fileName, &statbuf) == 0 &&
+        (uint64_t)statbuf.st_size == *size && hashFile(fileName) == *hash)
+    {
+        printf("File '%s' already present with identical content.\n", fileName);
+        return 1;
     }
+
+    inet_ntop(AF_INET, &owners[best].ipv4, peerIPStrGlobal, INET_ADDRSTRLEN);
+    peerPortGlobal = owners[best].port;
+
+    return 0;
 }
 
 void fetch()
@@ -212,8 +931,21 @@ void fetch()
     printf("Enter a file name: \n");
     scanf("%100s", fileName); // read file name, ensuring not to overflow buffet
 
-    // send a SEARCH request for the file
-    searchForFetch(fileName); // Tmodified search function tailored for fetch
+    uint64_t expectSize = 0; // known when fetching with metadata
+    uint64_t expectHash = 0;
+
+    if (useMeta)
+    {
+        if (planFetch(fileName, &expectSize, &expectHash) != 0)
+        {
+            return;
+        }
+    }
+    else
+    {
+        // send a SEARCH request for the file
+        searchForFetch(fileName); // Tmodified search function tailored for fetch
+    }
 
     int peerSock = socket(AF_INET, SOCK_STREAM, 0);
     if (peerSock < 0)
@@ -257,6 +989,12 @@ void fetch()
         return;
     }
 
+    if (expectSize > 0)
+    {
+        // reserve the space up front so the file is not fragmented
+        posix_fallocate(fileno(file), 0, expectSize);
+    }
+
     int bytesReceived;
     char fileBuffer[4096]; // buffer for file data
     int firstChunk = 1;
@@ -285,6 +1023,235 @@ void fetch()
 
     fclose(file);
     close(peerSock);
+
+    if (expectHash != 0 && hashFile(fileName) != expectHash)
+    {
+        fprintf(stderr, "Warning: content of '%s' does not match the published hash.\n", fileName);
+    }
+}
+
+// prints every file indexed by the registry. the registry streams the
+// catalog in pages, each one says where the next one starts
+void list()
+{
+    unsigned char request[9];
+    request[0] = 14; // action code for LIST
+    memset(request + 1, 0, 8); // start from the beginning
+
+    blockHeartbeat(1);
+
+    if (sendRegistry(request, sizeof(request)) < 0)
+    {
+        perror("send");
+        blockHeartbeat(0);
+        return;
+    }
+
+    unsigned long total = 0;
+    uint64_t next = 0;
+
+    while (next != UINT64_MAX)
+    {
+        // [count][next cursor] then [peer id][name] for every entry
+        unsigned char header[10];
+        if (recv(sock, header, sizeof(header), MSG_WAITALL) != sizeof(header))
+        {
+            fprintf(stderr, "Incomplete response from registry.\n");
+            break;
+        }
+
+        unsigned short count;
+        memcpy(&count, header, 2);
+        memcpy(&next, header + 2, 8);
+        count = ntohs(count);
+        next = be64toh(next);
+
+        for (unsigned short i = 0; i < count; i++)
+        {
+            unsigned int id;
+            char name[2048];
+            size_t len = 0;
+
+            if (recv(sock, &id, 4, MSG_WAITALL) != 4)
+            {
+                next = UINT64_MAX;
+                break;
+            }
+
+            while (len < sizeof(name) - 1 && recv(sock, name + len, 1, 0) == 1 && name[len] != '\0')
+            {
+                len++;
+            }
+            name[len] = '\0';
+
+            printf("Peer %u: %s\n", ntohl(id), name);
+            total++;
+        }
+    }
+
+    blockHeartbeat(0);
+
+    printf("%lu files indexed by registry.\n", total);
+}
+
+// prints the registry's counters. the response is split into sections that
+// each carry their length, so sections this peer does not know are skipped
+void stats()
+{
+    unsigned char request = 19; // action code for STATS
+    unsigned char response[4096];
+    unsigned int total;
+
+    blockHeartbeat(1);
+
+    if (sendRegistry(&request, 1) < 0 || recv(sock, &total, 4, MSG_WAITALL) != 4)
+    {
+        perror("stats");
+        blockHeartbeat(0);
+        return;
+    }
+
+    total = ntohl(total);
+
+    if (total > sizeof(response) || recv(sock, response, total, MSG_WAITALL) != total)
+    {
+        fprintf(stderr, "Incomplete response from registry.\n");
+        blockHeartbeat(0);
+        return;
+    }
+
+    blockHeartbeat(0);
+
+    for (unsigned int offset = 0; offset + 3 <= total;)
+    {
+        unsigned char section = response[offset];
+        unsigned short len;
+        memcpy(&len, response + offset + 1, 2);
+        len = ntohs(len);
+
+        unsigned char *body = response + offset + 3;
+        offset += 3 + len;
+
+        if (offset > total)
+        {
+            break;
+        }
+
+        if (section == 1 && len >= 1) // most searched names
+        {
+            printf("Most searched files:\n");
+
+            unsigned int at = 1;
+            for (int i = 0; i < body[0] && at + 4 < len; i++)
+            {
+                unsigned int count;
+                memcpy(&count, body + at, 4);
+
+                const char *name = (const char *)body + at + 4;
+                size_t nameLen = strnlen(name, len - at - 4);
+
+                printf("  %8u %.*s\n", ntohl(count), (int)nameLen, name);
+                at += 4 + nameLen + 1;
+            }
+        }
+        else if (section == 2 && len >= 17) // load of the registry's loop
+        {
+            unsigned int lag, depth;
+            uint64_t shed;
+            memcpy(&lag, body, 4);
+            memcpy(&depth, body + 4, 4);
+            memcpy(&shed, body + 9, 8);
+
+            printf("Loop lag: %u us, queue depth: %u, %s, %llu publishes shed\n",
+                   ntohl(lag), ntohl(depth), body[8] ? "shedding publishes" : "accepting publishes",
+                   (unsigned long long)be64toh(shed));
+        }
+        else if (section == 3 && len >= 9) // memory used by the registry's clients
+        {
+            uint64_t used;
+            memcpy(&used, body, 8);
+
+            printf("Memory used by clients: %llu bytes\n", (unsigned long long)be64toh(used));
+
+            for (int i = 0; i < body[8] && 9 + (i + 1) * 12 <= len; i++)
+            {
+                unsigned int id;
+                uint64_t bytes;
+                memcpy(&id, body + 9 + i * 12, 4);
+                memcpy(&bytes, body + 13 + i * 12, 8);
+
+                printf("  peer %u: %llu bytes\n", ntohl(id), (unsigned long long)be64toh(bytes));
+            }
+        }
+    }
+}
+
+// waits on a connection of its own until a matching file is published. the
+// registry pushes the notification so there is no need to keep searching
+void watch()
+{
+    char fileName[MAX_FILENAME_LENGTH + 1];
+    printf("Enter a file name (end it with * to watch a prefix): \n");
+    scanf("%100s", fileName);
+
+    int prefix = 0;
+    size_t len = strlen(fileName);
+    if (len > 0 && fileName[len - 1] == '*')
+    {
+        fileName[--len] = '\0';
+        prefix = 1;
+    }
+
+    int watchSock = connectRegistry(registryHost, registryPort);
+    if (watchSock < 0)
+    {
+        perror("Failed to connect to registry");
+        return;
+    }
+
+    char buffer[MAX_FILENAME_LENGTH + 3];
+    buffer[0] = 11;     // action code for WATCH
+    buffer[1] = prefix; // 0 for the exact name, 1 for a prefix
+    strcpy(buffer + 2, fileName);
+
+    if (send(watchSock, buffer, len + 3, MSG_NOSIGNAL) < 0)
+    {
+        perror("send");
+        close(watchSock);
+        return;
+    }
+
+    printf("Waiting for '%s%s' to be published...\n", fileName, prefix ? "*" : "");
+
+    // [13][peer id][ipv4][port][name]
+    unsigned char header[11];
+    char name[MAX_FILENAME_LENGTH + 1];
+    size_t nameLen = 0;
+
+    if (recv(watchSock, header, sizeof(header), MSG_WAITALL) != sizeof(header) || header[0] != 13)
+    {
+        fprintf(stderr, "Registry closed the watch.\n");
+        close(watchSock);
+        return;
+    }
+
+    while (nameLen < MAX_FILENAME_LENGTH && recv(watchSock, name + nameLen, 1, 0) == 1 && name[nameLen] != '\0')
+    {
+        nameLen++;
+    }
+    name[nameLen] = '\0';
+
+    close(watchSock);
+
+    unsigned int peerID;
+    unsigned short peerPort;
+    char peerIPStr[INET_ADDRSTRLEN];
+
+    memcpy(&peerID, header + 1, 4);
+    memcpy(&peerPort, header + 9, 2);
+    inet_ntop(AF_INET, header + 5, peerIPStr, INET_ADDRSTRLEN);
+
+    printf("File '%s' published by\nPeer %u\n%s:%hu\n", name, ntohl(peerID), peerIPStr, ntohs(peerPort));
 }
 
 void close_app()
@@ -303,8 +1270,12 @@ void print_options()
     printf("\nAvailable Commands: \n");
     printf("JOIN: sends a JOIN request to the registry.\n");
     printf("PUBLISH: send a PUBLISH request to the registry.\n");
+    printf("REGISTER: JOIN and PUBLISH in a single request.\n");
     printf("SEARCH: reads a file name from the terminal, print peer info.\n");
     printf("FETCH: fetch a file from another peer and save it locally.\n");
+    printf("WATCH: wait until a file, or any file with a prefix, is published.\n");
+    printf("LIST: print every file indexed by the registry.\n");
+    printf("STATS: print the most searched files, the registry's load and memory use.\n");
     printf("EXIT: close the peer application.\n\n");
 
     while (1)
@@ -320,6 +1291,10 @@ void print_options()
             {
                 publish();
             }
+            else if (strcmp(selection, "REGISTER") == 0)
+            {
+                registerPeer();
+            }
             else if (strcmp(selection, "SEARCH") == 0)
             {
                 search();
@@ -328,6 +1303,18 @@ void print_options()
             {
                 fetch();
             }
+            else if (strcmp(selection, "WATCH") == 0)
+            {
+                watch();
+            }
+            else if (strcmp(selection, "LIST") == 0)
+            {
+                list();
+            }
+            else if (strcmp(selection, "STATS") == 0)
+            {
+                stats();
+            }
             else if (strcmp(selection, "EXIT") == 0)
             {
                 printf("Exiting peer application.\n");
@@ -349,48 +1336,75 @@ void print_options()
 
 int main(int argc, char *argv[])
 {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:u:t:mf")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            standbyAddr = optarg; // standby registry to fail over to
+            break;
+        case 'u':
+            udpPort = optarg; // search over udp first
+            break;
+        case 't':
+            publishTTL = atoi(optarg); // publish with a ttl and send heartbeats
+            break;
+        case 'm':
+            useMeta = 1; // publish and fetch with file metadata
+            break;
+        case 'f':
+            frontCoded = 1; // publish front coded names, ignored with -m
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s standby IP:port] [-u registry udp port] [-t publish ttl] [-m] [-f] <registry IP> <registry port> <peer ID>\n", argv[0]);
+            exit(1);
+        }
+    }
+
     // ensure correct argument count
-    if (argc != 4)
+    if (argc - optind != 3)
     {
-        fprintf(stderr, "Usage: %s <registry IP> <registry port> <peer ID>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-s standby IP:port] [-u registry udp port] [-t publish ttl] [-m] [-f] <registry IP> <registry port> <peer ID>\n", argv[0]);
         exit(1);
     }
 
-    peer_id = atoi(argv[3]); // convert peer ID from argument
+    char *registryIP = argv[optind];
+    registryPort = argv[optind + 1];
+    registryHost = registryIP;
 
-    // networking initialization
-    struct sockaddr_in registryAddr; // registry address
-    struct hostent *registryHost;    // host information
+    udpHost = registryIP;
 
-    // create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    peer_id = atoi(argv[optind + 2]); // convert peer ID from argument
+
+    // connect to registry
+    sock = connectRegistry(registryIP, registryPort);
     if (sock < 0)
     {
-        perror("Failed to create socket");
+        perror("Failed to connect to registry");
         exit(1);
     }
+    printf("Connected to registry at %s:%s\n", registryIP, registryPort);
 
-    // resolve registry hostname/IP
-    registryHost = gethostbyname(argv[1]);
-    if (registryHost == NULL)
+    if (publishTTL)
     {
-        fprintf(stderr, "ERROR: No such host\n");
-        exit(1);
-    }
+        // heartbeat a few times per ttl so a single late one does not
+        // expire the catalog
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = heartbeat;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGALRM, &sa, NULL);
 
-    // fill registry address structure
-    memset(&registryAddr, 0, sizeof(registryAddr));
-    registryAddr.sin_family = AF_INET;
-    memcpy(&registryAddr.sin_addr, registryHost->h_addr_list[0], registryHost->h_length);
-    registryAddr.sin_port = htons(atoi(argv[2])); // registry port
-
-    // connect to registry
-    if (connect(sock, (struct sockaddr *)&registryAddr, sizeof(registryAddr)) < 0)
-    {
-        perror("Failed to connect to registry");
-        exit(1);
+        struct itimerval interval;
+        interval.it_interval.tv_sec = publishTTL / 3 ? publishTTL / 3 : 1;
+        interval.it_interval.tv_usec = 0;
+        interval.it_value = interval.it_interval;
+        setitimer(ITIMER_REAL, &interval, NULL);
     }
-    printf("Connected to registry at %s:%s\n", argv[1], argv[2]);
+
     print_options();
     close(sock);
     return 0;
@@ -0,0 +1,283 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "engine.h"
+
+// number of peers in each run, every peer publishes max_files names so the
+// catalog holds ten times as many files
+const size_t SIZES[] = {100, 1000, 10000};
+
+/**
+ * the time spent on one kind of request over a run
+ */
+struct timing {
+    const char *name;
+    size_t ops;
+    uint64_t ns;
+};
+
+/**
+ * joins the given number of in-memory peers, publishes a full catalog for
+ * each of them and searches for random names from the catalogs, then for
+ * names nobody published, which walks every slot. prints the time per
+ * request for each action
+ */
+int run(size_t peers, size_t searches);
+
+/**
+ * builds the PUBLISH request for the given peer into buf and returns its
+ * length
+ */
+size_t build_publish(uint8_t *buf, size_t len, size_t peer, size_t files);
+
+/**
+ * prints a line of the results table
+ */
+void print_timing(size_t peers, size_t files, struct timing *timing);
+
+/**
+ * returns the current time of the monotonic clock in ns
+ */
+uint64_t now_ns();
+
+/**
+ * xorshift generator so the names searched are the same on every run
+ */
+uint64_t next_random(uint64_t *state);
+
+int main(int argc, char **argv) {
+    size_t searches = 10000;
+
+    static struct option long_options[] = {
+        {"searches", required_argument, 0, 0},
+        {0,0,0,0}
+    };
+
+    int option_index = 0;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        if (c != 0) {
+            fprintf(stderr, "usage: %s [--searches N]\n", argv[0]);
+            return 1;
+        }
+
+        switch (option_index) {
+        case 0:
+            searches = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (searches == 0) {
+        fprintf(stderr, "[ERROR] --searches must be greater than 0\n");
+        return 1;
+    }
+
+    printf("%-8s %8s %8s %10s %10s\n", "", "peers", "files", "requests", "ns/op");
+
+    for (size_t index = 0; index < sizeof(SIZES) / sizeof(SIZES[0]); ++index) {
+        if (run(SIZES[index], searches) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int run(size_t peers, size_t searches) {
+    // the server holds a few tables sized for every socket so it is kept off
+    // the stack
+    struct server *server = calloc(1, sizeof(struct server));
+    struct client **clients = calloc(peers, sizeof(struct client *));
+
+    if (server == NULL || clients == NULL) {
+        fprintf(stderr, "[ERROR] failed allocating server state\n");
+
+        free(server);
+        free(clients);
+
+        return 1;
+    }
+
+    server->output_type = NO_LOG;
+    server->output = stdout;
+
+    // one more slot for the peer doing the searches
+    if (!engine_init(server, peers + 1)) {
+        fprintf(stderr, "[ERROR] failed to set up the engine: %s\n", strerror(errno));
+
+        free(server);
+        free(clients);
+
+        return 1;
+    }
+
+    size_t files = server->max_files;
+    uint8_t request[BUFF_SIZE];
+    uint8_t response[BUFF_SIZE];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (size_t index = 0; index <= peers; ++index) {
+        addr.sin_port = htons((uint16_t)(10000 + index % 50000));
+
+        struct client *client = engine_connect(server, -1, (struct sockaddr *)&addr);
+
+        if (client == NULL) {
+            fprintf(stderr, "[ERROR] failed to connect peer %lu\n", index);
+
+            engine_free(server);
+            free(server);
+            free(clients);
+
+            return 1;
+        }
+
+        if (index < peers) {
+            clients[index] = client;
+        }
+    }
+
+    struct client *searcher = &server->clients[peers];
+    struct timing join = {"JOIN", peers, 0};
+    struct timing publish = {"PUBLISH", peers, 0};
+    struct timing search = {"SEARCH", searches, 0};
+    struct timing miss = {"MISS", searches, 0};
+
+    // the searcher joins first, under an id none of the peers use
+    request[0] = ACTION_JOIN;
+    uint32_t id = htonl((uint32_t)peers + 1);
+    memcpy(request + 1, &id, 4);
+    engine_feed(server, searcher, request, 5, response, sizeof(response));
+
+    uint64_t start = now_ns();
+
+    for (size_t index = 0; index < peers; ++index) {
+        id = htonl((uint32_t)index + 1);
+
+        request[0] = ACTION_JOIN;
+        memcpy(request + 1, &id, 4);
+
+        engine_feed(server, clients[index], request, 5, response, sizeof(response));
+    }
+
+    join.ns = now_ns() - start;
+
+    // building the requests is kept out of the timings
+    for (size_t index = 0; index < peers; ++index) {
+        size_t len = build_publish(request, sizeof(request), index, files);
+
+        start = now_ns();
+        engine_feed(server, clients[index], request, len, response, sizeof(response));
+        publish.ns += now_ns() - start;
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15;
+    size_t misses = 0;
+
+    for (size_t index = 0; index < searches; ++index) {
+        uint64_t pick = next_random(&state);
+
+        request[0] = ACTION_SEARCH;
+        size_t len = 1 + (size_t)snprintf((char *)request + 1, sizeof(request) - 1, "peer%lu-file%lu.bin", (unsigned long)(pick % peers), (unsigned long)((pick >> 32) % files)) + 1;
+
+        start = now_ns();
+        size_t got = engine_feed(server, searcher, request, len, response, sizeof(response));
+        search.ns += now_ns() - start;
+
+        uint32_t found = 0;
+
+        if (got == SEARCH_RESPONSE_SIZE) {
+            memcpy(&found, response, 4);
+        }
+
+        if (found == 0) {
+            misses += 1;
+        }
+    }
+
+    for (size_t index = 0; index < searches; ++index) {
+        request[0] = ACTION_SEARCH;
+        size_t len = 1 + (size_t)snprintf((char *)request + 1, sizeof(request) - 1, "nobody-file%lu.bin", (unsigned long)index) + 1;
+
+        start = now_ns();
+        engine_feed(server, searcher, request, len, response, sizeof(response));
+        miss.ns += now_ns() - start;
+    }
+
+    print_timing(peers, peers * files, &join);
+    print_timing(peers, peers * files, &publish);
+    print_timing(peers, peers * files, &search);
+    print_timing(peers, peers * files, &miss);
+
+    if (misses > 0) {
+        fprintf(stderr, "[WARN] %lu searches did not find the file\n", misses);
+    }
+
+    engine_free(server);
+    free(server);
+    free(clients);
+
+    return 0;
+}
+
+size_t build_publish(uint8_t *buf, size_t len, size_t peer, size_t files) {
+    uint32_t count = htonl((uint32_t)files);
+    size_t used = 5;
+
+    buf[0] = ACTION_PUBLISH;
+    memcpy(buf + 1, &count, 4);
+
+    for (size_t index = 0; index < files; ++index) {
+        used += (size_t)snprintf((char *)buf + used, len - used, "peer%lu-file%lu.bin", (unsigned long)peer, (unsigned long)index) + 1;
+    }
+
+    return used;
+}
+
+void print_timing(size_t peers, size_t files, struct timing *timing) {
+    printf(
+        "%-8s %8lu %8lu %10lu %10.1f\n",
+        timing->name,
+        peers,
+        files,
+        timing->ops,
+        (double)timing->ns / timing->ops
+    );
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
@@ -0,0 +1,4134 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+// needed for memfd_create
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "trace.h"
+
+const uint8_t VERBOSE = 1;
+
+bool engine_init(struct server *server, size_t max_conn) {
+    server->max_conn = max_conn;
+    server->max_files = 10;
+    server->active_clients = 0;
+    server->next_slot = 0;
+    server->listen_sock = -1;
+    server->max_socket = 0;
+    server->repl_sock = -1;
+    server->repl_len = 0;
+    server->standbys = 0;
+    server->udp_sock = -1;
+    server->unix_sock = -1;
+    server->rings = 0;
+    server->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    server->backlog = SOMAXCONN;
+    server->now = clock_ms();
+    server->rate = 0;
+    server->burst = 0;
+    server->slice = DEFAULT_SLICE;
+    server->grace = DEFAULT_RESUME_GRACE * 1000;
+    server->seed = 0;
+    server->deferred = 0;
+    server->timers = NULL;
+    server->timers_len = 0;
+    server->timers_cap = 0;
+    server->watches = NULL;
+    server->watches_cap = 0;
+    server->watches_len = 0;
+    server->ranked = false;
+    server->localities = NULL;
+    server->localities_len = 0;
+    server->sites = NULL;
+    server->sites_len = 0;
+    server->stats.hot_len = 0;
+    server->stats.decayed_at = server->now;
+    server->lag = 0;
+    server->queue_depth = 0;
+    server->max_lag = DEFAULT_MAX_LAG * 1000;
+    server->max_queue = 0;
+    server->shedding = false;
+    server->shed = 0;
+    server->mem = 0;
+    server->max_mem = 0;
+    server->client_mem = 0;
+    server->listing = 0;
+    server->backlogged = 0;
+    server->capture = NULL;
+    server->capture_len = 0;
+    server->capture_cap = 0;
+    server->record = NULL;
+    server->recorded_at = 0;
+    server->conns = 0;
+    server->woke_at = 0;
+
+    memset(server->prefix_watches, 0, sizeof(server->prefix_watches));
+    memset(server->stats.sketch, 0, sizeof(server->stats.sketch));
+
+    server->clients = calloc(sizeof(struct client), server->max_conn);
+    server->cold = calloc(sizeof(struct client_cold), server->max_conn);
+
+    if (server->clients == NULL || server->cold == NULL) {
+        srv_error(server, "failed allocation client connection data: %s\n", strerror(errno));
+
+        free(server->clients);
+        free(server->cold);
+
+        return false;
+    }
+
+    if (!id_map_init(&server->ids, server->max_conn) || !id_map_init(&server->mirror_ids, server->max_conn) || !id_map_init(&server->mirror_keys, server->max_conn) || !id_map_init(&server->tokens, server->max_conn)) {
+        srv_error(server, "failed allocation id maps: %s\n", strerror(errno));
+
+        id_map_free(&server->ids);
+        id_map_free(&server->mirror_ids);
+        id_map_free(&server->mirror_keys);
+        id_map_free(&server->tokens);
+        free(server->clients);
+        free(server->cold);
+
+        return false;
+    }
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        server->clients[index].cold = &server->cold[index];
+        server->clients[index].active = 0;
+        server->clients[index].id = 0;
+        server->clients[index].sock = 0;
+        server->clients[index].files_len = 0;
+        server->clients[index].files = NULL;
+        server->clients[index].cold->meta = NULL;
+        server->clients[index].cold->origin = -1;
+        server->clients[index].ring = NULL;
+        server->clients[index].cold->in_buf = NULL;
+        server->clients[index].cold->in_len = 0;
+        server->clients[index].deferred = false;
+        server->clients[index].cold->ttl = 0;
+        server->clients[index].cold->expires = 0;
+        server->clients[index].cold->timer_at = 0;
+        server->clients[index].cold->watching = NULL;
+        server->clients[index].cold->watching_len = 0;
+        server->clients[index].listing = false;
+        server->clients[index].cold->out_buf = NULL;
+        server->clients[index].cold->mem = 0;
+        server->clients[index].cold->catalog_mem = 0;
+    }
+
+    for (size_t index = 0; index < FD_SETSIZE; ++index) {
+        server->by_sock[index] = NULL;
+    }
+
+    FD_ZERO(&server->all_socks);
+    FD_ZERO(&server->write_socks);
+
+    return true;
+}
+
+void engine_free(struct server *server) {
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        if (!server->clients[index].active) {
+            continue;
+        }
+
+        if (server->clients[index].cold->origin == -1 && server->clients[index].sock >= 0) {
+            close(server->clients[index].sock);
+        }
+
+        detach_ring(server, &server->clients[index]);
+        unwatch_all(server, &server->clients[index]);
+
+        clear_client(server, &server->clients[index]);
+    }
+
+    free(server->clients);
+    free(server->cold);
+    free(server->timers);
+    free(server->watches);
+
+    id_map_free(&server->ids);
+    id_map_free(&server->mirror_ids);
+    id_map_free(&server->mirror_keys);
+    id_map_free(&server->tokens);
+
+    free_localities(server);
+
+    if (server->record != NULL) {
+        fclose(server->record);
+        server->record = NULL;
+    }
+}
+
+struct client* engine_connect(struct server *server, int sock, const struct sockaddr *addr) {
+    struct client *client = NULL;
+
+    for (size_t tried = 0; tried < server->max_conn; ++tried) {
+        size_t index = (server->next_slot + tried) % server->max_conn;
+
+        if (!server->clients[index].active) {
+            client = &server->clients[index];
+            server->next_slot = (index + 1) % server->max_conn;
+            break;
+        }
+    }
+
+    if (client == NULL) {
+        return NULL;
+    }
+
+    uint8_t *in_buf = malloc(BUFF_SIZE);
+
+    if (in_buf == NULL) {
+        return NULL;
+    }
+
+    client->active = true;
+    client->sock = sock;
+    client->cold->addr = *addr;
+    client->cold->site = locate_site(server, &client->cold->addr);
+    client->cold->in_buf = in_buf;
+    client->cold->in_len = 0;
+    mem_charge(server, client, BUFF_SIZE);
+    client->cold->tokens = server->burst;
+    client->cold->refilled_at = server->now;
+    client->deferred = false;
+    client->cold->conn = ++server->conns;
+    server->active_clients += 1;
+
+    TRACE2(client_connect, client->cold->conn, sock);
+
+    if (sock >= 0) {
+        server->by_sock[sock] = client;
+
+        FD_SET(sock, &server->all_socks);
+
+        if (sock > server->max_socket) {
+            server->max_socket = sock;
+        }
+    }
+
+    return client;
+}
+
+size_t engine_feed(struct server *server, struct client *client, const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    server->capture = out;
+    server->capture_len = 0;
+    server->capture_cap = cap;
+
+    size_t offset = 0;
+
+    while (client->active) {
+        size_t room = BUFF_SIZE - client->cold->in_len;
+        size_t chunk = len - offset < room ? len - offset : room;
+
+        memcpy(client->cold->in_buf + client->cold->in_len, in + offset, chunk);
+
+        client->cold->in_len += chunk;
+        offset += chunk;
+
+        size_t buffered = client->cold->in_len;
+        size_t handled = process_client(server, client);
+        bool listed = false;
+
+        // the socket would be polled for room between pages, here the whole
+        // listing goes out before the requests behind it are looked at
+        while (client->active && client->listing) {
+            list_client(server, client);
+            listed = true;
+        }
+
+        // nothing left to hand over, or the rate limit is holding the rest
+        // back until the next call
+        if (offset == len && handled == 0 && !listed && client->cold->in_len == buffered) {
+            break;
+        }
+    }
+
+    server->capture = NULL;
+
+    return server->capture_len;
+}
+
+void engine_tick(struct server *server, uint64_t now) {
+    server->now = now;
+
+    if (server->timers_len > 0) {
+        expire_catalogs(server);
+    }
+
+    // clients that still had requests waiting from the last iteration go
+    // first, each one only gets a slice so nobody can hold up the loop
+    if (server->deferred > 0) {
+        run_deferred(server);
+    }
+}
+
+void srv_log(struct server* server, const char* format, ...) {
+    if (server->output_type == NO_LOG) {
+        return;
+    }
+
+    va_list ap;
+
+    va_start(ap, format);
+
+    vfprintf(server->output, format, ap);
+
+    va_end(ap);
+
+    if (server->output_type == FILE_LOG) {
+        fflush(server->output);
+    }
+}
+
+void srv_info(struct server* server, const char* format, ...) {
+    if (server->output_type == NO_LOG) {
+        return;
+    }
+
+    va_list ap;
+
+    va_start(ap, format);
+
+    fprintf(server->output, "[INFO] ");
+    vfprintf(server->output, format, ap);
+
+    va_end(ap);
+
+    if (server->output_type == FILE_LOG) {
+        fflush(server->output);
+    }
+}
+
+void srv_warn(struct server* server, const char* format, ...) {
+    if (server->output_type == NO_LOG) {
+        return;
+    }
+
+    va_list ap;
+
+    va_start(ap, format);
+
+    fprintf(server->output, "[WARN] ");
+    vfprintf(server->output, format, ap);
+
+    va_end(ap);
+
+    if (server->output_type == FILE_LOG) {
+        fflush(server->output);
+    }
+}
+
+void srv_error(struct server* server, const char* format, ...) {
+    if (server->output_type == NO_LOG) {
+        return;
+    }
+
+    va_list ap;
+
+    va_start(ap, format);
+
+    fprintf(server->output, "[ERROR] ");
+    vfprintf(server->output, format, ap);
+
+    va_end(ap);
+
+    if (server->output_type == FILE_LOG) {
+        fflush(server->output);
+    }
+}
+
+void srv_debug(struct server* server, const char* format, ...) {
+    if (server->output_type == NO_LOG) {
+        return;
+    }
+
+    va_list ap;
+
+    va_start(ap, format);
+
+    fprintf(server->output, "[DEBUG] ");
+    vfprintf(server->output, format, ap);
+
+    va_end(ap);
+
+    if (server->output_type == FILE_LOG) {
+        fflush(server->output);
+    }
+}
+
+void clear_client_files(struct server *server, struct client *c) {
+    if (c->files != NULL) {
+        TRACE2(catalog_clear, c->id, c->files_len);
+    }
+
+    free(c->files);
+    free(c->cold->meta);
+
+    // avoid dangling pointers
+    c->files = NULL;
+    c->cold->meta = NULL;
+    c->cold->catalog_hash = 0;
+
+    mem_release(server, c, c->cold->catalog_mem);
+    c->cold->catalog_mem = 0;
+}
+
+void clear_client(struct server *server, struct client *c) {
+    clear_client_files(server, c);
+    free_buffers(server, c);
+
+    c->listing = false;
+
+    c->active = false;
+    c->id = 0;
+    memset(c->cold->found, 0, SEARCH_RESPONSE_SIZE);
+    c->cold->found_ip[0] = '\0';
+    c->type = CLIENT_UNKNOWN;
+    c->sock = 0;
+    c->files_len = 0;
+    c->cold->origin = -1;
+    c->cold->ttl = 0;
+    c->cold->expires = 0;
+    c->cold->token = 0;
+    c->parked = false;
+}
+
+void mem_charge(struct server *server, struct client *client, size_t bytes) {
+    client->cold->mem += bytes;
+    server->mem += bytes;
+}
+
+void mem_release(struct server *server, struct client *client, size_t bytes) {
+    client->cold->mem -= bytes;
+    server->mem -= bytes;
+}
+
+void free_buffers(struct server *server, struct client *client) {
+    if (client->cold->in_buf != NULL) {
+        mem_release(server, client, BUFF_SIZE);
+    }
+
+    if (client->cold->out_buf != NULL) {
+        mem_release(server, client, LIST_PAGE_SIZE);
+    }
+
+    if (client->cold->pending != NULL) {
+        mem_release(server, client, client->cold->pending_cap);
+    }
+
+    if (client->cold->pending_len > 0 && client->type != CLIENT_STANDBY) {
+        // notifications the watcher never took
+        server->backlogged -= 1;
+
+        if (client->sock >= 0) {
+            FD_CLR(client->sock, &server->write_socks);
+        }
+    }
+
+    free(client->cold->in_buf);
+    free(client->cold->out_buf);
+    free(client->cold->pending);
+
+    client->cold->in_buf = NULL;
+    client->cold->in_len = 0;
+    client->cold->out_buf = NULL;
+    client->cold->out_len = 0;
+    client->cold->out_sent = 0;
+    client->cold->pending = NULL;
+    client->cold->pending_len = 0;
+    client->cold->pending_sent = 0;
+    client->cold->pending_cap = 0;
+    client->cold->resync = false;
+}
+
+size_t catalog_size(const uint8_t *files, struct file_meta *meta, size_t files_len) {
+    size_t size = 0;
+
+    // the names are laid out in sorted order so the last one ends the
+    // allocation
+    if (files_len > 0) {
+        size = ((const uint32_t *)files)[files_len - 1] + 2 + catalog_name_len(files, files_len - 1) + 1;
+    }
+
+    if (meta != NULL) {
+        size += sizeof(struct file_meta) * files_len;
+    }
+
+    return size;
+}
+
+bool admit_catalog(struct server *server, struct client *client, size_t size) {
+    if (server->client_mem != 0 && client->cold->mem - client->cold->catalog_mem + size > server->client_mem) {
+        srv_warn(server, "admit_catalog: client %u would use %lu bytes, limit is %lu\n", client->id, client->cold->mem - client->cold->catalog_mem + size, server->client_mem);
+        return false;
+    }
+
+    while (server->max_mem != 0 && server->mem - client->cold->catalog_mem + size > server->max_mem) {
+        // sessions that have not come back are the cheapest to lose, the
+        // one closest to giving up goes first
+        struct client *victim = NULL;
+
+        for (size_t index = 0; index < server->max_conn; ++index) {
+            struct client *c = &server->clients[index];
+
+            if (c->active && c->parked && (victim == NULL || c->cold->expires < victim->cold->expires)) {
+                victim = c;
+            }
+        }
+
+        if (victim == NULL) {
+            srv_warn(server, "admit_catalog: server is using %lu of %lu bytes, rejecting catalog of client %u\n", server->mem, server->max_mem, client->id);
+            return false;
+        }
+
+        srv_warn(server, "admit_catalog: evicting parked client %u. bytes: %lu\n", victim->id, victim->cold->mem);
+
+        release_parked(server, victim);
+    }
+
+    return true;
+}
+
+uint8_t* pack_catalog(struct server *server, const char **names, struct file_meta *meta, size_t files_len) {
+    struct packing *order = malloc(sizeof(struct packing) * files_len);
+    size_t size = sizeof(uint32_t) * files_len;
+
+    if (order == NULL && files_len != 0) {
+        srv_error(server, "pack_catalog: failed allocating sort order\n");
+        return NULL;
+    }
+
+    for (size_t index = 0; index < files_len; ++index) {
+        order[index].name = names[index];
+        order[index].index = index;
+
+        size += 2 + strlen(names[index]) + 1;
+    }
+
+    qsort(order, files_len, sizeof(struct packing), compare_packing);
+
+    // an empty catalog still gets an allocation so that it is told apart
+    // from having none
+    uint8_t *files = malloc(size > 0 ? size : 1);
+    struct file_meta *sorted = meta != NULL && files_len != 0 ? malloc(sizeof(struct file_meta) * files_len) : NULL;
+
+    if (files == NULL || (meta != NULL && files_len != 0 && sorted == NULL)) {
+        srv_error(server, "pack_catalog: failed allocating catalog\n");
+
+        free(order);
+        free(files);
+        free(sorted);
+
+        return NULL;
+    }
+
+    uint32_t *offsets = (uint32_t *)files;
+    size_t used = sizeof(uint32_t) * files_len;
+
+    for (size_t index = 0; index < files_len; ++index) {
+        // names are limited by the size of a request so they fit in 2 bytes
+        uint16_t len = (uint16_t)strlen(order[index].name);
+
+        offsets[index] = (uint32_t)used;
+
+        memcpy(files + used, &len, 2);
+        memcpy(files + used + 2, order[index].name, len + 1);
+
+        used += 2 + len + 1;
+
+        if (sorted != NULL) {
+            sorted[index] = meta[order[index].index];
+        }
+    }
+
+    if (sorted != NULL) {
+        memcpy(meta, sorted, sizeof(struct file_meta) * files_len);
+    }
+
+    free(sorted);
+    free(order);
+
+    return files;
+}
+
+int compare_packing(const void *a, const void *b) {
+    const struct packing *x = a;
+    const struct packing *y = b;
+    int cmp = strcmp(x->name, y->name);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+const char* catalog_name(const uint8_t *files, size_t index) {
+    return (const char *)files + ((const uint32_t *)files)[index] + 2;
+}
+
+size_t catalog_name_len(const uint8_t *files, size_t index) {
+    uint16_t len = 0;
+
+    memcpy(&len, files + ((const uint32_t *)files)[index], 2);
+
+    return len;
+}
+
+size_t catalog_lower_bound(const uint8_t *files, size_t files_len, const char *name, size_t len) {
+    size_t low = 0;
+    size_t high = files_len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t mid_len = catalog_name_len(files, mid);
+        int cmp = memcmp(catalog_name(files, mid), name, mid_len < len ? mid_len : len);
+
+        if (cmp < 0 || (cmp == 0 && mid_len < len)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+void free_catalog(uint8_t *files, struct file_meta *meta) {
+    free(files);
+    free(meta);
+}
+
+void move_catalog(struct server *server, struct client *from, struct client *to) {
+    clear_client_files(server, to);
+
+    to->files = from->files;
+    to->cold->meta = from->cold->meta;
+    to->files_len = from->files_len;
+    to->cold->catalog_hash = from->cold->catalog_hash;
+    to->cold->catalog_mem = from->cold->catalog_mem;
+
+    mem_release(server, from, from->cold->catalog_mem);
+    mem_charge(server, to, from->cold->catalog_mem);
+
+    from->files = NULL;
+    from->cold->meta = NULL;
+    from->files_len = 0;
+    from->cold->catalog_hash = 0;
+    from->cold->catalog_mem = 0;
+}
+
+void close_server_output(struct server* s) {
+    if (s->output_type != FILE_LOG) {
+        return;
+    }
+
+    if (fclose(s->output) != 0) {
+        perror("[server] failed to close output file");
+    }
+}
+
+void close_client(struct server *server, struct client *client) {
+    srv_info(server, "client: %d closing\n", client->sock);
+
+    TRACE2(client_close, client->cold->conn, client->sock);
+
+    if (client->sock >= 0) {
+        close(client->sock);
+
+        FD_CLR(client->sock, &server->all_socks);
+
+        server->by_sock[client->sock] = NULL;
+    }
+
+    if (client->deferred) {
+        server->deferred -= 1;
+    }
+
+    if (client->listing) {
+        end_listing(server, client);
+    }
+
+    detach_ring(server, client);
+    unwatch_all(server, client);
+
+    if (server->record != NULL) {
+        record_request(server, client->cold->conn, clock_us(), 0, NULL, 0);
+    }
+
+    if (client->type == CLIENT_STANDBY) {
+        remove_standby(server, client);
+    } else if (client->type == CLIENT_REGISTERED && client->cold->token != 0) {
+        park_client(server, client);
+        return;
+    } else if (client->type != CLIENT_UNKNOWN) {
+        id_map_remove(&server->ids, client->id, (size_t)(client - server->clients));
+
+        replicate_drop(server, client);
+    }
+
+    clear_client(server, client);
+    server->active_clients -= 1;
+}
+
+size_t process_client(struct server *server, struct client *client) {
+    size_t handled = 0;
+    bool more = false;
+
+    if (client->ring != NULL) {
+        handled = poll_ring(server, client);
+        more = shm_queue_peek(&client->ring->requests) != NULL;
+    } else {
+        // peers are free to send requests back to back so there can be more
+        // than one request, or only part of one, in what we have received
+        size_t offset = 0;
+
+        while (offset < client->cold->in_len) {
+            // requests that come in behind a LIST wait until all of its
+            // pages have been sent so the responses do not get mixed up
+            if (client->listing) {
+                more = true;
+                break;
+            }
+
+            ssize_t frame = frame_length(server, client->cold->in_buf + offset, client->cold->in_len - offset);
+
+            if (frame == 0) {
+                break;
+            }
+
+            if (frame < 0) {
+                // there is no way to find where the next request starts so
+                // everything that was received is dropped
+                srv_warn(server, "unknown command received from client: %u\n", client->cold->in_buf[offset]);
+
+                offset = client->cold->in_len;
+
+                break;
+            }
+
+            if (handled == server->slice || !take_token(server, client)) {
+                more = true;
+                break;
+            }
+
+            dispatch(server, client, client->cold->in_buf + offset, (size_t)frame);
+
+            // the client could have been closed while handling the request
+            if (!client->active) {
+                return handled + 1;
+            }
+
+            handled += 1;
+            offset += (size_t)frame;
+        }
+
+        if (offset == 0 && !more && client->cold->in_len == BUFF_SIZE) {
+            srv_warn(server, "client %d: request is larger than %d bytes\n", client->sock, BUFF_SIZE);
+
+            offset = client->cold->in_len;
+        }
+
+        memmove(client->cold->in_buf, client->cold->in_buf + offset, client->cold->in_len - offset);
+        client->cold->in_len -= offset;
+    }
+
+    if (more) {
+        defer_client(server, client);
+    } else if (client->deferred) {
+        resume_client(server, client);
+    }
+
+    return handled;
+}
+
+bool take_token(struct server *server, struct client *client) {
+    if (server->rate == 0) {
+        return true;
+    }
+
+    if (server->now > client->cold->refilled_at) {
+        client->cold->tokens += (double)(server->now - client->cold->refilled_at) * server->rate / 1000.0;
+
+        if (client->cold->tokens > server->burst) {
+            client->cold->tokens = server->burst;
+        }
+
+        client->cold->refilled_at = server->now;
+    }
+
+    if (client->cold->tokens < 1) {
+        return false;
+    }
+
+    client->cold->tokens -= 1;
+
+    return true;
+}
+
+void defer_client(struct server *server, struct client *client) {
+    if (client->deferred) {
+        return;
+    }
+
+    srv_info(server, "client %d: deferring waiting requests\n", client->sock);
+
+    client->deferred = true;
+    server->deferred += 1;
+
+    // ring clients keep their socket in the set since it is only used as a
+    // doorbell and to notice when they go away
+    if (client->ring == NULL && client->sock >= 0) {
+        FD_CLR(client->sock, &server->all_socks);
+    }
+}
+
+void resume_client(struct server *server, struct client *client) {
+    client->deferred = false;
+    server->deferred -= 1;
+
+    if (client->ring == NULL && client->sock >= 0) {
+        FD_SET(client->sock, &server->all_socks);
+    }
+}
+
+void run_deferred(struct server *server) {
+    for (size_t index = 0; index < server->max_conn && server->deferred > 0; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (c->active && c->deferred) {
+            process_client(server, c);
+        }
+    }
+}
+
+uint64_t clock_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t clock_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void update_load(struct server *server, uint64_t round, size_t depth) {
+    server->lag += ((double)round - server->lag) * LAG_WEIGHT;
+    server->queue_depth += ((double)depth - server->queue_depth) * LAG_WEIGHT;
+
+    bool lagging = server->max_lag != 0 && server->lag > (double)server->max_lag;
+    bool queued = server->max_queue != 0 && server->queue_depth > (double)server->max_queue;
+
+    if (!server->shedding && (lagging || queued)) {
+        srv_warn(server, "update_load: overloaded, shedding publishes. lag: %.0fus queue: %.1f\n", server->lag, server->queue_depth);
+
+        server->shedding = true;
+    } else if (server->shedding) {
+        // only stop once well under the limits so the mode does not flap
+        bool calm_lag = server->max_lag == 0 || server->lag < (double)server->max_lag / 2;
+        bool calm_queue = server->max_queue == 0 || server->queue_depth < (double)server->max_queue / 2;
+
+        if (calm_lag && calm_queue) {
+            srv_warn(server, "update_load: load back to normal. shed %lu publishes\n", server->shed);
+
+            server->shedding = false;
+        }
+    }
+}
+
+bool shed_request(struct server *server, struct client *client, uint8_t action) {
+    uint8_t response[9] = {0};
+    size_t response_len = 0;
+
+    // a plain publish has no response, so dropping it would leave the peer
+    // thinking its catalog was stored. those are always handled
+    switch (action) {
+    case ACTION_REGISTER:
+        response[0] = REGISTER_BUSY;
+        response_len = 9;
+        break;
+    case ACTION_PUBLISH_IF:
+        response[0] = CATALOG_BUSY;
+        response_len = 1;
+        break;
+    default:
+        return false;
+    }
+
+    server->shed += 1;
+
+    srv_debug(server, "shed_request: shed action %u from client %d\n", action, client->sock);
+
+    if (client_send(server, client, response, response_len) != 0) {
+        srv_error(server, "shed_request: error sending response: %s\n", strerror(errno));
+    }
+
+    return true;
+}
+
+ssize_t frame_length(struct server *server, const uint8_t *buffer, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+
+    switch (buffer[0]) {
+    case ACTION_JOIN:
+        return len >= 5 ? 5 : 0;
+    case ACTION_PUBLISH:
+        return names_length(buffer, len, 1, 0);
+    case ACTION_PUBLISH_TTL:
+        return names_length(buffer, len, 5, 0);
+    case ACTION_PUBLISH_META:
+        return names_length(buffer, len, 1, META_SIZE);
+    case ACTION_PUBLISH_META_TTL:
+        return names_length(buffer, len, 5, META_SIZE);
+    case ACTION_SEARCH:
+    case ACTION_SEARCH_META: {
+        const uint8_t *end = memchr(buffer + 1, 0, len - 1);
+
+        if (end == NULL) {
+            return len >= BUFF_SIZE ? -1 : 0;
+        }
+
+        return end - buffer + 1;
+    }
+    case ACTION_WATCH:
+    case ACTION_UNWATCH: {
+        const uint8_t *end = len > 2 ? memchr(buffer + 2, 0, len - 2) : NULL;
+
+        if (end == NULL) {
+            return len >= BUFF_SIZE ? -1 : 0;
+        }
+
+        return end - buffer + 1;
+    }
+    case ACTION_REPLICATE:
+    case ACTION_SHM_ATTACH:
+    case ACTION_HEARTBEAT:
+    case ACTION_STATS:
+        return 1;
+    case ACTION_LIST:
+    case ACTION_RESUME:
+        return len >= 9 ? 9 : 0;
+    case ACTION_PUBLISH_FC:
+        return front_coded_length(buffer, len, 5);
+    case ACTION_REGISTER:
+        return names_length(buffer, len, 5, 0);
+    case ACTION_PUBLISH_IF:
+        return len >= 13 ? 13 : 0;
+    default:
+        return -1;
+    }
+}
+
+ssize_t front_coded_length(const uint8_t *buffer, size_t len, size_t start) {
+    if (len < start + 4) {
+        return len >= BUFF_SIZE ? -1 : 0;
+    }
+
+    uint32_t count = 0;
+
+    memcpy(&count, buffer + start, 4);
+    count = ntohl(count);
+
+    size_t index = start + 4;
+
+    for (uint32_t found = 0; found < count; ++found) {
+        if (index + 2 > len || index + 2 + buffer[index + 1] > len) {
+            return len >= BUFF_SIZE ? -1 : 0;
+        }
+
+        index += 2 + buffer[index + 1];
+    }
+
+    return (ssize_t)index;
+}
+
+ssize_t names_length(const uint8_t *buffer, size_t len, size_t start, size_t fixed) {
+    if (len < start + 4) {
+        return len >= BUFF_SIZE ? -1 : 0;
+    }
+
+    uint32_t count = 0;
+
+    memcpy(&count, buffer + start, 4);
+    count = ntohl(count);
+
+    // the request is rejected later on if the count is too large but we
+    // still need to know where it ends. anything that does not fit in the
+    // buffer can not be found
+    size_t index = start + 4;
+
+    for (uint32_t found = 0; found < count; ++found) {
+        // the metadata can contain zeros so it is skipped before looking
+        // for the end of the name
+        const uint8_t *end = NULL;
+
+        if (index + fixed < len) {
+            end = memchr(buffer + index + fixed, 0, len - index - fixed);
+        }
+
+        if (end == NULL) {
+            return len >= BUFF_SIZE ? -1 : 0;
+        }
+
+        index = end - buffer + 1;
+    }
+
+    return (ssize_t)index;
+}
+
+void dispatch(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    // the handlers are free to change the buffer and to close the client
+    uint32_t conn = client->cold->conn;
+    uint8_t action = len > 0 ? buffer[0] : 0;
+
+    TRACE3(request_start, conn, action, len);
+
+    if (server->record == NULL || len == 0 || len > BUFF_SIZE) {
+        handle_request(server, client, buffer, len);
+    } else {
+        uint8_t request[BUFF_SIZE];
+        uint64_t started = clock_us();
+
+        memcpy(request, buffer, len);
+
+        handle_request(server, client, buffer, len);
+
+        // requests handed over without the loop, see engine_feed, only count
+        // their own time
+        uint64_t picked_up = server->woke_at == 0 || server->woke_at > started ? started : server->woke_at;
+
+        record_request(server, conn, started, clock_us() - picked_up, request, len);
+    }
+
+    TRACE2(request_done, conn, action);
+}
+
+void record_request(struct server *server, uint32_t conn, uint64_t at, uint64_t latency, const uint8_t *buffer, size_t len) {
+    uint64_t since = server->recorded_at == 0 || at < server->recorded_at ? 0 : at - server->recorded_at;
+    uint8_t header[RECORD_HEADER_SIZE];
+    uint32_t net_since = htonl(since > UINT32_MAX ? UINT32_MAX : (uint32_t)since);
+    uint32_t net_conn = htonl(conn);
+    uint32_t net_latency = htonl(latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+    uint16_t net_len = htons((uint16_t)len);
+
+    server->recorded_at = at;
+
+    memcpy(header, &net_since, 4);
+    memcpy(header + 4, &net_conn, 4);
+    memcpy(header + 8, &net_latency, 4);
+    memcpy(header + 12, &net_len, 2);
+
+    if (fwrite(header, 1, sizeof(header), server->record) != sizeof(header) ||
+        (len > 0 && fwrite(buffer, 1, len, server->record) != len)) {
+        srv_error(server, "record_request: failed writing the recording, stopping: %s\n", strerror(errno));
+
+        fclose(server->record);
+        server->record = NULL;
+    }
+}
+
+void handle_request(struct server *server, struct client *client, uint8_t *recv_buffer, size_t read) {
+    if (server->output_type != NO_LOG) {
+        srv_debug(server, "client %d data:\n", client->sock);
+
+        print_buffer(server->output, recv_buffer, read, VERBOSE);
+    }
+
+    if (read == 0) {
+        return;
+    }
+
+    // the request is already framed so it costs nothing to skip it
+    if (server->shedding && shed_request(server, client, recv_buffer[0])) {
+        return;
+    }
+
+    switch (recv_buffer[0]) {
+    case ACTION_JOIN:
+        handle_join(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_PUBLISH:
+    case ACTION_PUBLISH_META:
+        if (handle_publish(server, client, recv_buffer + 1, (size_t)read - 1, recv_buffer[0] == ACTION_PUBLISH_META)) {
+            // a plain publish does not expire
+            set_ttl(server, client, 0);
+        }
+        break;
+    case ACTION_PUBLISH_TTL:
+    case ACTION_PUBLISH_META_TTL:
+        handle_publish_ttl(server, client, recv_buffer + 1, (size_t)read - 1, recv_buffer[0] == ACTION_PUBLISH_META_TTL);
+        break;
+    case ACTION_HEARTBEAT:
+        handle_heartbeat(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_SEARCH:
+        handle_search(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_SEARCH_META:
+        handle_search_meta(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_WATCH:
+    case ACTION_UNWATCH:
+        handle_watch(server, client, recv_buffer + 1, (size_t)read - 1, recv_buffer[0] == ACTION_WATCH);
+        break;
+    case ACTION_LIST:
+        handle_list(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_PUBLISH_FC:
+        handle_publish_fc(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_REGISTER:
+        handle_register(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_RESUME:
+        handle_resume(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_PUBLISH_IF:
+        handle_publish_if(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_STATS:
+        handle_stats(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_REPLICATE:
+        handle_replicate(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    case ACTION_SHM_ATTACH:
+        handle_shm_attach(server, client, recv_buffer + 1, (size_t)read - 1);
+        break;
+    default:
+        srv_warn(server, "unknown command received from client: %u\n", recv_buffer[0]);
+        break;
+    }
+}
+
+int client_send(struct server *server, struct client *client, const uint8_t *buf, size_t len) {
+    if (client->sock == -1) {
+        // an in-memory client, the response goes to the caller of
+        // engine_feed
+        if (server->capture == NULL || server->capture_cap - server->capture_len < len) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        memcpy(server->capture + server->capture_len, buf, len);
+        server->capture_len += len;
+
+        return 0;
+    }
+
+    if (client->ring == NULL) {
+        // the response has to wait behind the notifications the client has
+        // not taken yet
+        if (client->cold->pending_len > 0) {
+            return queue_pending(server, client, buf, len);
+        }
+
+        return send_bytes(client->sock, buf, len);
+    }
+
+    // poll_ring does not take a request unless there is room for its
+    // response so this only fails if the response is too large
+    if (!shm_queue_push(&client->ring->responses, buf, len)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return 0;
+}
+
+void handle_shm_attach(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->cold->addr.sa_family != AF_UNIX) {
+        srv_warn(server, "handle_shm_attach: client is not connected over the unix socket\n");
+        return;
+    }
+
+    if (client->ring != NULL) {
+        srv_warn(server, "handle_shm_attach: client already has a ring\n");
+        return;
+    }
+
+    int fd = memfd_create("registry-ring", MFD_CLOEXEC);
+
+    if (fd == -1) {
+        srv_error(server, "handle_shm_attach: memfd_create: %s\n", strerror(errno));
+        return;
+    }
+
+    if (ftruncate(fd, sizeof(struct shm_ring)) != 0) {
+        srv_error(server, "handle_shm_attach: ftruncate: %s\n", strerror(errno));
+
+        close(fd);
+
+        return;
+    }
+
+    struct shm_ring *ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (ring == MAP_FAILED) {
+        srv_error(server, "handle_shm_attach: mmap: %s\n", strerror(errno));
+
+        close(fd);
+
+        return;
+    }
+
+    // the memfd is already zeroed which is a valid empty ring. the response
+    // is a single ACTION_SHM_ATTACH byte carrying the fd
+    uint8_t ack = ACTION_SHM_ATTACH;
+    struct iovec iov = { .iov_base = &ack, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(client->sock, &msg, 0) != 1) {
+        srv_error(server, "handle_shm_attach: sendmsg: %s\n", strerror(errno));
+
+        munmap(ring, sizeof(struct shm_ring));
+        close(fd);
+
+        return;
+    }
+
+    // the mapping stays valid after the fd is closed
+    close(fd);
+
+    client->ring = ring;
+    server->rings += 1;
+
+    mem_charge(server, client, sizeof(struct shm_ring));
+
+    srv_info(server, "handle_shm_attach: client %d attached a ring\n", client->sock);
+}
+
+void detach_ring(struct server *server, struct client *client) {
+    if (client->ring == NULL) {
+        return;
+    }
+
+    munmap(client->ring, sizeof(struct shm_ring));
+    mem_release(server, client, sizeof(struct shm_ring));
+
+    client->ring = NULL;
+    server->rings -= 1;
+}
+
+size_t poll_ring(struct server *server, struct client *client) {
+    size_t handled = 0;
+
+    while (handled < server->slice && !shm_queue_full(&client->ring->responses)) {
+        struct shm_slot *slot = shm_queue_peek(&client->ring->requests);
+
+        if (slot == NULL || !take_token(server, client)) {
+            break;
+        }
+
+        // the peer owns the memory so the request is copied out before it
+        // is handled, otherwise it could change what we already validated
+        uint8_t request[SHM_SLOT_SIZE];
+        size_t len = slot->len > SHM_SLOT_SIZE ? SHM_SLOT_SIZE : slot->len;
+
+        memcpy(request, slot->data, len);
+
+        shm_queue_pop(&client->ring->requests);
+
+        dispatch(server, client, request, len);
+
+        handled += 1;
+    }
+
+    return handled;
+}
+
+void handle_join(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (len != 4) {
+        srv_warn(server, "handle_join: bytes received is not 4\n");
+        return;
+    }
+
+    uint32_t received_id = 0;
+
+    memcpy(&received_id, buffer, 4);
+    received_id = ntohl(received_id);
+
+    join_client(server, client, received_id);
+}
+
+void handle_register(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    uint8_t status = REGISTER_INVALID;
+
+    if (len < 8) {
+        srv_warn(server, "handle_register: too few bytes received\n");
+    } else {
+        uint32_t received_id = 0;
+
+        memcpy(&received_id, buffer, 4);
+        received_id = ntohl(received_id);
+
+        status = join_client(server, client, received_id);
+
+        // the peer is left joined if only its catalog was invalid, the same
+        // as if it had sent a JOIN and a bad PUBLISH
+        if (status == REGISTER_OK && !handle_publish(server, client, buffer + 4, len - 4, false)) {
+            status = REGISTER_INVALID;
+        }
+
+        if (status == REGISTER_OK) {
+            client->type = CLIENT_REGISTERED;
+
+            set_ttl(server, client, 0);
+            issue_token(server, client);
+        }
+    }
+
+    send_session(server, client, status);
+}
+
+void send_session(struct server *server, struct client *client, uint8_t status) {
+    uint8_t response[9];
+    uint64_t token = htobe64(status == REGISTER_OK ? client->cold->token : 0);
+
+    response[0] = status;
+    memcpy(response + 1, &token, 8);
+
+    if (client_send(server, client, response, sizeof(response)) != 0) {
+        srv_error(server, "send_session: error sending response: %s\n", strerror(errno));
+    }
+}
+
+void issue_token(struct server *server, struct client *client) {
+    if (server->grace == 0 || client->cold->token != 0) {
+        return;
+    }
+
+    uint64_t token = 0;
+
+    // 0 means no token, anything already handed out is drawn again
+    while (token == 0 || id_map_get(&server->tokens, token) >= 0) {
+        if (server->seed != 0) {
+            server->seed ^= server->seed << 13;
+            server->seed ^= server->seed >> 7;
+            server->seed ^= server->seed << 17;
+
+            token = server->seed;
+        } else if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            srv_error(server, "issue_token: getrandom: %s\n", strerror(errno));
+            return;
+        }
+    }
+
+    client->cold->token = token;
+
+    id_map_put(&server->tokens, token, (size_t)(client - server->clients));
+}
+
+void handle_resume(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (len < 8) {
+        srv_warn(server, "handle_resume: too few bytes received\n");
+        send_session(server, client, REGISTER_INVALID);
+        return;
+    }
+
+    if (client->type != CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_resume: client already joined as %u\n", client->id);
+        send_session(server, client, REGISTER_INVALID);
+        return;
+    }
+
+    uint64_t token = 0;
+
+    memcpy(&token, buffer, 8);
+    token = be64toh(token);
+
+    ssize_t slot = token == 0 ? -1 : id_map_get(&server->tokens, token);
+
+    if (slot < 0) {
+        srv_warn(server, "handle_resume: unknown token\n");
+        send_session(server, client, REGISTER_UNKNOWN_TOKEN);
+        return;
+    }
+
+    struct client *old = &server->clients[slot];
+
+    // the peer noticed the drop before we did, its old connection is only
+    // waiting for a timeout
+    if (!old->parked) {
+        close_client(server, old);
+    }
+
+    srv_info(server, "handle_resume: client %u resumed. files: %lu\n", old->id, old->files_len);
+
+    if (TEST_OUTPUT) {
+        printf("TEST] RESUME %u\n", old->id);
+    }
+
+    size_t index = (size_t)(client - server->clients);
+    uint32_t ttl = old->cold->ttl;
+
+    set_client_id(server, client, old->id);
+    client->type = CLIENT_REGISTERED;
+    client->cold->token = old->cold->token;
+    old->cold->token = 0;
+
+    move_catalog(server, old, client);
+
+    // the old slot is released after the maps point at the new one so it
+    // does not remove the new entries
+    id_map_put(&server->ids, client->id, index);
+    id_map_put(&server->tokens, client->cold->token, index);
+
+    release_parked(server, old);
+
+    replicate_join(server, client);
+
+    if (client->files_len != 0) {
+        uint8_t body[BUFF_SIZE];
+        size_t body_len = encode_catalog(client, body, sizeof(body));
+
+        replicate_publish(server, client, body, body_len);
+    }
+
+    // the ttl starts over as if the catalog had been published again
+    set_ttl(server, client, ttl);
+
+    send_session(server, client, REGISTER_OK);
+}
+
+void park_client(struct server *server, struct client *client) {
+    srv_info(server, "park_client: keeping catalog of client %u for %lu ms\n", client->id, server->grace);
+
+    free_buffers(server, client);
+
+    client->sock = -1;
+    client->deferred = false;
+    client->parked = true;
+
+    // the catalog still expires at its ttl if that comes first
+    uint64_t until = server->now + server->grace;
+
+    if (client->cold->expires == 0 || until < client->cold->expires) {
+        client->cold->expires = until;
+    }
+
+    schedule_expiry(server, client);
+}
+
+void release_parked(struct server *server, struct client *client) {
+    size_t slot = (size_t)(client - server->clients);
+
+    // mirrors parked by a promotion are only in the mirror maps
+    if (client->cold->origin >= 0) {
+        replicate_drop(server, client);
+        drop_mirror(server, client);
+        return;
+    }
+
+    id_map_remove(&server->ids, client->id, slot);
+
+    if (client->cold->token != 0) {
+        id_map_remove(&server->tokens, client->cold->token, slot);
+    }
+
+    replicate_drop(server, client);
+
+    clear_client(server, client);
+    server->active_clients -= 1;
+}
+
+void set_client_id(struct server *server, struct client *client, uint32_t id) {
+    client->id = id;
+
+    memset(client->cold->found, 0, SEARCH_RESPONSE_SIZE);
+    client->cold->found_ip[0] = '\0';
+
+    // since we do not care if the client connects with an v4 or v6 address
+    // the ones that are not v4 are left as not found
+    if (client->cold->addr.sa_family != AF_INET) {
+        srv_warn(server, "set_client_id: client %u is using non IPv4 address, it will not be returned by searches\n", id);
+        return;
+    }
+
+    struct sockaddr_in *v4 = (struct sockaddr_in *)&client->cold->addr;
+    uint32_t net_id = htonl(id);
+
+    memcpy(client->cold->found, &net_id, 4);
+    memcpy(client->cold->found + 4, &v4->sin_addr.s_addr, 4);
+    memcpy(client->cold->found + 8, &v4->sin_port, 2);
+
+    if (TEST_OUTPUT && get_ipv4_port(v4, client->cold->found_ip, IPLEN_AND_PORT, true) == NULL) {
+        srv_error(server, "set_client_id: failed to create ipv4 string from client: %s\n", strerror(errno));
+        client->cold->found_ip[0] = '\0';
+    }
+}
+
+uint8_t join_client(struct server *server, struct client *client, uint32_t received_id) {
+    srv_info(server, "handle_join: client joining registry. id: %u\n", received_id);
+
+    ssize_t existing = id_map_get(&server->ids, received_id);
+
+    // a peer that joins again instead of resuming gets a fresh catalog
+    if (existing >= 0 && server->clients[existing].parked) {
+        release_parked(server, &server->clients[existing]);
+        existing = -1;
+    }
+
+    if (existing == client - server->clients) {
+        srv_warn(server, "handle_join: client id already registered\n");
+        return REGISTER_INVALID;
+    }
+
+    if (existing >= 0) {
+        srv_warn(server, "handle_join: id %u is in use by another client\n", received_id);
+        return REGISTER_ID_IN_USE;
+    }
+
+    if (client->type != CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_join: client already joined as %u\n", client->id);
+        return REGISTER_INVALID;
+    }
+
+    char ip[IPLEN_AND_PORT];
+
+    if (get_ip_port(&client->cold->addr, ip, IPLEN_AND_PORT, true) == NULL) {
+        srv_error(server, "handle_join: failed to create ip string from client: %s\n", strerror(errno));
+        srv_info(server, "handle_join: client registered %u\n", received_id);
+    } else {
+        srv_info(server, "handle_join: client addr: %s -> %u\n", ip, received_id);
+    }
+
+    if (TEST_OUTPUT) {
+        printf("TEST] JOIN %u\n", received_id);
+    }
+
+    set_client_id(server, client, received_id);
+    client->type = CLIENT_JOINED;
+
+    id_map_put(&server->ids, received_id, (size_t)(client - server->clients));
+
+    // if the peer failed over from a primary that we were mirroring then it
+    // takes over the catalog that was already replicated so it does not
+    // have to publish again
+    ssize_t mirror = id_map_get(&server->mirror_ids, received_id);
+
+    if (mirror >= 0) {
+        struct client *m = &server->clients[mirror];
+
+        srv_info(server, "handle_join: adopting mirrored catalog. files: %lu\n", m->files_len);
+
+        move_catalog(server, m, client);
+
+        client->cold->ttl = m->cold->ttl;
+        client->cold->expires = m->cold->expires;
+
+        // a parked mirror's expiry is the end of its grace period, the ttl
+        // starts over as if the catalog had been published again
+        if (m->parked) {
+            client->cold->expires = m->cold->ttl == 0 ? 0 : server->now + (uint64_t)m->cold->ttl * 1000;
+        }
+
+        schedule_expiry(server, client);
+
+        drop_mirror(server, m);
+    }
+
+    replicate_join(server, client);
+
+    if (client->files_len != 0) {
+        // let any standby of this server know about the adopted catalog as
+        // well
+        uint8_t body[BUFF_SIZE];
+        size_t body_len = encode_catalog(client, body, sizeof(body));
+
+        replicate_publish(server, client, body, body_len);
+
+        if (client->cold->ttl != 0) {
+            replicate_ttl(server, client);
+        }
+    }
+
+    return REGISTER_OK;
+}
+
+bool handle_publish(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool meta) {
+    if (client->type == CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_publish: client has not joined or registered\n");
+        return false;
+    }
+
+    // the metadata does not count against the limit for the names
+    size_t max_len = 1199 + (meta ? META_SIZE * server->max_files : 0);
+
+    if (len >= max_len) {
+        srv_warn(server, "handle_publish: bytes received is greater than %lu\n", max_len + 1);
+        return false;
+    }
+
+    srv_info(server, "handle_publish: client %u publishing files\n", client->id);
+
+    uint8_t *files = NULL;
+    struct file_meta *file_meta = NULL;
+    size_t files_len = 0;
+
+    if (!parse_publish(server, buffer, len, &files, meta ? &file_meta : NULL, &files_len)) {
+        return false;
+    }
+
+    if (!admit_catalog(server, client, catalog_size(files, file_meta, files_len))) {
+        free_catalog(files, file_meta);
+        return false;
+    }
+
+    install_catalog(server, client, files, file_meta, files_len);
+
+    client->cold->catalog_hash = hash_catalog(buffer, len);
+
+    replicate_publish(server, client, buffer, len);
+    notify_watchers(server, client);
+
+    return true;
+}
+
+void handle_publish_fc(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->type == CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_publish_fc: client has not joined or registered\n");
+        return;
+    }
+
+    if (len >= 1199) {
+        srv_warn(server, "handle_publish_fc: bytes received is greater than 1200\n");
+        return;
+    }
+
+    if (len < 8) {
+        srv_warn(server, "handle_publish_fc: too few bytes received\n");
+        return;
+    }
+
+    uint32_t ttl = 0;
+
+    memcpy(&ttl, buffer, 4);
+    ttl = ntohl(ttl);
+
+    srv_info(server, "handle_publish_fc: client %u publishing files\n", client->id);
+
+    uint8_t *files = NULL;
+    size_t files_len = 0;
+
+    if (!parse_front_coded(server, buffer + 4, len - 4, &files, &files_len)) {
+        return;
+    }
+
+    if (!admit_catalog(server, client, catalog_size(files, NULL, files_len))) {
+        free_catalog(files, NULL);
+        return;
+    }
+
+    install_catalog(server, client, files, NULL, files_len);
+
+    client->cold->catalog_hash = hash_catalog(buffer + 4, len - 4);
+
+    // the standbys only know the plain encoding
+    uint8_t body[BUFF_SIZE];
+    size_t body_len = encode_catalog(client, body, sizeof(body));
+
+    replicate_publish(server, client, body, body_len);
+    notify_watchers(server, client);
+
+    set_ttl(server, client, ttl);
+}
+
+bool parse_front_coded(struct server *server, uint8_t *buffer, size_t len, uint8_t **files_out, size_t *files_len_out) {
+    uint32_t count = 0;
+
+    memcpy(&count, buffer, 4);
+    count = ntohl(count);
+
+    if (count > server->max_files) {
+        srv_warn(server, "handle_publish_fc: number of files is greater than max. given: %u\n", count);
+        return false;
+    }
+
+    // the first pass only reads the lengths. it checks every entry and
+    // sizes the catalog so the names can be written straight into it
+    uint8_t *p = buffer + 4;
+    uint8_t *end = buffer + len;
+    size_t size = sizeof(uint32_t) * count;
+    size_t prev_len = 0;
+    size_t decoded = 0;
+
+    for (; decoded < count; ++decoded) {
+        if (end - p < 2) {
+            srv_warn(server, "handle_publish_fc: body ends before entry %lu of %u\n", decoded, count);
+            break;
+        }
+
+        size_t shared = p[0];
+        size_t suffix = p[1];
+
+        // every name fits in the 8 bits of the shared length so the next
+        // name can always refer to all of it
+        if (shared > prev_len || shared + suffix > UINT8_MAX || (size_t)(end - p - 2) < suffix) {
+            srv_warn(server, "handle_publish_fc: invalid entry received from client\n");
+            break;
+        }
+
+        bool valid = true;
+
+        for (size_t check = 0; check < suffix; ++check) {
+            if (p[2 + check] == 0 || p[2 + check] >= 128) {
+                valid = false;
+                break;
+            }
+        }
+
+        if (!valid) {
+            srv_warn(server, "handle_publish_fc: invalid character received from client\n");
+            break;
+        }
+
+        size += 2 + shared + suffix + 1;
+        prev_len = shared + suffix;
+
+        p += 2 + suffix;
+    }
+
+    if (decoded < count) {
+        return false;
+    }
+
+    // same layout as pack_catalog, an empty catalog still gets an allocation
+    uint8_t *files = malloc(size > 0 ? size : 1);
+
+    if (files == NULL) {
+        srv_error(server, "handle_publish_fc: failed allocating catalog\n");
+        return false;
+    }
+
+    uint32_t *offsets = (uint32_t *)files;
+    size_t used = sizeof(uint32_t) * count;
+    // the name written before this one, it is already in the new catalog
+    const uint8_t *prev = NULL;
+    bool sorted = true;
+
+    p = buffer + 4;
+    prev_len = 0;
+
+    for (size_t index = 0; index < count; ++index) {
+        size_t shared = p[0];
+        size_t suffix = p[1];
+        uint16_t name_len = (uint16_t)(shared + suffix);
+        uint8_t *name = files + used + 2;
+
+        if (shared > 0) {
+            memcpy(name, prev, shared);
+        }
+
+        memcpy(name + shared, p + 2, suffix);
+        name[name_len] = 0;
+
+        memcpy(files + used, &name_len, 2);
+        offsets[index] = (uint32_t)used;
+
+        // senders sort the names to share the most, one that did not is
+        // sorted below
+        if (sorted && prev != NULL) {
+            int cmp = memcmp(prev, name, prev_len < name_len ? prev_len : name_len);
+
+            sorted = cmp < 0 || (cmp == 0 && prev_len <= name_len);
+        }
+
+        prev = name;
+        prev_len = name_len;
+        used += 2 + name_len + 1;
+
+        p += 2 + suffix;
+    }
+
+    if (!sorted) {
+        srv_info(server, "handle_publish_fc: names are not sorted, sorting them\n");
+
+        const char **names = malloc(sizeof(char *) * count);
+        uint8_t *packed = NULL;
+
+        if (names != NULL) {
+            for (size_t index = 0; index < count; ++index) {
+                names[index] = catalog_name(files, index);
+            }
+
+            packed = pack_catalog(server, names, NULL, count);
+        }
+
+        free(names);
+        free(files);
+
+        if (packed == NULL) {
+            srv_error(server, "handle_publish_fc: failed sorting catalog\n");
+            return false;
+        }
+
+        files = packed;
+    }
+
+    *files_out = files;
+    *files_len_out = count;
+
+    return true;
+}
+
+void install_catalog(struct server *server, struct client *client, uint8_t *files, struct file_meta *meta, size_t files_len) {
+    // on the off chance that they have already published files to the
+    // server we will attempt to clean up any previous files
+    clear_client_files(server, client);
+
+    client->files_len = files_len;
+    client->files = files;
+    client->cold->meta = meta;
+    client->cold->catalog_mem = catalog_size(files, meta, files_len);
+
+    mem_charge(server, client, client->cold->catalog_mem);
+
+    TRACE2(catalog_install, client->id, files_len);
+
+    srv_info(server, "handle_publish: published files\n");
+
+    for (size_t index = 0; index < client->files_len; ++index) {
+        if (client->cold->meta != NULL) {
+            srv_log(server, "    %s %lu %016lx\n", catalog_name(client->files, index), client->cold->meta[index].size, client->cold->meta[index].hash);
+        } else {
+            srv_log(server, "    %s\n", catalog_name(client->files, index));
+        }
+    }
+
+    if (TEST_OUTPUT) {
+        printf("TEST] PUBLISH %lu", client->files_len);
+
+        for (size_t index = 0; index < client->files_len; ++index) {
+            printf(" %s", catalog_name(client->files, index));
+        }
+
+        printf("\n");
+    }
+}
+
+void handle_publish_ttl(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool meta) {
+    if (len < 4) {
+        srv_warn(server, "handle_publish_ttl: too few bytes received\n");
+        return;
+    }
+
+    uint32_t ttl = 0;
+
+    memcpy(&ttl, buffer, 4);
+    ttl = ntohl(ttl);
+
+    if (handle_publish(server, client, buffer + 4, len - 4, meta)) {
+        srv_info(server, "handle_publish_ttl: catalog expires in %us\n", ttl);
+
+        set_ttl(server, client, ttl);
+    }
+}
+
+void handle_publish_if(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    uint8_t status = CATALOG_CHANGED;
+
+    if (client->type == CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_publish_if: client has not joined or registered\n");
+    } else if (len < 12) {
+        srv_warn(server, "handle_publish_if: too few bytes received\n");
+    } else {
+        uint32_t ttl = 0;
+        uint64_t hash = 0;
+
+        memcpy(&ttl, buffer, 4);
+        memcpy(&hash, buffer + 4, 8);
+        ttl = ntohl(ttl);
+        hash = be64toh(hash);
+
+        if (hash != 0 && hash == client->cold->catalog_hash) {
+            srv_info(server, "handle_publish_if: catalog of client %u unchanged\n", client->id);
+
+            // the same as publishing the catalog again, so the ttl starts
+            // over as well
+            set_ttl(server, client, ttl);
+
+            status = CATALOG_UNCHANGED;
+        }
+    }
+
+    if (client_send(server, client, &status, 1) != 0) {
+        srv_error(server, "handle_publish_if: error sending response: %s\n", strerror(errno));
+    }
+}
+
+uint64_t hash_catalog(const uint8_t *buffer, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t index = 0; index < len; ++index) {
+        hash ^= buffer[index];
+        hash *= 1099511628211ull;
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+void handle_heartbeat(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->cold->ttl == 0) {
+        srv_debug(server, "handle_heartbeat: client %u has no ttl\n", client->id);
+        return;
+    }
+
+    // the timer already in the heap picks up the new expiry when it fires so
+    // a heartbeat never touches the heap
+    client->cold->expires = server->now + (uint64_t)client->cold->ttl * 1000;
+
+    replicate_ttl(server, client);
+}
+
+void set_ttl(struct server *server, struct client *client, uint32_t ttl) {
+    if (ttl == 0 && client->cold->ttl == 0) {
+        return;
+    }
+
+    client->cold->ttl = ttl;
+    client->cold->expires = ttl == 0 ? 0 : server->now + (uint64_t)ttl * 1000;
+
+    schedule_expiry(server, client);
+
+    replicate_ttl(server, client);
+}
+
+void schedule_expiry(struct server *server, struct client *client) {
+    if (client->cold->expires == 0) {
+        return;
+    }
+
+    // a timer that fires before the expiry will reschedule itself so there
+    // is no need for another one
+    if (client->cold->timer_at != 0 && client->cold->timer_at <= client->cold->expires) {
+        return;
+    }
+
+    if (!timer_push(server, client->cold->expires, (size_t)(client - server->clients))) {
+        srv_error(server, "schedule_expiry: failed to allocate timer\n");
+        return;
+    }
+
+    client->cold->timer_at = client->cold->expires;
+}
+
+void expire_catalogs(struct server *server) {
+    while (server->timers_len > 0 && server->timers[0].at <= server->now) {
+        struct timer timer = timer_pop(server);
+        struct client *client = &server->clients[timer.slot];
+
+        // an earlier timer was pushed for the slot after this one
+        if (timer.at != client->cold->timer_at) {
+            continue;
+        }
+
+        client->cold->timer_at = 0;
+
+        if (!client->active || client->cold->expires == 0) {
+            continue;
+        }
+
+        if (client->cold->expires > server->now) {
+            // a heartbeat came in since the timer was pushed
+            schedule_expiry(server, client);
+            continue;
+        }
+
+        if (client->parked) {
+            srv_info(server, "expire_catalogs: client %u did not resume. files: %lu\n", client->id, client->files_len);
+
+            release_parked(server, client);
+            continue;
+        }
+
+        srv_info(server, "expire_catalogs: catalog of client %u expired. files: %lu\n", client->id, client->files_len);
+
+        clear_client_files(server, client);
+
+        client->files_len = 0;
+        client->cold->ttl = 0;
+        client->cold->expires = 0;
+
+        // an empty publish clears the catalog on the standby as well
+        uint8_t empty[4] = {0};
+
+        replicate_publish(server, client, empty, sizeof(empty));
+    }
+}
+
+bool timer_push(struct server *server, uint64_t at, size_t slot) {
+    if (server->timers_len == server->timers_cap) {
+        size_t cap = server->timers_cap == 0 ? 64 : server->timers_cap * 2;
+        struct timer *timers = realloc(server->timers, sizeof(struct timer) * cap);
+
+        if (timers == NULL) {
+            return false;
+        }
+
+        server->timers = timers;
+        server->timers_cap = cap;
+    }
+
+    size_t index = server->timers_len;
+
+    server->timers_len += 1;
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (server->timers[parent].at <= at) {
+            break;
+        }
+
+        server->timers[index] = server->timers[parent];
+        index = parent;
+    }
+
+    server->timers[index].at = at;
+    server->timers[index].slot = slot;
+
+    return true;
+}
+
+struct timer timer_pop(struct server *server) {
+    struct timer top = server->timers[0];
+    struct timer last = server->timers[server->timers_len - 1];
+    size_t index = 0;
+
+    server->timers_len -= 1;
+
+    while (true) {
+        size_t child = index * 2 + 1;
+
+        if (child >= server->timers_len) {
+            break;
+        }
+
+        if (child + 1 < server->timers_len && server->timers[child + 1].at < server->timers[child].at) {
+            child += 1;
+        }
+
+        if (last.at <= server->timers[child].at) {
+            break;
+        }
+
+        server->timers[index] = server->timers[child];
+        index = child;
+    }
+
+    if (server->timers_len > 0) {
+        server->timers[index] = last;
+    }
+
+    return top;
+}
+
+bool parse_publish(struct server *server, uint8_t *buffer, size_t len, uint8_t **files_out, struct file_meta **meta_out, size_t *files_len_out) {
+    size_t files_len = 0;
+
+    if (len < 4) {
+        srv_warn(server, "handle_publish: too few bytes received\n");
+        return false;
+    }
+
+    uint32_t net_count = 0;
+
+    memcpy(&net_count, buffer, 4);
+    files_len = ntohl(net_count);
+
+    if (files_len > server->max_files) {
+        srv_warn(server, "handle_publish: number of files is greater than max. given: %lu\n", files_len);
+        return false;
+    }
+
+    // flag for indicating if we need to cleanup due to an error or issue from
+    // the client
+    bool clean_up = false;
+    // number of names found so far
+    size_t parsed = 0;
+    // moving pointer for our current location in the buffer
+    uint8_t *p = buffer + 4;
+    // the names point into the buffer until they are packed, pre-allocate
+    // the list and we will not re-allocate
+    const char **names = calloc(sizeof(char *), files_len);
+    // only allocated if the body carries metadata
+    struct file_meta *meta = NULL;
+
+    if (names == NULL && files_len != 0) {
+        srv_error(server, "handle_publish: failed allocating file list\n");
+        return false;
+    }
+
+    if (meta_out != NULL && files_len != 0) {
+        meta = calloc(sizeof(struct file_meta), files_len);
+
+        if (meta == NULL) {
+            srv_error(server, "handle_publish: failed allocating file metadata\n");
+
+            free(names);
+
+            return false;
+        }
+    }
+
+    len -= 4;
+
+    // this is probably the portion that can have the most issue due to
+    // allocating strings and having to keep track of what bytes we are
+    // looking at
+    for (size_t count = 0; count < files_len; ++count) {
+        bool found_null = false;
+        size_t str_len = 0;
+
+        if (meta_out != NULL) {
+            if (len < META_SIZE) {
+                srv_warn(server, "handle_publish: file metadata cut short\n");
+
+                clean_up = true;
+
+                break;
+            }
+
+            memcpy(&meta[count].size, p, 8);
+            memcpy(&meta[count].hash, p + 8, 8);
+            meta[count].size = be64toh(meta[count].size);
+            meta[count].hash = be64toh(meta[count].hash);
+
+            p += META_SIZE;
+            len -= META_SIZE;
+        }
+
+        for (; str_len < len; ++str_len) {
+            if (p[str_len] == 0) {
+                found_null = true;
+                break;
+            } else if (p[str_len] >= 128) {
+                srv_warn(server, "handle_publish: invalid ASCII character received from client\n");
+
+                clean_up = true;
+
+                break;
+            }
+        }
+
+        if (clean_up) {
+            break;
+        }
+
+        if (!found_null) {
+            srv_warn(server, "handle_publish: non null terminated string given by client\n");
+
+            clean_up = true;
+
+            break;
+        }
+
+        names[parsed] = (const char *)p;
+        parsed += 1;
+
+        srv_info(server, "handle_publish: str: \"%s\" %lu\n", (const char *)p, str_len);
+
+        p += str_len + 1;
+        len -= str_len + 1;
+    }
+
+    uint8_t *files = clean_up ? NULL : pack_catalog(server, names, meta, files_len);
+
+    free(names);
+
+    if (files == NULL) {
+        srv_log(server, "handle_publish: cleaning up allocated lists\n");
+
+        free(meta);
+
+        return false;
+    }
+
+    *files_out = files;
+    *files_len_out = files_len;
+
+    if (meta_out != NULL) {
+        *meta_out = meta;
+    }
+
+    return true;
+}
+
+size_t encode_catalog(struct client *client, uint8_t *buffer, size_t len) {
+    size_t used = 4;
+    uint32_t count = 0;
+
+    for (size_t f = 0; f < client->files_len; ++f) {
+        size_t str_len = catalog_name_len(client->files, f) + 1;
+        size_t fixed = client->cold->meta != NULL ? META_SIZE : 0;
+
+        if (used + fixed + str_len > len) {
+            break;
+        }
+
+        if (client->cold->meta != NULL) {
+            uint64_t size = htobe64(client->cold->meta[f].size);
+            uint64_t hash = htobe64(client->cold->meta[f].hash);
+
+            memcpy(buffer + used, &size, 8);
+            memcpy(buffer + used + 8, &hash, 8);
+        }
+
+        memcpy(buffer + used + fixed, catalog_name(client->files, f), str_len);
+        used += fixed + str_len;
+        count += 1;
+    }
+
+    // the count goes in last so it matches what actually fit
+    count = htonl(count);
+    memcpy(buffer, &count, 4);
+
+    return used;
+}
+
+struct client* search_client_files(struct server* server, const char *find, struct client *client) {
+    return find_client_file(server, find, client) >= 0 ? client : NULL;
+}
+
+ssize_t find_client_file(struct server *server, const char *find, struct client *client) {
+    size_t len = strlen(find);
+    size_t index = catalog_lower_bound(client->files, client->files_len, find, len);
+
+    if (index < client->files_len && catalog_name_len(client->files, index) == len && memcmp(catalog_name(client->files, index), find, len) == 0) {
+        return (ssize_t)index;
+    }
+
+    return -1;
+}
+
+void handle_search(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->type == CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_publish: client has not joined or registered\n");
+        return;
+    }
+
+    uint8_t response[SEARCH_RESPONSE_SIZE];
+
+    srv_info(server, "handle_search: client %u searching files\n", client->id);
+
+    search_request(server, buffer, len, &client->cold->addr, response);
+
+    srv_info(server, "handle_search: sending response\n");
+
+    if (client_send(server, client, response, SEARCH_RESPONSE_SIZE) != 0) {
+        srv_error(server, "handle_search: error sending resposne: %s\n", strerror(errno));
+    }
+}
+
+void search_request(struct server *server, const uint8_t *buffer, size_t len, const struct sockaddr *from, uint8_t *response) {
+    memset(response, 0, SEARCH_RESPONSE_SIZE);
+
+    if (!check_file_name(server, buffer, len)) {
+        return;
+    }
+
+    const char *p = (const char *)buffer;
+
+    record_search(server, p);
+
+    struct client *found = find_file(server, p, from);
+
+    TRACE2(search, p, found != NULL ? found->id : 0);
+
+    if (found == NULL) {
+        srv_info(server, "handle_search: failed to find file\n");
+
+        if (TEST_OUTPUT) {
+            printf("TEST] SEARCH %s 0 0.0.0.0:0\n", p);
+        }
+
+        return;
+    }
+
+    memcpy(response, found->cold->found, SEARCH_RESPONSE_SIZE);
+
+    if (TEST_OUTPUT && found->cold->found_ip[0] != '\0') {
+        printf("TEST] SEARCH %s %u %s\n", p, found->id, found->cold->found_ip);
+    }
+}
+
+void handle_list(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (len != 8) {
+        srv_warn(server, "handle_list: bytes received is not 8\n");
+        return;
+    }
+
+    uint64_t cursor = 0;
+
+    memcpy(&cursor, buffer, 8);
+    cursor = be64toh(cursor);
+
+    // the ring slots are too small to hold back pages so ring clients only
+    // get the last page without any entries
+    if (client->ring != NULL) {
+        uint8_t page[LIST_HEADER_SIZE] = {0};
+        uint64_t end = htobe64(LIST_END);
+
+        memcpy(page + 2, &end, 8);
+
+        srv_warn(server, "handle_list: not supported over a shared memory ring\n");
+
+        if (client_send(server, client, page, sizeof(page)) != 0) {
+            srv_error(server, "handle_list: error sending response: %s\n", strerror(errno));
+        }
+
+        return;
+    }
+
+    if (client->cold->out_buf == NULL) {
+        client->cold->out_buf = malloc(LIST_PAGE_SIZE);
+
+        if (client->cold->out_buf == NULL) {
+            srv_error(server, "handle_list: failed allocating page\n");
+            return;
+        }
+
+        mem_charge(server, client, LIST_PAGE_SIZE);
+    }
+
+    srv_info(server, "handle_list: client %d listing from %lx\n", client->sock, cursor);
+
+    client->listing = true;
+    client->cold->cursor = cursor;
+    client->cold->out_len = 0;
+    client->cold->out_sent = 0;
+    server->listing += 1;
+}
+
+bool run_listings(struct server *server) {
+    bool more = false;
+    size_t found = 0;
+    size_t listing = server->listing;
+
+    for (size_t index = 0; index < server->max_conn && found < listing; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (!c->active || !c->listing) {
+            continue;
+        }
+
+        found += 1;
+
+        if (list_client(server, c)) {
+            more = true;
+        }
+    }
+
+    return more;
+}
+
+bool list_client(struct server *server, struct client *client) {
+    if (client->sock >= 0) {
+        FD_CLR(client->sock, &server->write_socks);
+    }
+
+    for (size_t pages = 0; pages < server->slice;) {
+        if (client->cold->out_sent == client->cold->out_len) {
+            // notifications that came in while the last page went out are
+            // sent before the next one is started
+            if (client->cold->pending_len > 0) {
+                if (flush_pending(server, client) != 0) {
+                    srv_error(server, "list_client: error sending notifications: %s\n", strerror(errno));
+
+                    close_client(server, client);
+
+                    return false;
+                }
+
+                if (client->cold->pending_len > 0) {
+                    return false;
+                }
+            }
+
+            if (client->cold->cursor == LIST_END) {
+                srv_info(server, "list_client: client %d done listing\n", client->sock);
+
+                end_listing(server, client);
+
+                return false;
+            }
+
+            client->cold->out_len = fill_page(server, &client->cold->cursor, client->cold->out_buf);
+            client->cold->out_sent = 0;
+
+            pages += 1;
+        }
+
+        ssize_t sent;
+
+        if (client->sock >= 0) {
+            sent = send(client->sock, client->cold->out_buf + client->cold->out_sent, client->cold->out_len - client->cold->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else if (client_send(server, client, client->cold->out_buf + client->cold->out_sent, client->cold->out_len - client->cold->out_sent) == 0) {
+            sent = (ssize_t)(client->cold->out_len - client->cold->out_sent);
+        } else {
+            sent = -1;
+        }
+
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            srv_error(server, "list_client: error sending page: %s\n", strerror(errno));
+
+            close_client(server, client);
+
+            return false;
+        }
+
+        if (sent > 0) {
+            client->cold->out_sent += (size_t)sent;
+        }
+
+        if (client->cold->out_sent < client->cold->out_len) {
+            // the client is not keeping up, wait until its socket has room
+            // instead of filling more pages
+            FD_SET(client->sock, &server->write_socks);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t fill_page(struct server *server, uint64_t *cursor, uint8_t *page) {
+    // the cursor is the slot of the client in the upper half and the index
+    // in its catalog in the lower half. catalogs can change between pages so
+    // a listing is not a snapshot, but it always makes progress
+    size_t slot = (size_t)(*cursor >> 32);
+    size_t file = (size_t)(*cursor & UINT32_MAX);
+    size_t used = LIST_HEADER_SIZE;
+    uint16_t count = 0;
+
+    while (slot < server->max_conn && count < LIST_PAGE) {
+        struct client *c = &server->clients[slot];
+
+        if (!c->active || file >= c->files_len) {
+            slot += 1;
+            file = 0;
+            continue;
+        }
+
+        size_t str_len = catalog_name_len(c->files, file) + 1;
+
+        if (used + 4 + str_len > LIST_PAGE_SIZE) {
+            break;
+        }
+
+        uint32_t id = htonl(c->id);
+
+        memcpy(page + used, &id, 4);
+        memcpy(page + used + 4, catalog_name(c->files, file), str_len);
+
+        used += 4 + str_len;
+        count += 1;
+        file += 1;
+    }
+
+    *cursor = slot >= server->max_conn ? LIST_END : ((uint64_t)slot << 32) | file;
+
+    uint16_t net_count = htons(count);
+    uint64_t next = htobe64(*cursor);
+
+    memcpy(page, &net_count, 2);
+    memcpy(page + 2, &next, 8);
+
+    return used;
+}
+
+void end_listing(struct server *server, struct client *client) {
+    if (client->sock >= 0) {
+        FD_CLR(client->sock, &server->write_socks);
+    }
+
+    client->listing = false;
+    server->listing -= 1;
+}
+
+void handle_watch(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool add) {
+    // a watching connection does not have to join, the peer may already
+    // have joined on its main connection with the same id
+    if (len < 1 || buffer[0] > 1) {
+        srv_warn(server, "handle_watch: invalid watch mode\n");
+        return;
+    }
+
+    if (!check_file_name(server, buffer + 1, len - 1)) {
+        return;
+    }
+
+    const char *name = (const char *)buffer + 1;
+    size_t name_len = len - 2;
+    bool prefix = buffer[0] == 1;
+
+    if (!add) {
+        watch_remove(server, client, name, name_len, prefix);
+
+        return;
+    }
+
+    if (client->cold->watching_len >= WATCH_MAX) {
+        srv_warn(server, "handle_watch: client %d is watching too many names\n", client->sock);
+        return;
+    }
+
+    struct watch *watch = watch_add(server, client, name, name_len, prefix);
+
+    if (watch == NULL) {
+        return;
+    }
+
+    srv_info(server, "handle_watch: client %d watching %s\"%s\"\n", client->sock, prefix ? "prefix " : "", name);
+
+    if (TEST_OUTPUT) {
+        printf("TEST] WATCH %s %d\n", name, prefix);
+    }
+
+    // a name published before the watch came in is reported right away so
+    // the peer does not have to search as well
+    notify_existing(server, client, watch);
+}
+
+struct watch* watch_add(struct server *server, struct client *client, const char *name, size_t len, bool prefix) {
+    if (server->watches_len >= server->watches_cap && !watch_grow(server)) {
+        srv_error(server, "handle_watch: failed growing watch table\n");
+        return NULL;
+    }
+
+    struct watch *watch = malloc(sizeof(struct watch) + len + 1);
+
+    if (watch == NULL) {
+        srv_error(server, "handle_watch: failed allocating watch\n");
+        return NULL;
+    }
+
+    mem_charge(server, client, sizeof(struct watch) + len + 1);
+
+    watch->hash = hash_name(name, len);
+    watch->prefix = prefix;
+    watch->slot = (size_t)(client - server->clients);
+    watch->len = len;
+    memcpy(watch->name, name, len + 1);
+
+    size_t bucket = watch->hash & (server->watches_cap - 1);
+
+    watch->next = server->watches[bucket];
+    server->watches[bucket] = watch;
+    watch->next_client = client->cold->watching;
+    client->cold->watching = watch;
+
+    server->watches_len += 1;
+    client->cold->watching_len += 1;
+
+    if (prefix) {
+        server->prefix_watches[len] += 1;
+    }
+
+    return watch;
+}
+
+void watch_remove(struct server *server, struct client *client, const char *name, size_t len, bool prefix) {
+    for (struct watch **w = &client->cold->watching; *w != NULL; w = &(*w)->next_client) {
+        struct watch *watch = *w;
+
+        if (watch->prefix == prefix && watch->len == len && memcmp(watch->name, name, len) == 0) {
+            *w = watch->next_client;
+            client->cold->watching_len -= 1;
+
+            watch_free(server, watch);
+
+            return;
+        }
+    }
+}
+
+void unwatch_all(struct server *server, struct client *client) {
+    while (client->cold->watching != NULL) {
+        struct watch *watch = client->cold->watching;
+
+        client->cold->watching = watch->next_client;
+
+        watch_free(server, watch);
+    }
+
+    client->cold->watching_len = 0;
+}
+
+void watch_free(struct server *server, struct watch *watch) {
+    size_t bucket = watch->hash & (server->watches_cap - 1);
+
+    for (struct watch **w = &server->watches[bucket]; *w != NULL; w = &(*w)->next) {
+        if (*w == watch) {
+            *w = watch->next;
+            break;
+        }
+    }
+
+    if (watch->prefix) {
+        server->prefix_watches[watch->len] -= 1;
+    }
+
+    server->watches_len -= 1;
+
+    mem_release(server, &server->clients[watch->slot], sizeof(struct watch) + watch->len + 1);
+
+    free(watch);
+}
+
+bool watch_grow(struct server *server) {
+    size_t cap = server->watches_cap == 0 ? 64 : server->watches_cap * 2;
+    struct watch **watches = calloc(cap, sizeof(struct watch *));
+
+    if (watches == NULL) {
+        return false;
+    }
+
+    for (size_t bucket = 0; bucket < server->watches_cap; ++bucket) {
+        struct watch *watch = server->watches[bucket];
+
+        while (watch != NULL) {
+            struct watch *next = watch->next;
+            size_t moved = watch->hash & (cap - 1);
+
+            watch->next = watches[moved];
+            watches[moved] = watch;
+
+            watch = next;
+        }
+    }
+
+    free(server->watches);
+
+    server->watches = watches;
+    server->watches_cap = cap;
+
+    return true;
+}
+
+void notify_watchers(struct server *server, struct client *publisher) {
+    if (server->watches_len == 0) {
+        return;
+    }
+
+    for (size_t f = 0; f < publisher->files_len; ++f) {
+        const char *name = catalog_name(publisher->files, f);
+        size_t len = catalog_name_len(publisher->files, f);
+        // the hash is built up one byte at a time so that every watched
+        // prefix length is looked up without hashing the name again
+        uint32_t hash = hash_name(name, 0);
+
+        for (size_t at = 0; at <= len && at < WATCH_NAME_MAX; ++at) {
+            bool exact = at == len;
+
+            if (exact || server->prefix_watches[at] != 0) {
+                struct watch *watch = server->watches[hash & (server->watches_cap - 1)];
+
+                for (; watch != NULL; watch = watch->next) {
+                    if (watch->hash != hash || watch->len != at || (!watch->prefix && !exact)) {
+                        continue;
+                    }
+
+                    struct client *watcher = &server->clients[watch->slot];
+
+                    if (watcher != publisher && memcmp(watch->name, name, at) == 0) {
+                        send_notify(server, watcher, publisher, name);
+                    }
+                }
+            }
+
+            if (!exact) {
+                hash = (hash ^ (uint8_t)name[at]) * 16777619u;
+            }
+        }
+    }
+}
+
+void notify_existing(struct server *server, struct client *client, struct watch *watch) {
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (!c->active || c == client) {
+            continue;
+        }
+
+        // the names starting with the watched one are next to each other
+        for (size_t f = catalog_lower_bound(c->files, c->files_len, watch->name, watch->len); f < c->files_len; ++f) {
+            const char *name = catalog_name(c->files, f);
+
+            if (strncmp(name, watch->name, watch->len) != 0) {
+                break;
+            }
+
+            if (watch->prefix || name[watch->len] == 0) {
+                send_notify(server, client, c, name);
+            }
+        }
+    }
+}
+
+void send_notify(struct server *server, struct client *watcher, struct client *publisher, const char *name) {
+    uint8_t frame[NOTIFY_HEADER_SIZE + BUFF_SIZE];
+    size_t name_len = strlen(name) + 1;
+    uint32_t id = htonl(publisher->id);
+
+    if (name_len > BUFF_SIZE) {
+        return;
+    }
+
+    memset(frame, 0, NOTIFY_HEADER_SIZE);
+
+    frame[0] = ACTION_NOTIFY;
+    memcpy(frame + 1, &id, 4);
+
+    if (publisher->cold->addr.sa_family == AF_INET) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)&publisher->cold->addr;
+
+        memcpy(frame + 5, &v4->sin_addr.s_addr, 4);
+        memcpy(frame + 9, &v4->sin_port, 2);
+    }
+
+    memcpy(frame + NOTIFY_HEADER_SIZE, name, name_len);
+
+    srv_info(server, "send_notify: client %d notified of \"%s\"\n", watcher->sock, name);
+
+    if (TEST_OUTPUT) {
+        printf("TEST] NOTIFY %s %u\n", name, publisher->id);
+    }
+
+    if (watcher->sock == -1 || watcher->ring != NULL) {
+        if (client_send(server, watcher, frame, NOTIFY_HEADER_SIZE + name_len) != 0) {
+            srv_error(server, "send_notify: error sending notification: %s\n", strerror(errno));
+        }
+
+        return;
+    }
+
+    // a watcher that is slow to read must not hold up the loop so its
+    // notifications are queued instead of sent with send_bytes
+    watcher->cold->pending_max = NOTIFY_PENDING_MAX;
+
+    if (queue_pending(server, watcher, frame, NOTIFY_HEADER_SIZE + name_len) != 0) {
+        srv_error(server, "send_notify: closing watcher %d: %s\n", watcher->sock, strerror(errno));
+
+        // the watch table is being walked so the watcher can not be closed
+        // here. the main loop sees the shutdown and closes it
+        shutdown(watcher->sock, SHUT_RDWR);
+    }
+}
+
+void flush_watchers(struct server *server) {
+    size_t found = 0;
+    size_t backlogged = server->backlogged;
+
+    for (size_t index = 0; index < server->max_conn && found < backlogged; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (!c->active || c->type == CLIENT_STANDBY || c->cold->pending_len == 0) {
+            continue;
+        }
+
+        found += 1;
+
+        if (flush_pending(server, c) != 0) {
+            srv_error(server, "flush_watchers: closing watcher %d: %s\n", c->sock, strerror(errno));
+
+            close_client(server, c);
+        }
+    }
+}
+
+uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t index = 0; index < len; ++index) {
+        hash = (hash ^ (uint8_t)name[index]) * 16777619u;
+    }
+
+    return hash;
+}
+
+bool check_file_name(struct server *server, const uint8_t *buffer, size_t len) {
+    if (len >= 100) {
+        srv_warn(server, "handle_search: received too many bytes from client\n");
+        return false;
+    }
+
+    // check to make sure that the string we are given is a valid ASCII string
+    for (size_t check = 0; check < len; ++check) {
+        if (buffer[check] >= 128) {
+            srv_warn(server, "handle_search: file name contains non ASCII characters\n");
+            return false;
+        }
+    }
+
+    if (len == 0 || buffer[len - 1] != 0) {
+        srv_warn(server, "handle_search: non null terminated string from client\n");
+        return false;
+    }
+
+    return true;
+}
+
+void handle_search_meta(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->type == CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_search_meta: client has not joined or registered\n");
+        return;
+    }
+
+    struct file_owner owners[SEARCH_META_MAX];
+    size_t owners_len = 0;
+
+    if (check_file_name(server, buffer, len)) {
+        const char *name = (const char *)buffer;
+        bool ranked = server->ranked && client->cold->addr.sa_family == AF_INET;
+
+        record_search(server, name);
+        uint32_t site = ranked ? locate_site(server, &client->cold->addr) : 0;
+
+        for (size_t index = 0; index < server->max_conn && owners_len < SEARCH_META_MAX; ++index) {
+            struct client *c = &server->clients[index];
+
+            if (!c->active) {
+                continue;
+            }
+
+            ssize_t file = find_client_file(server, name, c);
+
+            // peers can only fetch from owners they can reach over ipv4. the
+            // address is only looked at for owners so the scan stays in the
+            // hot half of the slots
+            if (file < 0 || c->cold->addr.sa_family != AF_INET) {
+                continue;
+            }
+
+            owners[owners_len].client = c;
+            owners[owners_len].distance = ranked ? owner_distance(&client->cold->addr, site, c) : 0;
+
+            // owners that published without metadata are reported with a
+            // size and hash of 0
+            if (c->cold->meta != NULL) {
+                owners[owners_len].meta = c->cold->meta[file];
+            } else {
+                memset(&owners[owners_len].meta, 0, sizeof(struct file_meta));
+            }
+
+            owners_len += 1;
+        }
+
+        // owners with the same content end up next to each other, closest
+        // first
+        qsort(owners, owners_len, sizeof(struct file_owner), compare_owners);
+
+        TRACE2(search_meta, name, owners_len);
+
+        srv_info(server, "handle_search_meta: found %lu owners of \"%s\"\n", owners_len, name);
+
+        if (TEST_OUTPUT) {
+            printf("TEST] SEARCH_META %s %lu\n", name, owners_len);
+        }
+    }
+
+    uint8_t response[2 + SEARCH_META_RECORD * SEARCH_META_MAX];
+    uint16_t count = htons((uint16_t)owners_len);
+    uint8_t *p = response + 2;
+
+    memcpy(response, &count, 2);
+
+    for (size_t index = 0; index < owners_len; ++index) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)&owners[index].client->cold->addr;
+        uint32_t id = htonl(owners[index].client->id);
+        uint64_t size = htobe64(owners[index].meta.size);
+        uint64_t hash = htobe64(owners[index].meta.hash);
+
+        memcpy(p, &id, 4);
+        memcpy(p + 4, &v4->sin_addr.s_addr, 4);
+        memcpy(p + 8, &v4->sin_port, 2);
+        memcpy(p + 10, &size, 8);
+        memcpy(p + 18, &hash, 8);
+
+        p += SEARCH_META_RECORD;
+    }
+
+    if (client_send(server, client, response, p - response) != 0) {
+        srv_error(server, "handle_search_meta: error sending response: %s\n", strerror(errno));
+    }
+}
+
+int compare_owners(const void *a, const void *b) {
+    const struct file_owner *x = a;
+    const struct file_owner *y = b;
+
+    if (x->meta.hash != y->meta.hash) {
+        return x->meta.hash < y->meta.hash ? -1 : 1;
+    }
+
+    if (x->distance != y->distance) {
+        return x->distance < y->distance ? -1 : 1;
+    }
+
+    if (x->client->id != y->client->id) {
+        return x->client->id < y->client->id ? -1 : 1;
+    }
+
+    return 0;
+}
+
+struct client* find_file(struct server *server, const char *name, const struct sockaddr *from) {
+    bool ranked = server->ranked && from != NULL && from->sa_family == AF_INET;
+    uint32_t site = ranked ? locate_site(server, from) : 0;
+    struct client *best = NULL;
+    uint32_t best_distance = UINT32_MAX;
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        if (!server->clients[index].active) {
+            continue;
+        }
+
+        srv_debug(server, "handle_search: checking client: %u\n", server->clients[index].id);
+
+        struct client *found = search_client_files(server, name, &server->clients[index]);
+
+        if (found == NULL) {
+            continue;
+        }
+
+        if (!ranked) {
+            srv_info(server, "handle_search: found file. id: %u\n", found->id);
+
+            return found;
+        }
+
+        uint32_t distance = owner_distance(from, site, found);
+
+        if (best == NULL || distance < best_distance) {
+            best = found;
+            best_distance = distance;
+        }
+
+        // nothing can be closer than the same address in the same site
+        if (distance == 0) {
+            break;
+        }
+    }
+
+    if (best != NULL) {
+        srv_info(server, "handle_search: found file. id: %u distance: %u\n", best->id, best_distance);
+    }
+
+    return best;
+}
+
+void record_search(struct server *server, const char *name) {
+    struct search_stats *stats = &server->stats;
+    size_t len = strlen(name);
+    uint64_t hash = hash_catalog((const uint8_t *)name, len);
+    // every row gets its own hash from the two halves of the one hash
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t count = UINT32_MAX;
+
+    decay_searches(server);
+
+    for (uint32_t row = 0; row < SKETCH_DEPTH; ++row) {
+        uint32_t *counter = &stats->sketch[row][(h1 + row * h2) % SKETCH_WIDTH];
+
+        if (*counter < UINT32_MAX) {
+            *counter += 1;
+        }
+
+        if (*counter < count) {
+            count = *counter;
+        }
+    }
+
+    for (size_t index = 0; index < stats->hot_len; ++index) {
+        if (stats->hot[index].hash == hash && strcmp(stats->hot[index].name, name) == 0) {
+            stats->hot[index].count = count;
+            hot_sift_down(stats, index);
+            return;
+        }
+    }
+
+    size_t index;
+
+    if (stats->hot_len < HOT_NAMES) {
+        index = stats->hot_len;
+        stats->hot_len += 1;
+    } else if (count > stats->hot[0].count) {
+        index = 0;
+    } else {
+        return;
+    }
+
+    stats->hot[index].count = count;
+    stats->hot[index].hash = hash;
+    memcpy(stats->hot[index].name, name, len + 1);
+
+    if (index == 0) {
+        hot_sift_down(stats, 0);
+    } else {
+        hot_sift_up(stats, index);
+    }
+}
+
+void decay_searches(struct server *server) {
+    struct search_stats *stats = &server->stats;
+    uint64_t periods = (server->now - stats->decayed_at) / SEARCH_DECAY_MS;
+
+    if (periods == 0) {
+        return;
+    }
+
+    unsigned shift = periods > 31 ? 31 : (unsigned)periods;
+
+    stats->decayed_at += periods * SEARCH_DECAY_MS;
+
+    for (size_t row = 0; row < SKETCH_DEPTH; ++row) {
+        for (size_t column = 0; column < SKETCH_WIDTH; ++column) {
+            stats->sketch[row][column] >>= shift;
+        }
+    }
+
+    // halving every count keeps the heap in order
+    for (size_t index = 0; index < stats->hot_len; ++index) {
+        stats->hot[index].count >>= shift;
+    }
+}
+
+void hot_sift_down(struct search_stats *stats, size_t index) {
+    struct hot_name moving = stats->hot[index];
+
+    while (true) {
+        size_t child = index * 2 + 1;
+
+        if (child >= stats->hot_len) {
+            break;
+        }
+
+        if (child + 1 < stats->hot_len && stats->hot[child + 1].count < stats->hot[child].count) {
+            child += 1;
+        }
+
+        if (moving.count <= stats->hot[child].count) {
+            break;
+        }
+
+        stats->hot[index] = stats->hot[child];
+        index = child;
+    }
+
+    stats->hot[index] = moving;
+}
+
+void hot_sift_up(struct search_stats *stats, size_t index) {
+    struct hot_name moving = stats->hot[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (stats->hot[parent].count <= moving.count) {
+            break;
+        }
+
+        stats->hot[index] = stats->hot[parent];
+        index = parent;
+    }
+
+    stats->hot[index] = moving;
+}
+
+void handle_stats(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    struct search_stats *stats = &server->stats;
+    uint8_t response[4 + 3 + 1 + HOT_NAMES * (4 + HOT_NAME_MAX) + 3 + 17 + 3 + 9 + TOP_CONSUMERS * 12];
+    size_t offset = 4;
+
+    decay_searches(server);
+
+    // the heap is only ordered by its top so sort a copy for the response
+    struct hot_name hot[HOT_NAMES];
+    size_t hot_len = 0;
+
+    for (size_t index = 0; index < stats->hot_len; ++index) {
+        if (stats->hot[index].count == 0) {
+            continue;
+        }
+
+        size_t at = hot_len;
+
+        while (at > 0 && hot[at - 1].count < stats->hot[index].count) {
+            hot[at] = hot[at - 1];
+            at -= 1;
+        }
+
+        hot[at] = stats->hot[index];
+        hot_len += 1;
+    }
+
+    size_t section = offset;
+
+    response[offset] = STATS_HOT_NAMES;
+    response[offset + 3] = (uint8_t)hot_len;
+    offset += 4;
+
+    for (size_t index = 0; index < hot_len; ++index) {
+        uint32_t count = htonl(hot[index].count);
+        size_t name_len = strlen(hot[index].name) + 1;
+
+        memcpy(response + offset, &count, 4);
+        memcpy(response + offset + 4, hot[index].name, name_len);
+        offset += 4 + name_len;
+    }
+
+    uint16_t section_len = htons((uint16_t)(offset - section - 3));
+
+    memcpy(response + section + 1, &section_len, 2);
+
+    uint16_t load_len = htons(17);
+    uint32_t lag = htonl(server->lag > UINT32_MAX ? UINT32_MAX : (uint32_t)server->lag);
+    uint32_t depth = htonl((uint32_t)(server->queue_depth + 0.5));
+    uint64_t shed = htobe64(server->shed);
+
+    response[offset] = STATS_LOAD;
+    memcpy(response + offset + 1, &load_len, 2);
+    memcpy(response + offset + 3, &lag, 4);
+    memcpy(response + offset + 7, &depth, 4);
+    response[offset + 11] = server->shedding;
+    memcpy(response + offset + 12, &shed, 8);
+    offset += 3 + 17;
+
+    // a single pass keeping the largest few in order
+    struct client *top[TOP_CONSUMERS];
+    size_t top_len = 0;
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (!c->active || (top_len == TOP_CONSUMERS && c->cold->mem <= top[top_len - 1]->cold->mem)) {
+            continue;
+        }
+
+        size_t at = top_len < TOP_CONSUMERS ? top_len++ : TOP_CONSUMERS - 1;
+
+        while (at > 0 && top[at - 1]->cold->mem < c->cold->mem) {
+            top[at] = top[at - 1];
+            at -= 1;
+        }
+
+        top[at] = c;
+    }
+
+    uint16_t memory_len = htons((uint16_t)(9 + top_len * 12));
+    uint64_t mem = htobe64(server->mem);
+
+    response[offset] = STATS_MEMORY;
+    memcpy(response + offset + 1, &memory_len, 2);
+    memcpy(response + offset + 3, &mem, 8);
+    response[offset + 11] = (uint8_t)top_len;
+    offset += 12;
+
+    for (size_t index = 0; index < top_len; ++index) {
+        uint32_t id = htonl(top[index]->id);
+        uint64_t bytes = htobe64(top[index]->cold->mem);
+
+        memcpy(response + offset, &id, 4);
+        memcpy(response + offset + 4, &bytes, 8);
+        offset += 12;
+    }
+
+    uint32_t total = htonl((uint32_t)(offset - 4));
+
+    memcpy(response, &total, 4);
+
+    srv_info(server, "handle_stats: sending %lu hot names\n", hot_len);
+
+    if (client_send(server, client, response, offset) != 0) {
+        srv_error(server, "handle_stats: error sending response: %s\n", strerror(errno));
+    }
+}
+
+bool load_localities(struct server *server, const char *path) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "[ERROR] failed to open locality file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    size_t line_no = 0;
+    size_t cap = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no += 1;
+
+        char subnet[64];
+        char label[128];
+        char extra;
+        int fields = sscanf(line, " %63s %127s %c", subnet, label, &extra);
+
+        if (fields <= 0 || subnet[0] == '#') {
+            continue;
+        }
+
+        char *slash = strchr(subnet, '/');
+        struct in_addr net;
+        char *end = NULL;
+        unsigned long bits = 0;
+
+        if (slash != NULL) {
+            *slash = 0;
+            bits = strtoul(slash + 1, &end, 10);
+        }
+
+        if (fields != 2 || slash == NULL || *end != 0 || bits > 32 || inet_pton(AF_INET, subnet, &net) != 1) {
+            fprintf(stderr, "[ERROR] %s:%lu: expected ADDRESS/BITS LABEL\n", path, line_no);
+            fclose(file);
+            return false;
+        }
+
+        if (server->localities_len == cap) {
+            cap = cap == 0 ? 16 : cap * 2;
+
+            struct locality *localities = realloc(server->localities, sizeof(struct locality) * cap);
+
+            if (localities == NULL) {
+                fprintf(stderr, "[ERROR] failed to allocate localities: %s\n", strerror(errno));
+                fclose(file);
+                return false;
+            }
+
+            server->localities = localities;
+        }
+
+        size_t site = 0;
+
+        while (site < server->sites_len && strcmp(server->sites[site], label) != 0) {
+            site += 1;
+        }
+
+        if (site == server->sites_len) {
+            char **sites = realloc(server->sites, sizeof(char *) * (server->sites_len + 1));
+
+            if (sites == NULL || (sites[site] = strdup(label)) == NULL) {
+                fprintf(stderr, "[ERROR] failed to allocate sites: %s\n", strerror(errno));
+                server->sites = sites != NULL ? sites : server->sites;
+                fclose(file);
+                return false;
+            }
+
+            server->sites = sites;
+            server->sites_len += 1;
+        }
+
+        struct locality *l = &server->localities[server->localities_len];
+
+        l->mask = bits == 0 ? 0 : UINT32_MAX << (32 - bits);
+        l->net = ntohl(net.s_addr) & l->mask;
+        l->site = (uint32_t)site + 1;
+
+        server->localities_len += 1;
+    }
+
+    fclose(file);
+
+    // the first match is then the longest one
+    qsort(server->localities, server->localities_len, sizeof(struct locality), compare_localities);
+
+    server->ranked = true;
+
+    return true;
+}
+
+uint32_t locate_site(struct server *server, const struct sockaddr *addr) {
+    if (addr->sa_family != AF_INET) {
+        return 0;
+    }
+
+    uint32_t ip = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+
+    for (size_t index = 0; index < server->localities_len; ++index) {
+        if ((ip & server->localities[index].mask) == server->localities[index].net) {
+            return server->localities[index].site;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t owner_distance(const struct sockaddr *from, uint32_t site, const struct client *owner) {
+    // the requester could not use the address anyway
+    if (owner->cold->addr.sa_family != AF_INET) {
+        return UINT32_MAX;
+    }
+
+    uint32_t a = ntohl(((const struct sockaddr_in *)from)->sin_addr.s_addr);
+    uint32_t b = ntohl(((const struct sockaddr_in *)&owner->cold->addr)->sin_addr.s_addr);
+    uint32_t common = a == b ? 32 : (uint32_t)__builtin_clz(a ^ b);
+
+    // anything in the same site beats every owner outside of it, the
+    // address prefix only breaks ties
+    return (site != 0 && site == owner->cold->site ? 0 : 33) + 32 - common;
+}
+
+void free_localities(struct server *server) {
+    for (size_t index = 0; index < server->sites_len; ++index) {
+        free(server->sites[index]);
+    }
+
+    free(server->sites);
+    free(server->localities);
+
+    server->sites = NULL;
+    server->sites_len = 0;
+    server->localities = NULL;
+    server->localities_len = 0;
+}
+
+int compare_localities(const void *a, const void *b) {
+    const struct locality *x = a;
+    const struct locality *y = b;
+
+    // masks are contiguous so a longer prefix is a larger mask
+    if (x->mask != y->mask) {
+        return x->mask > y->mask ? -1 : 1;
+    }
+
+    return 0;
+}
+
+void handle_replicate(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
+    if (client->type != CLIENT_UNKNOWN) {
+        srv_warn(server, "handle_replicate: client has already joined\n");
+        return;
+    }
+
+    if (len != 0) {
+        srv_warn(server, "handle_replicate: unexpected bytes received\n");
+        return;
+    }
+
+    if (server->standbys == REPL_MAX_STANDBYS) {
+        srv_warn(server, "handle_replicate: already serving %d standbys\n", REPL_MAX_STANDBYS);
+        return;
+    }
+
+    srv_info(server, "handle_replicate: standby %d attached, sending snapshot\n", client->sock);
+
+    client->type = CLIENT_STANDBY;
+
+    // the standby is added to the list after the snapshot has been queued so
+    // that replicate_send does not pick it up twice
+    if (send_snapshot(server, client) != 0) {
+        srv_error(server, "handle_replicate: error sending snapshot: %s\n", strerror(errno));
+        close_client(server, client);
+        return;
+    }
+
+    server->standby[server->standbys] = client;
+    server->standbys += 1;
+}
+
+int send_snapshot(struct server *server, struct client *standby) {
+    // the snapshot is queued like the rest of the stream but does not count
+    // against the limit
+    standby->cold->pending_max = SIZE_MAX;
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *c = &server->clients[index];
+
+        if (!c->active || c->type == CLIENT_UNKNOWN || c->type == CLIENT_STANDBY) {
+            continue;
+        }
+
+        uint8_t frame[REPL_HEADER_SIZE + 16];
+        uint32_t key = htonl((uint32_t)index);
+        uint32_t payload_len = htonl(16);
+        uint32_t id = htonl(c->id);
+        uint16_t family = htons(c->cold->addr.sa_family);
+
+        frame[0] = REPL_JOIN;
+        memcpy(frame + 1, &payload_len, 4);
+        memcpy(frame + 5, &key, 4);
+        memcpy(frame + 9, &id, 4);
+        memcpy(frame + 13, &family, 2);
+
+        if (c->cold->addr.sa_family == AF_INET) {
+            struct sockaddr_in *v4 = (struct sockaddr_in *)&c->cold->addr;
+
+            memcpy(frame + 15, &v4->sin_addr.s_addr, 4);
+            memcpy(frame + 19, &v4->sin_port, 2);
+        } else {
+            memset(frame + 15, 0, 6);
+        }
+
+        if (queue_pending(server, standby, frame, sizeof(frame)) != 0) {
+            return -1;
+        }
+
+        uint8_t body[REPL_BUFF_SIZE];
+        size_t body_len = REPL_HEADER_SIZE + 12;
+        uint64_t hash = htobe64(c->cold->catalog_hash);
+
+        memcpy(body + REPL_HEADER_SIZE, &key, 4);
+        memcpy(body + REPL_HEADER_SIZE + 4, &hash, 8);
+
+        body_len += encode_catalog(c, body + body_len, sizeof(body) - body_len);
+        payload_len = htonl((uint32_t)(body_len - REPL_HEADER_SIZE));
+
+        body[0] = c->cold->meta != NULL ? REPL_PUBLISH_META : REPL_PUBLISH;
+        memcpy(body + 1, &payload_len, 4);
+
+        if (queue_pending(server, standby, body, body_len) != 0) {
+            return -1;
+        }
+
+        if (c->cold->ttl != 0) {
+            uint8_t ttl_frame[REPL_HEADER_SIZE + 8];
+            uint32_t ttl = htonl(c->cold->ttl);
+
+            payload_len = htonl(8);
+
+            ttl_frame[0] = REPL_TTL;
+            memcpy(ttl_frame + 1, &payload_len, 4);
+            memcpy(ttl_frame + 5, &key, 4);
+            memcpy(ttl_frame + 9, &ttl, 4);
+
+            if (queue_pending(server, standby, ttl_frame, sizeof(ttl_frame)) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    standby->cold->pending_max = standby->cold->pending_len - standby->cold->pending_sent + REPL_PENDING_MAX;
+
+    return 0;
+}
+
+void replicate_send(struct server *server, uint8_t op, uint32_t key, const uint8_t *payload, size_t len) {
+    if (server->standbys == 0) {
+        return;
+    }
+
+    uint8_t frame[REPL_BUFF_SIZE];
+
+    if (len + REPL_HEADER_SIZE + 4 > sizeof(frame)) {
+        srv_error(server, "replicate_send: frame too large to replicate: %lu\n", len);
+        return;
+    }
+
+    uint32_t payload_len = htonl((uint32_t)(len + 4));
+    uint32_t net_key = htonl(key);
+
+    frame[0] = op;
+    memcpy(frame + 1, &payload_len, 4);
+    memcpy(frame + REPL_HEADER_SIZE, &net_key, 4);
+
+    // a DROP has no payload
+    if (len > 0) {
+        memcpy(frame + REPL_HEADER_SIZE + 4, payload, len);
+    }
+
+    // dropping a standby moves the last one into its place, so the list is
+    // walked from the end
+    for (size_t index = server->standbys; index > 0; --index) {
+        struct client *c = server->standby[index - 1];
+
+        if (c->cold->resync) {
+            continue;
+        }
+
+        if (queue_pending(server, c, frame, len + REPL_HEADER_SIZE + 4) == 0) {
+            continue;
+        }
+
+        if (errno == ENOBUFS) {
+            // the frames it missed are covered by the snapshot it gets once
+            // it has taken what is already queued
+            srv_warn(server, "replicate_send: standby %d fell behind, resyncing\n", c->sock);
+
+            c->cold->resync = true;
+            continue;
+        }
+
+        srv_error(server, "replicate_send: dropping standby %d: %s\n", c->sock, strerror(errno));
+
+        close_client(server, c);
+    }
+}
+
+int queue_pending(struct server *server, struct client *client, const uint8_t *buf, size_t len) {
+    struct client_cold *cold = client->cold;
+    size_t waiting = cold->pending_len - cold->pending_sent;
+
+    if (waiting + len > cold->pending_max) {
+        srv_warn(server, "queue_pending: client %d is %lu bytes behind\n", client->sock, waiting);
+
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (cold->pending_len + len > cold->pending_cap && cold->pending_sent > 0) {
+        // the sent bytes are only dropped from the front when the frame
+        // would not fit after them
+        memmove(cold->pending, cold->pending + cold->pending_sent, waiting);
+
+        cold->pending_len = waiting;
+        cold->pending_sent = 0;
+    }
+
+    if (cold->pending_len + len > cold->pending_cap) {
+        size_t cap = cold->pending_cap == 0 ? REPL_BUFF_SIZE : cold->pending_cap;
+
+        while (cap < cold->pending_len + len) {
+            cap *= 2;
+        }
+
+        uint8_t *pending = realloc(cold->pending, cap);
+
+        if (pending == NULL) {
+            srv_error(server, "queue_pending: failed allocating pending buffer\n");
+            return -1;
+        }
+
+        mem_charge(server, client, cap - cold->pending_cap);
+
+        cold->pending = pending;
+        cold->pending_cap = cap;
+    }
+
+    if (cold->pending_len == 0 && client->type != CLIENT_STANDBY) {
+        server->backlogged += 1;
+    }
+
+    memcpy(cold->pending + cold->pending_len, buf, len);
+    cold->pending_len += len;
+
+    return flush_pending(server, client);
+}
+
+int flush_pending(struct server *server, struct client *client) {
+    struct client_cold *cold = client->cold;
+
+    if (client->listing && cold->out_sent < cold->out_len) {
+        // a page of a LIST response is half way out, the notifications
+        // follow once list_client has sent the rest of it
+        return 0;
+    }
+
+    FD_CLR(client->sock, &server->write_socks);
+
+    while (cold->pending_sent < cold->pending_len) {
+        ssize_t sent = send(client->sock, cold->pending + cold->pending_sent, cold->pending_len - cold->pending_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+
+            // the client is not keeping up, the rest goes out once its
+            // socket has room
+            FD_SET(client->sock, &server->write_socks);
+
+            return 0;
+        }
+
+        cold->pending_sent += (size_t)sent;
+    }
+
+    if (cold->pending_len > 0 && client->type != CLIENT_STANDBY) {
+        server->backlogged -= 1;
+    }
+
+    cold->pending_len = 0;
+    cold->pending_sent = 0;
+
+    return 0;
+}
+
+void flush_standbys(struct server *server) {
+    for (size_t index = server->standbys; index > 0; --index) {
+        struct client *c = server->standby[index - 1];
+
+        if (c->cold->pending_len == 0 && !c->cold->resync) {
+            continue;
+        }
+
+        if (flush_pending(server, c) != 0) {
+            srv_error(server, "flush_standbys: dropping standby %d: %s\n", c->sock, strerror(errno));
+
+            close_client(server, c);
+            continue;
+        }
+
+        if (!c->cold->resync || c->cold->pending_len != 0) {
+            continue;
+        }
+
+        srv_info(server, "flush_standbys: standby %d caught up, sending snapshot\n", c->sock);
+
+        uint8_t frame[REPL_HEADER_SIZE + 4] = {REPL_RESYNC};
+        uint32_t payload_len = htonl(4);
+
+        memcpy(frame + 1, &payload_len, 4);
+
+        c->cold->resync = false;
+
+        if (queue_pending(server, c, frame, sizeof(frame)) != 0 || send_snapshot(server, c) != 0) {
+            srv_error(server, "flush_standbys: dropping standby %d: %s\n", c->sock, strerror(errno));
+
+            close_client(server, c);
+        }
+    }
+}
+
+void remove_standby(struct server *server, struct client *standby) {
+    for (size_t index = 0; index < server->standbys; ++index) {
+        if (server->standby[index] == standby) {
+            server->standbys -= 1;
+            server->standby[index] = server->standby[server->standbys];
+
+            break;
+        }
+    }
+
+    if (standby->sock >= 0) {
+        FD_CLR(standby->sock, &server->write_socks);
+    }
+}
+
+void replicate_join(struct server *server, struct client *client) {
+    uint8_t payload[12] = {0};
+    uint32_t id = htonl(client->id);
+    uint16_t family = htons(client->cold->addr.sa_family);
+
+    memcpy(payload, &id, 4);
+    memcpy(payload + 4, &family, 2);
+
+    if (client->cold->addr.sa_family == AF_INET) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)&client->cold->addr;
+
+        memcpy(payload + 6, &v4->sin_addr.s_addr, 4);
+        memcpy(payload + 10, &v4->sin_port, 2);
+    }
+
+    replicate_send(server, REPL_JOIN, (uint32_t)(client - server->clients), payload, sizeof(payload));
+}
+
+void replicate_publish(struct server *server, struct client *client, const uint8_t *buffer, size_t len) {
+    if (server->standbys == 0) {
+        return;
+    }
+
+    uint8_t op = client->cold->meta != NULL ? REPL_PUBLISH_META : REPL_PUBLISH;
+    uint8_t payload[REPL_BUFF_SIZE];
+    uint64_t hash = htobe64(client->cold->catalog_hash);
+
+    if (len + 8 > sizeof(payload)) {
+        srv_error(server, "replicate_publish: catalog too large to replicate: %lu\n", len);
+        return;
+    }
+
+    memcpy(payload, &hash, 8);
+    memcpy(payload + 8, buffer, len);
+
+    replicate_send(server, op, (uint32_t)(client - server->clients), payload, len + 8);
+}
+
+void replicate_ttl(struct server *server, struct client *client) {
+    uint32_t ttl = htonl(client->cold->ttl);
+
+    replicate_send(server, REPL_TTL, (uint32_t)(client - server->clients), (uint8_t *)&ttl, 4);
+}
+
+void replicate_drop(struct server *server, struct client *client) {
+    replicate_send(server, REPL_DROP, (uint32_t)(client - server->clients), NULL, 0);
+}
+
+void apply_replication(struct server *server, uint8_t op, uint8_t *payload, size_t len) {
+    if (len < 4) {
+        srv_warn(server, "apply_replication: frame missing key\n");
+        return;
+    }
+
+    uint32_t key = 0;
+
+    memcpy(&key, payload, 4);
+    key = ntohl(key);
+
+    struct client *mirror = find_mirror(server, key);
+
+    switch (op) {
+    case REPL_JOIN: {
+        if (len != 16) {
+            srv_warn(server, "apply_replication: invalid join frame\n");
+            return;
+        }
+
+        if (mirror == NULL) {
+            for (size_t index = 0; index < server->max_conn; ++index) {
+                if (!server->clients[index].active) {
+                    mirror = &server->clients[index];
+                    mirror->active = true;
+                    mirror->sock = -1;
+                    mirror->cold->origin = key;
+                    server->active_clients += 1;
+
+                    id_map_put(&server->mirror_keys, key, index);
+                    break;
+                }
+            }
+
+            if (mirror == NULL) {
+                srv_warn(server, "apply_replication: no room for mirrored client\n");
+                return;
+            }
+        }
+
+        uint32_t id = 0;
+        uint16_t family = 0;
+
+        memcpy(&id, payload + 4, 4);
+        memcpy(&family, payload + 8, 2);
+
+        memset(&mirror->cold->addr, 0, sizeof(mirror->cold->addr));
+
+        if (ntohs(family) == AF_INET) {
+            struct sockaddr_in *v4 = (struct sockaddr_in *)&mirror->cold->addr;
+
+            v4->sin_family = AF_INET;
+            memcpy(&v4->sin_addr.s_addr, payload + 10, 4);
+            memcpy(&v4->sin_port, payload + 14, 2);
+        } else {
+            mirror->cold->addr.sa_family = ntohs(family);
+        }
+
+        mirror->cold->site = locate_site(server, &mirror->cold->addr);
+
+        size_t slot = (size_t)(mirror - server->clients);
+
+        if (mirror->type != CLIENT_UNKNOWN) {
+            id_map_remove(&server->mirror_ids, mirror->id, slot);
+        }
+
+        set_client_id(server, mirror, ntohl(id));
+        mirror->type = CLIENT_JOINED;
+
+        id_map_put(&server->mirror_ids, mirror->id, slot);
+
+        srv_info(server, "apply_replication: mirrored join. key: %u id: %u\n", key, mirror->id);
+
+        break;
+    }
+    case REPL_PUBLISH:
+    case REPL_PUBLISH_META: {
+        if (mirror == NULL) {
+            srv_warn(server, "apply_replication: publish for unknown key: %u\n", key);
+            return;
+        }
+
+        if (len < 12) {
+            srv_warn(server, "apply_replication: publish missing hash for key: %u\n", key);
+            return;
+        }
+
+        uint8_t *files = NULL;
+        struct file_meta *meta = NULL;
+        size_t files_len = 0;
+        uint64_t hash = 0;
+
+        memcpy(&hash, payload + 4, 8);
+
+        if (!parse_publish(server, payload + 12, len - 12, &files, op == REPL_PUBLISH_META ? &meta : NULL, &files_len)) {
+            return;
+        }
+
+        clear_client_files(server, mirror);
+
+        mirror->files = files;
+        mirror->cold->meta = meta;
+        mirror->files_len = files_len;
+        mirror->cold->catalog_hash = be64toh(hash);
+        mirror->cold->catalog_mem = catalog_size(files, meta, files_len);
+
+        // the primary already applied its limits, so the mirror is only
+        // counted and never rejected
+        mem_charge(server, mirror, mirror->cold->catalog_mem);
+
+        // clients watching on the standby hear about it as well
+        notify_watchers(server, mirror);
+
+        srv_info(server, "apply_replication: mirrored publish. key: %u files: %lu\n", key, files_len);
+
+        break;
+    }
+    case REPL_TTL: {
+        if (mirror == NULL || len != 8) {
+            srv_warn(server, "apply_replication: invalid ttl for key: %u\n", key);
+            return;
+        }
+
+        uint32_t ttl = 0;
+
+        memcpy(&ttl, payload + 4, 4);
+
+        // the expiry is restarted from our own clock, which is close enough
+        // since the frame was sent as soon as the primary got the request
+        mirror->cold->ttl = ntohl(ttl);
+        mirror->cold->expires = mirror->cold->ttl == 0 ? 0 : server->now + (uint64_t)mirror->cold->ttl * 1000;
+
+        schedule_expiry(server, mirror);
+
+        break;
+    }
+    case REPL_RESYNC:
+        srv_warn(server, "apply_replication: fell behind the primary, resyncing\n");
+
+        drop_mirrors(server);
+
+        break;
+    case REPL_DROP:
+        if (mirror == NULL) {
+            return;
+        }
+
+        srv_info(server, "apply_replication: mirrored drop. key: %u\n", key);
+
+        drop_mirror(server, mirror);
+
+        break;
+    default:
+        srv_warn(server, "apply_replication: unknown op: %u\n", op);
+        break;
+    }
+}
+
+struct client* find_mirror(struct server *server, uint32_t key) {
+    ssize_t slot = id_map_get(&server->mirror_keys, key);
+
+    return slot >= 0 ? &server->clients[slot] : NULL;
+}
+
+void drop_mirror(struct server *server, struct client *mirror) {
+    size_t slot = (size_t)(mirror - server->clients);
+
+    id_map_remove(&server->mirror_ids, mirror->id, slot);
+    id_map_remove(&server->mirror_keys, (uint32_t)mirror->cold->origin, slot);
+
+    clear_client(server, mirror);
+    server->active_clients -= 1;
+}
+
+void park_mirrors(struct server *server) {
+    // the mirrors have to be reclaimed even when resuming is disabled, or the
+    // catalogs of peers that never fail over to this server stay forever
+    uint64_t grace = server->grace != 0 ? server->grace : DEFAULT_RESUME_GRACE * 1000;
+    size_t parked = 0;
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *mirror = &server->clients[index];
+
+        if (!mirror->active || mirror->cold->origin < 0) {
+            continue;
+        }
+
+        mirror->parked = true;
+
+        if (mirror->cold->expires == 0 || server->now + grace < mirror->cold->expires) {
+            mirror->cold->expires = server->now + grace;
+        }
+
+        schedule_expiry(server, mirror);
+
+        parked += 1;
+    }
+
+    srv_info(server, "park_mirrors: keeping %lu mirrored catalogs for %lu ms\n", parked, grace);
+}
+
+void drop_mirrors(struct server *server) {
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *mirror = &server->clients[index];
+
+        if (mirror->active && mirror->cold->origin >= 0) {
+            drop_mirror(server, mirror);
+        }
+    }
+}
+
+struct client* find_client_by_id(struct server *server, uint32_t id) {
+    ssize_t slot = id_map_get(&server->ids, id);
+
+    return slot >= 0 ? &server->clients[slot] : NULL;
+}
+
+bool id_map_init(struct id_map *map, size_t max) {
+    // at most half full keeps the probe sequences short
+    size_t cap = 16;
+
+    while (cap < max * 2) {
+        cap *= 2;
+    }
+
+    map->entries = malloc(sizeof(struct id_entry) * cap);
+
+    if (map->entries == NULL) {
+        return false;
+    }
+
+    for (size_t index = 0; index < cap; ++index) {
+        map->entries[index].slot = ID_MAP_EMPTY;
+    }
+
+    map->mask = cap - 1;
+
+    return true;
+}
+
+void id_map_free(struct id_map *map) {
+    free(map->entries);
+
+    map->entries = NULL;
+}
+
+size_t id_map_hash(struct id_map *map, uint64_t id) {
+    // peer ids are often sequential, the multiply spreads them over the
+    // upper bits which are the ones that are kept
+    return (size_t)((id * 0x9e3779b97f4a7c15ull) >> 32) & map->mask;
+}
+
+ssize_t id_map_get(struct id_map *map, uint64_t id) {
+    for (size_t index = id_map_hash(map, id);; index = (index + 1) & map->mask) {
+        struct id_entry *entry = &map->entries[index];
+
+        if (entry->slot == ID_MAP_EMPTY) {
+            return -1;
+        }
+
+        if (entry->id == id) {
+            return (ssize_t)entry->slot;
+        }
+    }
+}
+
+void id_map_put(struct id_map *map, uint64_t id, size_t slot) {
+    for (size_t index = id_map_hash(map, id);; index = (index + 1) & map->mask) {
+        struct id_entry *entry = &map->entries[index];
+
+        if (entry->slot == ID_MAP_EMPTY || entry->id == id) {
+            entry->id = id;
+            entry->slot = (uint32_t)slot;
+
+            return;
+        }
+    }
+}
+
+void id_map_remove(struct id_map *map, uint64_t id, size_t slot) {
+    size_t hole = id_map_hash(map, id);
+
+    for (;; hole = (hole + 1) & map->mask) {
+        if (map->entries[hole].slot == ID_MAP_EMPTY) {
+            return;
+        }
+
+        if (map->entries[hole].id == id) {
+            break;
+        }
+    }
+
+    if (map->entries[hole].slot != slot) {
+        return;
+    }
+
+    // move the entries after the hole back if the hole is between where
+    // they hash to and where they are, otherwise lookups would stop at the
+    // hole before reaching them
+    for (size_t next = (hole + 1) & map->mask; map->entries[next].slot != ID_MAP_EMPTY; next = (next + 1) & map->mask) {
+        size_t home = id_map_hash(map, map->entries[next].id);
+
+        if (((next - home) & map->mask) >= ((next - hole) & map->mask)) {
+            map->entries[hole] = map->entries[next];
+            hole = next;
+        }
+    }
+
+    map->entries[hole].slot = ID_MAP_EMPTY;
+}
+
+char* get_ipv4_port(struct sockaddr_in* addr, char* str, size_t len, bool inc_port) {
+    if (inet_ntop(AF_INET, &addr->sin_addr, str, len) == NULL) {
+        return NULL;
+    }
+
+    if (inc_port) {
+        // short cut this since the minimum size of an IPv4 address is 7
+        // characters
+        size_t wrote = strlen(str + 7) + 7;
+
+        if (wrote + 6 > len) {
+            return str;
+        }
+
+        if (snprintf(str + wrote, len - wrote, ":%u", ntohs(addr->sin_port)) < 0) {
+            return NULL;
+        } else {
+            return str;
+        }
+    } else {
+        return str;
+    }
+}
+
+char* get_ipv6_port(struct sockaddr_in6* addr, char* str, size_t len, bool inc_port) {
+    if (inet_ntop(AF_INET6, &addr->sin6_addr, str, len) == NULL) {
+        return NULL;
+    }
+
+    if (inc_port) {
+        // the address could be between 3 and 45 characters for IPv6 so
+        // there is not much of a gain here
+        size_t wrote = strlen(str + 3) + 3;
+
+        if (wrote + 6 > len) {
+            return str;
+        }
+
+        if (snprintf(str + wrote, len - wrote, ":%u", ntohs(addr->sin6_port)) < 0) {
+            return NULL;
+        } else {
+            return str;
+        }
+    } else {
+        return str;
+    }
+}
+
+char* get_ip_port(struct sockaddr* addr, char* str, size_t len, bool inc_port) {
+    if (addr->sa_family == AF_INET) {
+        struct sockaddr_in *v4 = (struct sockaddr_in *)addr;
+
+        return get_ipv4_port(v4, str, len, inc_port);
+    } else if (addr->sa_family == AF_INET6) {
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)addr;
+
+        return get_ipv6_port(v6, str, len ,inc_port);
+    } else {
+        return NULL;
+    }
+}
+
+// pulled from the h1-counter
+int send_bytes(int sock, const uint8_t *buff, size_t len) {
+    size_t total_sent = 0;
+
+    while (total_sent < len) {
+        ssize_t sent = send(sock, buff + total_sent, len - total_sent, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+
+            // client sockets are non blocking so wait a bounded amount of
+            // time for the client to read what it has been sent
+            struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+
+            if (poll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            continue;
+        }
+
+        total_sent += (size_t)sent;
+    }
+
+    return 0;
+}
+
+void print_buffer(FILE* output, const uint8_t *buff, size_t length, uint8_t flags) {
+    fprintf(output, "buffer:");
+
+    for (size_t index = 0; index < length; ++index) {
+        if (buff[index] <= 0x0f) {
+            fprintf(output, " 0%x", buff[index]);
+        } else {
+            fprintf(output, " %x", buff[index]);
+        }
+    }
+
+    if ((flags & VERBOSE) == VERBOSE) {
+        fprintf(output, "\n      :");
+
+        for (size_t index = 0; index < length; ++index) {
+            if (buff[index] == '\n') {
+                // if the characters is \n then we will escape and display it
+                fprintf(output, " \\n");
+            } else if (buff[index] < 32) {
+                // vs trying to print the control characters we will just print
+                // CC for "control character"
+                fprintf(output, " CC");
+            } else if (buff[index] >= 128) {
+                // this is an extended ascii character but we are not going to
+                // print it
+                fprintf(output, " EE");
+            } else {
+                // a printable character
+                fprintf(output, "  %c", buff[index]);
+            }
+        }
+
+        fprintf(output, "\n");
+    } else {
+        fprintf(output, "\n");
+    }
+}
@@ -0,0 +1,1355 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "shm_ring.h"
+
+#define BUFF_SIZE 2048
+
+// how long send_bytes will wait for a full socket buffer to drain
+#define SEND_TIMEOUT_MS 1000
+
+// default max number of requests handled for a single client before the loop
+// moves on to the next client, can be changed with --client-slice
+#define DEFAULT_SLICE 16
+
+// default number of seconds the catalog of a registered client is kept after
+// its connection drops, can be changed with --resume-grace
+#define DEFAULT_RESUME_GRACE 30
+
+// default average time in ms the loop can take to get through a round of
+// events before publishes are shed, 0 never sheds. can be changed with
+// --max-lag
+#define DEFAULT_MAX_LAG 0
+// weight of the newest round in the average loop lag and queue depth
+#define LAG_WEIGHT 0.125
+
+#define IPLEN_AND_PORT 51
+
+// size of the buffer used to read the replication stream from a primary.
+// needs to hold at least one full frame
+#define REPL_BUFF_SIZE 4096
+// op + payload length
+#define REPL_HEADER_SIZE 5
+// most standby registries that can attach to one primary
+#define REPL_MAX_STANDBYS 8
+// bytes of the replication stream a standby can fall behind by before it is
+// resynced, on top of the snapshot it attached with
+#define REPL_PENDING_MAX (4 * 1024 * 1024)
+
+// id + ipv4 + port
+#define SEARCH_RESPONSE_SIZE 10
+// size + hash in front of every name of a PUBLISH_META request
+#define META_SIZE 16
+// id + ipv4 + port + size + hash
+#define SEARCH_META_RECORD 26
+// max number of owners returned for a SEARCH_META request
+#define SEARCH_META_MAX 32
+// longer than any name a WATCH request can carry
+#define WATCH_NAME_MAX 100
+// max number of names a single client can watch
+#define WATCH_MAX 64
+// action + id + ipv4 + port in front of the name of a notification
+#define NOTIFY_HEADER_SIZE 11
+// bytes of notifications a watcher can have waiting for its socket before it
+// is closed
+#define NOTIFY_PENDING_MAX (64 * 1024)
+// marks an unused entry of an id map
+#define ID_MAP_EMPTY UINT32_MAX
+
+// max number of entries in a page of a LIST response
+#define LIST_PAGE 64
+// max size in bytes of a page of a LIST response
+#define LIST_PAGE_SIZE 4096
+// count + next cursor
+#define LIST_HEADER_SIZE 10
+// the cursor sent with the last page of a LIST response
+#define LIST_END UINT64_MAX
+// rows and counters per row of the search count sketch
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024
+// number of most searched names tracked
+#define HOT_NAMES 16
+// large enough for any name check_file_name accepts
+#define HOT_NAME_MAX 100
+// every counter is halved this often so the counts follow current demand
+#define SEARCH_DECAY_MS 60000
+// number of clients using the most memory reported by STATS
+#define TOP_CONSUMERS 8
+
+// a recording starts with RECORD_MAGIC followed by one record per request:
+// [us since the previous record: u32][connection: u32][latency us: u32]
+// [length: u16][request]. a record with a length of 0 marks the connection
+// closing
+#define RECORD_MAGIC "REGREC1\n"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_HEADER_SIZE 14
+
+// logs are written to a file named after the start time and search results
+// are printed. can be turned off with -DTEST_OUTPUT=false
+#ifndef TEST_OUTPUT
+#define TEST_OUTPUT true
+#endif
+
+/**
+ * the three different states for a connected client
+ */
+enum client_state {
+    // the client is connected but not join joined or registered
+    CLIENT_UNKNOWN,
+    // the client has joined
+    CLIENT_JOINED,
+    // the client has registered
+    CLIENT_REGISTERED,
+    // the client is a standby registry receiving the replication stream
+    CLIENT_STANDBY,
+};
+
+/**
+ * the action codes that a client can send to the server. the first byte of
+ * every request
+ */
+enum action {
+    ACTION_JOIN = 0,
+    ACTION_PUBLISH = 1,
+    ACTION_SEARCH = 2,
+    // 3 is FETCH which is only sent between peers
+    ACTION_REPLICATE = 4,
+    // only accepted over the unix socket, the response carries a memfd
+    ACTION_SHM_ATTACH = 5,
+    // [ttl seconds: u32][the PUBLISH request body]
+    ACTION_PUBLISH_TTL = 6,
+    // keeps a catalog published with a ttl alive for another ttl
+    ACTION_HEARTBEAT = 7,
+    // [count: u32] then [size: u64][hash: u64][name] for every file
+    ACTION_PUBLISH_META = 8,
+    // [ttl seconds: u32][the PUBLISH_META request body]
+    ACTION_PUBLISH_META_TTL = 9,
+    // [name], answered with [count: u16] and a record for every owner
+    ACTION_SEARCH_META = 10,
+    // [mode: u8][name], mode 0 watches the exact name and 1 a prefix
+    ACTION_WATCH = 11,
+    // same body as WATCH, removes the watch again
+    ACTION_UNWATCH = 12,
+    // only sent by the registry, unsolicited, to a client watching a name
+    // that was published: [id: u32][ipv4: u32][port: u16][name]. the other
+    // responses have no header so peers should watch on their own connection
+    ACTION_NOTIFY = 13,
+    // [cursor: u64], 0 to start from the beginning. answered with a stream
+    // of pages [count: u16][next cursor: u64] followed by [id: u32][name]
+    // for every entry. the last page has LIST_END as the next cursor
+    ACTION_LIST = 14,
+    // [ttl seconds: u32, 0 for none][count: u32] then for every name
+    // [shared: u8][suffix len: u8][suffix]. shared is the number of leading
+    // bytes taken from the name before it, so sorted names shrink a lot
+    ACTION_PUBLISH_FC = 15,
+    // [id: u32][the PUBLISH request body], joins and publishes at once and
+    // is answered with [status: u8][resume token: u64]. the token is 0 if
+    // sessions can not be resumed
+    ACTION_REGISTER = 16,
+    // [resume token: u64], takes back the catalog of a registered client
+    // whose connection dropped. answered like REGISTER
+    ACTION_RESUME = 17,
+    // [ttl seconds: u32, 0 for none][catalog hash: u64], answered with
+    // [status: u8]. if the hash matches the catalog already published then
+    // it is kept as is and the ttl applied, otherwise the peer publishes
+    ACTION_PUBLISH_IF = 18,
+    // no payload, answered with [len: u32] followed by sections of
+    // [stats_section: u8][len: u16][payload]
+    ACTION_STATS = 19,
+};
+
+/**
+ * the sections of a STATS response. unknown sections can be skipped by
+ * their length
+ */
+enum stats_section {
+    // [count: u8] then [estimated searches: u32][name] for every name, most
+    // searched first
+    STATS_HOT_NAMES = 1,
+    // [average loop lag in us: u32][average queue depth: u32][shedding: u8]
+    // [publishes shed: u64]
+    STATS_LOAD = 2,
+    // [bytes used by all clients: u64][count: u8] then [id: u32][bytes: u64]
+    // for the clients using the most, largest first
+    STATS_MEMORY = 3,
+};
+
+/**
+ * the status sent back for a PUBLISH_IF request
+ */
+enum publish_if_status {
+    CATALOG_UNCHANGED = 0,
+    // the registry has a different catalog or none at all
+    CATALOG_CHANGED = 1,
+    // the registry is overloaded and not taking publishes right now
+    CATALOG_BUSY = 2,
+};
+
+/**
+ * the status sent back for a REGISTER request
+ */
+enum register_status {
+    REGISTER_OK = 0,
+    // another client has joined with the same id
+    REGISTER_ID_IN_USE = 1,
+    // the client has already joined or the request is invalid
+    REGISTER_INVALID = 2,
+    // RESUME was sent with a token that has no session, the session expired
+    // or the peer joined again without it
+    REGISTER_UNKNOWN_TOKEN = 3,
+    // the registry is overloaded and not taking publishes right now
+    REGISTER_BUSY = 4,
+};
+
+/**
+ * the operations sent from a primary to a standby over the replication
+ * stream. every frame is [op: u8][payload len: u32][payload]
+ */
+enum repl_op {
+    // payload: [key: u32][id: u32][family: u16][ipv4: u32][port: u16]
+    REPL_JOIN = 0,
+    // payload: [key: u32][catalog hash: u64][the PUBLISH request body]. the
+    // hash is the one the primary stored, which is not the hash of the body
+    // if the catalog was published front coded
+    REPL_PUBLISH = 1,
+    // payload: [key: u32]
+    REPL_DROP = 2,
+    // payload: [key: u32][ttl seconds: u32], sent on publish and heartbeat
+    REPL_TTL = 3,
+    // payload: [key: u32][catalog hash: u64][the PUBLISH_META request body]
+    REPL_PUBLISH_META = 4,
+    // payload: [key: u32], the key is unused. the standby fell behind and a
+    // new snapshot follows, every mirror is dropped
+    REPL_RESYNC = 5,
+};
+
+/**
+ * an entry in the expiry heap. entries are never removed early, when one
+ * fires it is checked against the client and dropped if it is stale
+ */
+struct timer {
+    // time in ms that the timer fires
+    uint64_t at;
+    // index of the client in the client list
+    size_t slot;
+};
+
+/**
+ * a subnet from the --locality file
+ */
+struct locality {
+    // network address and mask in host byte order
+    uint32_t net;
+    uint32_t mask;
+    // site the subnet belongs to, subnets with the same label share a site.
+    // starts at 1 since 0 is used for addresses outside every subnet
+    uint32_t site;
+};
+
+/**
+ * a name in the heap of the most searched names
+ */
+struct hot_name {
+    // estimated number of searches, the heap is ordered by it
+    uint32_t count;
+    // hash_catalog of the name, compared before the name itself
+    uint64_t hash;
+    char name[HOT_NAME_MAX];
+};
+
+/**
+ * counts of searched names, hits and misses alike. the sketch over counts
+ * names that share a counter but never under counts, so the estimate of a
+ * name is the smallest of its counters. it takes the same memory no matter
+ * how many distinct names are searched for
+ */
+struct search_stats {
+    uint32_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    // min heap of the most searched names, the least searched is on top so
+    // it can be replaced
+    struct hot_name hot[HOT_NAMES];
+    size_t hot_len;
+    // time in ms of the last decay
+    uint64_t decayed_at;
+};
+
+/**
+ * metadata published along with a file name. the hash is computed by the
+ * peers, the registry only compares it
+ */
+struct file_meta {
+    // size of the file in bytes
+    uint64_t size;
+    // hash of the file content
+    uint64_t hash;
+};
+
+/**
+ * an entry of an id map
+ */
+struct id_entry {
+    // peer id, or resume token for the token map
+    uint64_t id;
+    // slot of the client, ID_MAP_EMPTY if the entry is unused
+    uint32_t slot;
+};
+
+/**
+ * open addressing hash map from an id to the slot of a client. it is sized
+ * for max_conn when the server starts so it never has to grow, and entries
+ * are shifted back on removal so churn does not leave tombstones behind
+ */
+struct id_map {
+    struct id_entry *entries;
+    // number of entries minus one, the number of entries is a power of two
+    size_t mask;
+};
+
+/**
+ * a name or prefix watched by a client. watches are chained in the buckets of
+ * the server's watch table and in a list for the client that owns them
+ */
+struct watch {
+    // hash of the name, see hash_name
+    uint32_t hash;
+    // matches every name starting with this one
+    bool prefix;
+    // slot of the watching client
+    size_t slot;
+    // next watch in the same bucket
+    struct watch *next;
+    // next watch of the same client
+    struct watch *next_client;
+    // length of the name without the terminator
+    size_t len;
+    char name[];
+};
+
+/**
+ * a name waiting to be packed into a catalog, see pack_catalog
+ */
+struct packing {
+    const char *name;
+    // position of the name in the request, used to reorder the metadata
+    size_t index;
+};
+
+/**
+ * an owner of a file collected while answering a SEARCH_META request
+ */
+struct file_owner {
+    struct client *client;
+    // copied since clients without metadata do not have any to point at
+    struct file_meta meta;
+    // see owner_distance, 0 for every owner if searches are not ranked
+    uint32_t distance;
+};
+
+/**
+ * the state of a client that is only needed once the client has been
+ * picked, see struct client
+ */
+struct client_cold {
+    // the socketaddr information of the connected client
+    struct sockaddr addr;
+    // size and hash of every file, NULL if the catalog was published
+    // without metadata
+    struct file_meta *meta;
+    // hash of the publish body the catalog was parsed from, see
+    // hash_catalog. 0 if there is no catalog
+    uint64_t catalog_hash;
+    // site of the client's address, see locate_site
+    uint32_t site;
+    // bytes allocated for the client: its catalog, buffers and watches
+    size_t mem;
+    // bytes of mem taken by the catalog, see catalog_size
+    size_t catalog_mem;
+    // the key of the client on the primary if this is a mirror created from
+    // the replication stream, -1 for clients connected to this server
+    int64_t origin;
+    // bytes received from the client that do not make up a full request yet
+    uint8_t *in_buf;
+    // number of bytes stored in in_buf
+    size_t in_len;
+    // tokens left in the client's bucket, every request takes one
+    double tokens;
+    // the last time in ms that tokens were added to the bucket
+    uint64_t refilled_at;
+    // ttl in seconds of the published catalog, 0 if it does not expire
+    uint32_t ttl;
+    // time in ms that the catalog expires unless a heartbeat comes in, 0 if
+    // it does not expire
+    uint64_t expires;
+    // time in ms of the timer that will check this slot next, 0 if there
+    // is none. belongs to the slot and not the client so it is not reset
+    uint64_t timer_at;
+    // names watched by the client
+    struct watch *watching;
+    // number of watches in the list
+    size_t watching_len;
+    // position in the catalog of the next page to send
+    uint64_t cursor;
+    // page of a LIST response, allocated on the first LIST
+    uint8_t *out_buf;
+    // number of bytes in out_buf
+    size_t out_len;
+    // number of bytes of out_buf that have been sent
+    size_t out_sent;
+    // token handed out at REGISTER that lets the peer take the catalog back
+    // after a reconnect, 0 if it has none
+    uint64_t token;
+    // number of the connection in a recording, see record_request
+    uint32_t conn;
+    // the SEARCH response naming this client, built when the id is set so a
+    // search hit is a single copy. all zeros if the address is not ipv4
+    // since peers cannot be pointed at it
+    uint8_t found[SEARCH_RESPONSE_SIZE];
+    // address of found as ip:port for the TEST] lines, empty if it is all
+    // zeros
+    char found_ip[IPLEN_AND_PORT];
+    // replication frames for a standby, or notifications for a watcher, that
+    // its socket has not taken yet. sent from the main loop by
+    // flush_standbys and flush_watchers
+    uint8_t *pending;
+    // bytes queued in pending, how many of them have been sent and the size
+    // of pending
+    size_t pending_len;
+    size_t pending_sent;
+    size_t pending_cap;
+    // unsent bytes the client can have queued before it is dropped
+    size_t pending_max;
+    // the standby fell behind, the stream is held back until pending has
+    // been sent and then a new snapshot is queued
+    bool resync;
+};
+
+/**
+ * relevant data we want to store about a connected client. only the fields
+ * the loops over every slot look at are kept here and the rest is in cold,
+ * so a scan pulls 48 bytes per slot through the cache and not the buffers,
+ * addresses and bookkeeping behind them
+ */
+struct client {
+    // determines if the current client struct is active or not
+    bool active;
+    // the client has requests waiting that did not fit in its slice or its
+    // bucket. the socket is not read again until they have been handled
+    bool deferred;
+    // the client is being sent the catalog for a LIST request
+    bool listing;
+    // the connection dropped and the catalog is kept until the peer resumes
+    // or the grace period ends. the socket is closed and set to -1
+    bool parked;
+    // type specified by client_state
+    int type;
+    // socket file descriptor
+    int sock;
+    // client id provided by the client
+    uint32_t id;
+    // number of files current stored in the server
+    size_t files_len;
+    // names published by the client, sorted and packed into a single
+    // allocation, see pack_catalog
+    uint8_t *files;
+    // shared memory ring if the client has attached one. all requests are
+    // then read from the ring and the socket is only used as a doorbell
+    struct shm_ring *ring;
+    // the rest of the client's state, a slot of server->cold
+    struct client_cold *cold;
+};
+
+enum server_output {
+    STDOUT_LOG,
+    FILE_LOG,
+    // logging is disabled, used when benchmarking
+    NO_LOG,
+};
+
+/**
+ * relevant state data we want to store for the server
+ */
+struct server {
+    // max number of active connections the server will handle
+    size_t max_conn;
+    // max number of files that a client can publish to the server
+    size_t max_files;
+    // total number of active clients
+    size_t active_clients;
+    // list of client structs
+    struct client *clients;
+    // the cold half of every slot in clients, at the same index
+    struct client_cold *cold;
+    // slot engine_connect starts looking for a free one from. slots are
+    // handed out round robin so a connect does not scan past every taken
+    // slot at the front of the list
+    size_t next_slot;
+    // server socket file descriptor
+    int listen_sock;
+    // all currently connected sockets
+    fd_set all_socks;
+    // the currently highest socket value
+    int max_socket;
+    // output type
+    int output_type;
+    // output stream
+    FILE* output;
+    // socket connected to the primary when running as a standby, -1 otherwise
+    int repl_sock;
+    // number of bytes currently stored in repl_buffer
+    size_t repl_len;
+    // partial frames received from the primary
+    uint8_t repl_buffer[REPL_BUFF_SIZE];
+    // standby registries currently attached to this server
+    struct client *standby[REPL_MAX_STANDBYS];
+    // number of entries in standby
+    size_t standbys;
+    // udp socket answering stateless SEARCH datagrams, -1 if not enabled
+    int udp_sock;
+    // unix domain socket listening for co-located peers, -1 if not enabled
+    int unix_sock;
+    // number of clients with an attached shared memory ring
+    size_t rings;
+    // busy polling the rings only pays off if the peers run on another cpu
+    bool spin;
+    // size of the listen queue for the listening sockets
+    int backlog;
+    // lookup of connected clients by socket. select can not handle sockets
+    // past FD_SETSIZE so that is all we need
+    struct client *by_sock[FD_SETSIZE];
+    // monotonic time in ms, updated once per iteration of the main loop
+    uint64_t now;
+    // requests per second added to every client's bucket, 0 is unlimited
+    double rate;
+    // max number of tokens a client's bucket can hold
+    double burst;
+    // max number of requests handled for a client per loop iteration
+    size_t slice;
+    // number of clients currently deferred
+    size_t deferred;
+    // min heap of catalog expiry timers
+    struct timer *timers;
+    // number of timers in the heap
+    size_t timers_len;
+    // allocated size of the heap
+    size_t timers_cap;
+    // hash table of watched names
+    struct watch **watches;
+    // number of buckets, always a power of two
+    size_t watches_cap;
+    // number of watches in the table
+    size_t watches_len;
+    // number of prefix watches of every length. a publish only looks up the
+    // prefixes of a name at the lengths that are actually watched
+    size_t prefix_watches[WATCH_NAME_MAX];
+    // slots of the joined clients connected to this server by peer id
+    struct id_map ids;
+    // slots of the mirrored clients by peer id
+    struct id_map mirror_ids;
+    // slots of the mirrored clients by their key on the primary
+    struct id_map mirror_keys;
+    // slots of the registered clients by resume token
+    struct id_map tokens;
+    // ms a parked catalog is kept for, 0 disables resuming
+    uint64_t grace;
+    // state of the generator resume tokens are drawn from instead of
+    // getrandom, 0 to use getrandom. set by simulations so runs repeat
+    uint64_t seed;
+    // searches return the owner closest to the requester instead of the
+    // first one found, set by --locality
+    bool ranked;
+    // subnets from the locality file, longest prefix first
+    struct locality *localities;
+    size_t localities_len;
+    // label of every site, the site number is the index plus one
+    char **sites;
+    size_t sites_len;
+    // most searched names
+    struct search_stats stats;
+    // moving average of the time in us the loop takes to get through one
+    // round of events. a request that arrives during a round waits about
+    // this long before it is looked at
+    double lag;
+    // moving average of the ready sockets and deferred clients per round
+    double queue_depth;
+    // lag in us and queue depth past which publishes are shed, 0 disables
+    uint64_t max_lag;
+    size_t max_queue;
+    // publishes are answered busy or dropped while searches are still served
+    bool shedding;
+    // number of publishes shed
+    uint64_t shed;
+    // bytes allocated for all clients, the sum of their mem
+    size_t mem;
+    // limits in bytes for the memory of all clients and of a single client,
+    // 0 for no limit. publishes that would go past them are rejected
+    size_t max_mem;
+    size_t client_mem;
+    // number of clients currently being sent a LIST response
+    size_t listing;
+    // number of watchers with notifications their socket has not taken yet
+    size_t backlogged;
+    // sockets of listing clients, standbys and watchers waiting for room in
+    // their send buffer
+    fd_set write_socks;
+    // responses sent to in-memory clients are copied here, see engine_feed
+    uint8_t *capture;
+    // number of bytes copied to capture and the size of capture
+    size_t capture_len;
+    size_t capture_cap;
+    // file the request stream is recorded to, NULL if not recording
+    FILE *record;
+    // time in us of the last record written
+    uint64_t recorded_at;
+    // number of connections made, the last one handed out as a conn
+    uint32_t conns;
+    // time in us the loop last woke up with ready sockets, the requests
+    // that came with them have been waiting since
+    uint64_t woke_at;
+};
+
+/**
+ * sets every field of the server to its default and allocates the client
+ * slots and id maps for max_conn clients. output and output_type are left to
+ * the caller. returns false if an allocation failed
+ */
+bool engine_init(struct server *server, size_t max_conn);
+
+/**
+ * drops every client and frees what engine_init and the clients allocated.
+ * the sockets of connected clients and the recording are closed but the
+ * listening sockets are left to the caller
+ */
+void engine_free(struct server *server);
+
+/**
+ * takes a free slot for a client on the given socket. a socket of -1 makes an
+ * in-memory client whose requests are handed over with engine_feed. returns
+ * NULL if every slot is taken or the allocation failed
+ */
+struct client* engine_connect(struct server *server, int sock, const struct sockaddr *addr);
+
+/**
+ * handles the requests in the given bytes for an in-memory client as if they
+ * had been received on its socket. the responses, including the pages of a
+ * LIST, are copied to out and the number of bytes copied is returned. a
+ * response that does not fit in what is left of out fails like a send on a
+ * broken socket. requests held back by the rate limit stay buffered until
+ * the next call
+ */
+size_t engine_feed(struct server *server, struct client *client, const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+
+/**
+ * moves the clock of the server to now, given in ms, and runs what is due:
+ * expired catalogs and the requests of deferred clients
+ */
+void engine_tick(struct server *server, uint64_t now);
+
+/**
+ * free the allocated strings stored for a client
+ */
+void clear_client_files(struct server *server, struct client *c);
+
+/**
+ * resets and frees allocated data for a client
+ */
+void clear_client(struct server *server, struct client *c);
+
+/**
+ * counts bytes allocated for a client
+ */
+void mem_charge(struct server *server, struct client *client, size_t bytes);
+
+/**
+ * counts bytes freed for a client
+ */
+void mem_release(struct server *server, struct client *client, size_t bytes);
+
+/**
+ * frees the request and LIST buffers of a client
+ */
+void free_buffers(struct server *server, struct client *client);
+
+/**
+ * returns the number of bytes allocated for a catalog
+ */
+size_t catalog_size(const uint8_t *files, struct file_meta *meta, size_t files_len);
+
+/**
+ * packs the names of a catalog into one allocation: an offset for every
+ * name in sorted order, then the names at those offsets, each as a 2 byte
+ * length, the bytes and a null. the metadata, if any, is reordered in place
+ * to match. returns NULL if the allocation failed
+ */
+uint8_t* pack_catalog(struct server *server, const char **names, struct file_meta *meta, size_t files_len);
+
+/**
+ * orders two entries of the list being packed by name and then by their
+ * position in the request
+ */
+int compare_packing(const void *a, const void *b);
+
+/**
+ * returns the name at the given index of a packed catalog
+ */
+const char* catalog_name(const uint8_t *files, size_t index);
+
+/**
+ * returns the length of the name at the given index of a packed catalog,
+ * without the null
+ */
+size_t catalog_name_len(const uint8_t *files, size_t index);
+
+/**
+ * returns the index of the first name in a packed catalog that is not
+ * less than the given one, files_len if there is none. all names starting
+ * with a prefix follow the one this returns for the prefix
+ */
+size_t catalog_lower_bound(const uint8_t *files, size_t files_len, const char *name, size_t len);
+
+/**
+ * checks if a client can replace its catalog with one of the given size.
+ * parked catalogs are evicted to make room if the server is over its limit
+ */
+bool admit_catalog(struct server *server, struct client *client, size_t size);
+
+/**
+ * frees a parsed catalog that was not installed
+ */
+void free_catalog(uint8_t *files, struct file_meta *meta);
+
+/**
+ * moves the catalog of one client over to another one
+ */
+void move_catalog(struct server *server, struct client *from, struct client *to);
+
+/**
+ * closes the server output if necessary
+ */
+void close_server_output(struct server* s);
+
+/**
+ * sends a response to the client over its socket or shared memory ring
+ */
+int client_send(struct server *server, struct client *client, const uint8_t *buf, size_t len);
+
+/**
+ * closes the connection of a client and releases everything it holds
+ */
+void close_client(struct server *server, struct client *client);
+
+/**
+ * returns the length of the first request in the buffer, 0 if the request is
+ * not complete yet or -1 if the bytes can never be a valid request
+ */
+ssize_t frame_length(struct server *server, const uint8_t *buffer, size_t len);
+
+/**
+ * handles the buffered requests of a client, up to its slice and as long as
+ * its bucket has tokens. anything left over defers the client
+ */
+size_t process_client(struct server *server, struct client *client);
+
+/**
+ * takes a token from the client's bucket, returns false if it is empty
+ */
+bool take_token(struct server *server, struct client *client);
+
+/**
+ * stops reading from the client until its waiting requests are handled
+ */
+void defer_client(struct server *server, struct client *client);
+
+/**
+ * starts reading from a deferred client again
+ */
+void resume_client(struct server *server, struct client *client);
+
+/**
+ * gives every deferred client another slice
+ */
+void run_deferred(struct server *server);
+
+/**
+ * returns the current monotonic time in ms
+ */
+uint64_t clock_ms();
+
+/**
+ * returns the current monotonic time in us
+ */
+uint64_t clock_us();
+
+/**
+ * adds the length of a round of the loop to the average lag and starts or
+ * stops shedding publishes
+ */
+void update_load(struct server *server, uint64_t round, size_t depth);
+
+/**
+ * sheds a publish while the server is overloaded. only the publishes that
+ * are answered with a status are shed so the peer knows to try again.
+ * returns false if the request has to be handled
+ */
+bool shed_request(struct server *server, struct client *client, uint8_t action);
+
+/**
+ * handles a single request from a client, the first byte is the action. the
+ * request is recorded if the server is recording
+ */
+void dispatch(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * calls the handler for the action of the request
+ */
+void handle_request(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * writes a record of a request that started being handled at the given time
+ * in us, or of the connection closing if len is 0. latency is the time in us
+ * from when the loop picked up the request until it was handled
+ */
+void record_request(struct server *server, uint32_t conn, uint64_t at, uint64_t latency, const uint8_t *buffer, size_t len);
+
+/**
+ * attempts to find the desired string for the given client if the string is
+ * found then it will return the pointer provided otherwise will return NULL
+ */
+struct client* search_client_files(struct server* server, const char* find, struct client* client);
+
+/**
+ * handles a join request sent by a client
+ */
+void handle_join(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * handles a register request, a join and a publish in a single request
+ */
+void handle_register(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * joins the client with the given id. returns REGISTER_OK or the reason the
+ * join was refused
+ */
+uint8_t join_client(struct server *server, struct client *client, uint32_t id);
+
+/**
+ * sets the id of the client and builds its SEARCH response from the id and
+ * address
+ */
+void set_client_id(struct server *server, struct client *client, uint32_t id);
+
+/**
+ * sends the [status][token] response of REGISTER and RESUME
+ */
+void send_session(struct server *server, struct client *client, uint8_t status);
+
+/**
+ * gives a registered client a random resume token if resuming is enabled
+ */
+void issue_token(struct server *server, struct client *client);
+
+/**
+ * handles a resume request, moves the catalog of the parked client with the
+ * token over to this connection
+ */
+void handle_resume(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * keeps the catalog of a registered client whose connection was closed until
+ * it resumes or the grace period ends
+ */
+void park_client(struct server *server, struct client *client);
+
+/**
+ * drops a parked client and its catalog
+ */
+void release_parked(struct server *server, struct client *client);
+
+/**
+ * handles a publish request sent by a client, with metadata if meta is set.
+ * returns true if the client's catalog was replaced
+ */
+bool handle_publish(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool meta);
+
+/**
+ * handles a publish request with front coded names
+ */
+void handle_publish_fc(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * decodes a list of front coded names straight into a packed catalog, the
+ * shared part of every name is copied from the one written before it. names
+ * that were not sent in order are sorted with pack_catalog. returns false
+ * if the body is invalid in which case nothing is allocated
+ */
+bool parse_front_coded(struct server *server, uint8_t *buffer, size_t len, uint8_t **files, size_t *files_len);
+
+/**
+ * replaces the catalog of a client with the parsed files
+ */
+void install_catalog(struct server *server, struct client *client, uint8_t *files, struct file_meta *meta, size_t files_len);
+
+/**
+ * returns the length of a list of front coded names prefixed with a count,
+ * starting at the given offset. same return values as frame_length
+ */
+ssize_t front_coded_length(const uint8_t *buffer, size_t len, size_t start);
+
+/**
+ * handles a publish request that carries a ttl for the catalog
+ */
+void handle_publish_ttl(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool meta);
+
+/**
+ * handles a conditional publish, only compares the hash of the catalog
+ */
+void handle_publish_if(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * returns the 64 bit FNV-1a hash of a publish body, from the count to the
+ * end of the names. 0 is never returned since it means no catalog
+ */
+uint64_t hash_catalog(const uint8_t *buffer, size_t len);
+
+/**
+ * handles a heartbeat sent by a client to keep its catalog alive
+ */
+void handle_heartbeat(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * sets the ttl of a client's catalog and starts the expiry from now
+ */
+void set_ttl(struct server *server, struct client *client, uint32_t ttl);
+
+/**
+ * makes sure there is a timer that will check the client's catalog before it
+ * expires
+ */
+void schedule_expiry(struct server *server, struct client *client);
+
+/**
+ * fires the timers that are due and drops the catalogs that have expired
+ */
+void expire_catalogs(struct server *server);
+
+/**
+ * adds a timer to the expiry heap
+ */
+bool timer_push(struct server *server, uint64_t at, size_t slot);
+
+/**
+ * removes the earliest timer from the expiry heap
+ */
+struct timer timer_pop(struct server *server);
+
+/**
+ * replicates the ttl of a client's catalog to the standby registries
+ */
+void replicate_ttl(struct server *server, struct client *client);
+
+/**
+ * returns the length of a list of null terminated names prefixed with a
+ * count, starting at the given offset. every name is preceded by fixed bytes
+ * of metadata. same return values as frame_length
+ */
+ssize_t names_length(const uint8_t *buffer, size_t len, size_t start, size_t fixed);
+
+/**
+ * handles a search request sent by a client
+ */
+void handle_search(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * validates a search request and fills in the 10 byte response. the response
+ * is all zeros if the request is invalid or the file was not found
+ */
+void search_request(struct server *server, const uint8_t *buffer, size_t len, const struct sockaddr *from, uint8_t *response);
+
+/**
+ * finds a client that has published the given file name. when ranking this
+ * is the one closest to from, otherwise the first one found
+ */
+struct client* find_file(struct server *server, const char *name, const struct sockaddr *from);
+
+/**
+ * counts a search for the name in the sketch and the hot names
+ */
+void record_search(struct server *server, const char *name);
+
+/**
+ * halves every count once for every decay period that has passed
+ */
+void decay_searches(struct server *server);
+
+/**
+ * moves a hot name down the heap until its children are searched more
+ */
+void hot_sift_down(struct search_stats *stats, size_t index);
+
+/**
+ * moves a hot name up the heap until its parent is searched less
+ */
+void hot_sift_up(struct search_stats *stats, size_t index);
+
+/**
+ * handles a stats request sent by a client
+ */
+void handle_stats(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * reads the --locality file. every line is "ADDRESS/BITS LABEL", blank lines
+ * and lines starting with # are skipped
+ */
+bool load_localities(struct server *server, const char *path);
+
+/**
+ * returns the site of the longest subnet containing the address, 0 if there
+ * is none or the address is not ipv4
+ */
+uint32_t locate_site(struct server *server, const struct sockaddr *addr);
+
+/**
+ * returns how far an owner is from the requester. owners in the same site
+ * come first, then the owners sharing the longest address prefix
+ */
+uint32_t owner_distance(const struct sockaddr *from, uint32_t site, const struct client *owner);
+
+/**
+ * frees the subnets and site labels
+ */
+void free_localities(struct server *server);
+
+/**
+ * orders localities from the longest prefix to the shortest
+ */
+int compare_localities(const void *a, const void *b);
+
+/**
+ * returns the index of the file in the client's catalog or -1 if the client
+ * has not published it. the catalog is sorted so this is a binary search
+ */
+ssize_t find_client_file(struct server *server, const char *find, struct client *client);
+
+/**
+ * handles a list request sent by a client. the pages are sent from the main
+ * loop by run_listings
+ */
+void handle_list(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * sends the next pages to every listing client. returns true if there are
+ * pages that can be sent right away
+ */
+bool run_listings(struct server *server);
+
+/**
+ * sends up to a slice of pages to a listing client without blocking. returns
+ * true if it has more pages and its socket was not full
+ */
+bool list_client(struct server *server, struct client *client);
+
+/**
+ * fills a page with the entries starting at the cursor and moves the cursor
+ * past them. returns the size of the page
+ */
+size_t fill_page(struct server *server, uint64_t *cursor, uint8_t *page);
+
+/**
+ * stops listing to a client
+ */
+void end_listing(struct server *server, struct client *client);
+
+/**
+ * handles a watch or unwatch request sent by a client
+ */
+void handle_watch(struct server *server, struct client *client, uint8_t *buffer, size_t len, bool add);
+
+/**
+ * adds a watch for the client to the watch table. returns NULL on error
+ */
+struct watch* watch_add(struct server *server, struct client *client, const char *name, size_t len, bool prefix);
+
+/**
+ * removes a watch of the client from the watch table if it exists
+ */
+void watch_remove(struct server *server, struct client *client, const char *name, size_t len, bool prefix);
+
+/**
+ * removes every watch of the client
+ */
+void unwatch_all(struct server *server, struct client *client);
+
+/**
+ * unlinks a watch from its bucket and frees it. the caller unlinks it from
+ * the client's list
+ */
+void watch_free(struct server *server, struct watch *watch);
+
+/**
+ * doubles the number of buckets of the watch table
+ */
+bool watch_grow(struct server *server);
+
+/**
+ * sends a notification to every client watching one of the names in the
+ * catalog of the publisher
+ */
+void notify_watchers(struct server *server, struct client *publisher);
+
+/**
+ * sends a notification for every name already published that matches a new
+ * watch
+ */
+void notify_existing(struct server *server, struct client *client, struct watch *watch);
+
+/**
+ * queues a single notification that the publisher has the named file. a
+ * watcher that is too far behind on its notifications is closed
+ */
+void send_notify(struct server *server, struct client *watcher, struct client *publisher, const char *name);
+
+/**
+ * sends the queued notifications of every watcher that has some, called from
+ * the main loop
+ */
+void flush_watchers(struct server *server);
+
+/**
+ * FNV-1a of the first len bytes of the name
+ */
+uint32_t hash_name(const char *name, size_t len);
+
+/**
+ * validates the file name of a search request
+ */
+bool check_file_name(struct server *server, const uint8_t *buffer, size_t len);
+
+/**
+ * orders the owners of a file by the hash of their content and then by id
+ */
+int compare_owners(const void *a, const void *b);
+
+/**
+ * handles a search request that asks for every owner of a file along with
+ * the metadata each of them published
+ */
+void handle_search_meta(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * creates a shared memory ring for a client connected over the unix socket
+ * and passes the memfd back to it
+ */
+void handle_shm_attach(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * unmaps the shared memory ring of a client if it has one
+ */
+void detach_ring(struct server *server, struct client *client);
+
+/**
+ * processes the requests waiting in a client's shared memory ring. returns the
+ * number of requests handled
+ */
+size_t poll_ring(struct server *server, struct client *client);
+
+/**
+ * parses the body of a publish request into a packed catalog. if meta is
+ * not NULL then the body carries metadata for every file which is parsed
+ * into an allocated list as well. returns false if the body is invalid in
+ * which case nothing is allocated
+ */
+bool parse_publish(struct server *server, uint8_t *buffer, size_t len, uint8_t **files, struct file_meta **meta, size_t *files_len);
+
+/**
+ * writes the catalog of a client as the body of a PUBLISH request, or of a
+ * PUBLISH_META request if it has metadata. returns the number of bytes written
+ */
+size_t encode_catalog(struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * handles a replicate request sent by a standby registry. the connection is
+ * turned into a replication stream and sent a snapshot of the current state
+ */
+void handle_replicate(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+
+/**
+ * queues a snapshot of every catalog for a standby registry. returns -1 if
+ * the standby has to be dropped
+ */
+int send_snapshot(struct server *server, struct client *standby);
+
+/**
+ * queues a replication frame for all attached standby registries. a standby
+ * that has fallen too far behind gets nothing until it is resynced
+ */
+void replicate_send(struct server *server, uint8_t op, uint32_t key, const uint8_t *payload, size_t len);
+
+/**
+ * adds bytes to the pending buffer of a standby or watcher and sends what
+ * its socket will take without blocking. returns -1 if the client has to be
+ * dropped
+ */
+int queue_pending(struct server *server, struct client *client, const uint8_t *buf, size_t len);
+
+/**
+ * sends what a client has pending without blocking. the socket is watched
+ * for room if some of it is left. returns -1 if the send failed
+ */
+int flush_pending(struct server *server, struct client *client);
+
+/**
+ * sends the queued replication stream to every standby and a new snapshot to
+ * the ones that have caught up after falling behind, called from the main
+ * loop
+ */
+void flush_standbys(struct server *server);
+
+/**
+ * removes a standby from the list of attached ones
+ */
+void remove_standby(struct server *server, struct client *standby);
+
+/**
+ * replicates a client that has joined to the standby registries
+ */
+void replicate_join(struct server *server, struct client *client);
+
+/**
+ * replicates the body of a publish request to the standby registries. the
+ * body is a PUBLISH_META body if the client's catalog has metadata
+ */
+void replicate_publish(struct server *server, struct client *client, const uint8_t *buffer, size_t len);
+
+/**
+ * replicates a client that has disconnected to the standby registries
+ */
+void replicate_drop(struct server *server, struct client *client);
+
+/**
+ * applies a single replication frame received from the primary
+ */
+void apply_replication(struct server *server, uint8_t op, uint8_t *payload, size_t len);
+
+/**
+ * finds the mirrored client for the given primary key
+ */
+struct client* find_mirror(struct server *server, uint32_t key);
+
+/**
+ * releases a mirrored client and removes it from the mirror maps
+ */
+void drop_mirror(struct server *server, struct client *mirror);
+
+/**
+ * parks every mirrored client after the primary is gone so that catalogs of
+ * peers that do not fail over to this server are released after the grace
+ * period
+ */
+void park_mirrors(struct server *server);
+
+/**
+ * releases every mirrored client, used before the snapshot of a resync
+ */
+void drop_mirrors(struct server *server);
+
+/**
+ * finds the joined client connected to this server with the given peer id
+ */
+struct client* find_client_by_id(struct server *server, uint32_t id);
+
+/**
+ * allocates an id map that can hold max entries. returns false on error
+ */
+bool id_map_init(struct id_map *map, size_t max);
+
+/**
+ * frees the entries of an id map
+ */
+void id_map_free(struct id_map *map);
+
+/**
+ * returns the slot stored for the id or -1 if there is none
+ */
+ssize_t id_map_get(struct id_map *map, uint64_t id);
+
+/**
+ * stores the slot for the id, replacing the slot already stored for it
+ */
+void id_map_put(struct id_map *map, uint64_t id, size_t slot);
+
+/**
+ * removes the id if it is stored for the given slot
+ */
+void id_map_remove(struct id_map *map, uint64_t id, size_t slot);
+
+/**
+ * returns the index of the entry an id hashes to
+ */
+size_t id_map_hash(struct id_map *map, uint64_t id);
+
+/**
+ * retrieves the ipv4 address and port of the desired sockaddr_in
+ */
+char* get_ipv4_port(struct sockaddr_in* addr, char* str, size_t len, bool inc_port);
+
+/**
+ * retrives the ipv6 address and port of the desired sockaddr_in6
+ */
+char* get_ipv6_port(struct sockaddr_in6* addr, char* str, size_t len, bool inc_port);
+
+/**
+ * retrieves the ip address and port of the desired sockaddr
+ */
+char* get_ip_port(struct sockaddr* addr, char* str, size_t len, bool inc_port);
+
+/**
+ * attempts to send all the desired bytes to the specified socket
+ */
+int send_bytes(int sock, const uint8_t *buf, size_t len);
+
+/**
+ * prints out the given buffer to stdout
+ */
+void print_buffer(FILE* output, const uint8_t *buf, size_t length, uint8_t flags);
+
+/**
+ * logs the given message to the specified output for the server
+ */
+void srv_log(struct server* server, const char* format, ...);
+
+/**
+ * logs the given message to the specified output for the server and will also
+ * print the "[INFO]" prefix
+ */
+void srv_info(struct server* server, const char* format, ...);
+
+/**
+ * logs the given message to the specified output for the server and will also
+ * print the "[WARN]" prefix
+ */
+void srv_warn(struct server* server, const char* format, ...);
+
+/**
+ * logs the given message to the specified output for the server and will also
+ * print the "[ERROR]" prefix
+ */
+void srv_error(struct server* server, const char* format, ...);
+
+/**
+ * logs the given message to the specified output for the server and will also
+ * print the "[DEBUG]" prefix
+ */
+void srv_debug(struct server* server, const char* format, ...);
+
+#endif
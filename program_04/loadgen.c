@@ -0,0 +1,716 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+// needed for sched_yield with strict standards
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+#define SEARCH_RESPONSE_SIZE 10
+
+// action codes understood by the registry
+#define ACTION_JOIN 0
+#define ACTION_PUBLISH 1
+#define ACTION_SEARCH 2
+#define ACTION_SHM_ATTACH 5
+
+/**
+ * the ways the load generator can talk to the registry
+ */
+enum transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UDP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM,
+};
+
+// number of polls of the response queue before yielding the cpu, set to 0
+// on single cpu machines where spinning only delays the registry
+size_t spin_limit = 1024;
+
+/**
+ * a connection to the registry over one of the transports
+ */
+struct conn {
+    int type;
+    int sock;
+    // only set for TRANSPORT_SHM
+    struct shm_ring *ring;
+};
+
+/**
+ * opens a tcp or udp socket connected to the registry
+ */
+int connect_inet(const char *host, const char *port, int socktype);
+
+/**
+ * opens a stream socket connected to the registry's unix socket
+ */
+int connect_unix(const char *path);
+
+/**
+ * asks the registry for a shared memory ring over a unix socket and maps it
+ */
+struct shm_ring* attach_ring(int sock);
+
+/**
+ * sends a request and waits for a response of the given length. a response
+ * length of 0 does not wait for anything
+ */
+int request(struct conn *conn, const uint8_t *req, size_t len, uint8_t *resp, size_t resp_len);
+
+/**
+ * runs the search benchmark against a single transport and prints the results
+ */
+int run(struct conn *conn, const char *name, uint32_t id, size_t requests);
+
+/**
+ * opens the given number of connections at once, like a registry restart
+ * would cause, and measures how long it takes for all of them to be served
+ */
+int storm(const char *host, const char *port, size_t connections);
+
+/**
+ * floods the registry with pipelined searches from a single connection until
+ * the process is killed. used to check that other clients are still served
+ */
+void flood(const char *host, const char *port);
+
+/**
+ * returns the current monotonic time in nanoseconds
+ */
+uint64_t now_ns();
+
+/**
+ * compare function for qsort
+ */
+int cmp_u64(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    char *port = "5432";
+    char *udp_port = NULL;
+    char *unix_path = NULL;
+    size_t requests = 10000;
+    size_t storm_size = 0;
+    bool with_flood = false;
+
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 0},
+        {"port", required_argument, 0, 0},
+        {"udp-port", required_argument, 0, 0},
+        {"unix-path", required_argument, 0, 0},
+        {"requests", required_argument, 0, 0},
+        {"storm", required_argument, 0, 0},
+        {"flood", no_argument, 0, 0},
+        {0,0,0,0}
+    };
+
+    int option_index = 0;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        if (c != 0) {
+            fprintf(stderr, "usage: %s [--host HOST] [--port PORT] [--udp-port PORT] [--unix-path PATH] [--requests N] [--storm N] [--flood]\n", argv[0]);
+            return 1;
+        }
+
+        switch (option_index) {
+        case 0:
+            host = optarg;
+            break;
+        case 1:
+            port = optarg;
+            break;
+        case 2:
+            udp_port = optarg;
+            break;
+        case 3:
+            unix_path = optarg;
+            break;
+        case 4:
+            requests = strtoul(optarg, NULL, 10);
+            break;
+        case 5:
+            storm_size = strtoul(optarg, NULL, 10);
+            break;
+        case 6:
+            with_flood = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+        spin_limit = 0;
+    }
+
+    if (storm_size != 0) {
+        return storm(host, port, storm_size);
+    }
+
+    if (requests == 0) {
+        fprintf(stderr, "[ERROR] --requests must be greater than 0\n");
+        return 1;
+    }
+
+    printf("%-6s %10s %10s %10s %10s %10s %12s\n", "", "requests", "mean us", "p50 us", "p99 us", "max us", "req/s");
+
+    struct conn tcp = { .type = TRANSPORT_TCP, .ring = NULL };
+    tcp.sock = connect_inet(host, port, SOCK_STREAM);
+
+    if (tcp.sock == -1) {
+        fprintf(stderr, "[ERROR] failed to connect to registry %s:%s\n", host, port);
+        return 1;
+    }
+
+    // the tcp connection is also the owner of the file that every transport
+    // searches for
+    uint8_t publish[64] = {ACTION_PUBLISH, 0, 0, 0, 1};
+    size_t publish_len = 5 + (size_t)snprintf((char *)publish + 5, sizeof(publish) - 5, "loadgen.bin") + 1;
+    uint8_t join[5] = {ACTION_JOIN};
+    uint32_t id = htonl(1);
+
+    memcpy(join + 1, &id, 4);
+
+    if (request(&tcp, join, sizeof(join), NULL, 0) != 0 ||
+        request(&tcp, publish, publish_len, NULL, 0) != 0) {
+        fprintf(stderr, "[ERROR] failed to publish to registry: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // there is no acknowledgement for join or publish so give the registry
+    // a moment to take them in before searching
+    usleep(100000);
+
+    pid_t flooder = -1;
+
+    if (with_flood) {
+        flooder = fork();
+
+        if (flooder == 0) {
+            flood(host, port);
+            exit(0);
+        }
+
+        // let the flood get going before measuring
+        usleep(100000);
+    }
+
+    int result = run(&tcp, "tcp", 1, requests);
+
+    if (result == 0 && udp_port != NULL) {
+        struct conn udp = { .type = TRANSPORT_UDP, .ring = NULL };
+        udp.sock = connect_inet(host, udp_port, SOCK_DGRAM);
+
+        if (udp.sock == -1) {
+            fprintf(stderr, "[ERROR] failed to create udp socket\n");
+            result = 1;
+        } else {
+            // udp searches are stateless so there is no join
+            result = run(&udp, "udp", 0, requests);
+
+            close(udp.sock);
+        }
+    }
+
+    if (result == 0 && unix_path != NULL) {
+        struct conn local = { .type = TRANSPORT_UNIX, .ring = NULL };
+        local.sock = connect_unix(unix_path);
+
+        if (local.sock == -1) {
+            fprintf(stderr, "[ERROR] failed to connect to %s: %s\n", unix_path, strerror(errno));
+            result = 1;
+        } else {
+            result = run(&local, "unix", 2, requests);
+
+            close(local.sock);
+        }
+    }
+
+    if (result == 0 && unix_path != NULL) {
+        struct conn shm = { .type = TRANSPORT_SHM, .ring = NULL };
+        shm.sock = connect_unix(unix_path);
+
+        if (shm.sock == -1 || (shm.ring = attach_ring(shm.sock)) == NULL) {
+            fprintf(stderr, "[ERROR] failed to attach shared memory ring\n");
+            result = 1;
+        } else {
+            result = run(&shm, "shm", 3, requests);
+
+            munmap(shm.ring, sizeof(struct shm_ring));
+        }
+
+        if (shm.sock != -1) {
+            close(shm.sock);
+        }
+    }
+
+    close(tcp.sock);
+
+    if (flooder > 0) {
+        kill(flooder, SIGTERM);
+        waitpid(flooder, NULL, 0);
+    }
+
+    return result;
+}
+
+void flood(const char *host, const char *port) {
+    struct conn conn = { .type = TRANSPORT_TCP, .ring = NULL };
+    conn.sock = connect_inet(host, port, SOCK_STREAM);
+
+    if (conn.sock == -1) {
+        fprintf(stderr, "[ERROR] flood: failed to connect\n");
+        return;
+    }
+
+    uint8_t join[5] = {ACTION_JOIN};
+    uint32_t id = htonl(999);
+
+    memcpy(join + 1, &id, 4);
+
+    if (request(&conn, join, sizeof(join), NULL, 0) != 0) {
+        return;
+    }
+
+    // 64 searches written at once and then read back, as fast as possible
+    uint8_t search[] = "\x02loadgen.bin";
+    uint8_t batch[sizeof(search) * 64];
+    uint8_t responses[SEARCH_RESPONSE_SIZE * 64];
+
+    for (size_t index = 0; index < 64; ++index) {
+        memcpy(batch + index * sizeof(search), search, sizeof(search));
+    }
+
+    while (request(&conn, batch, sizeof(batch), responses, sizeof(responses)) == 0) {
+    }
+}
+
+int run(struct conn *conn, const char *name, uint32_t id, size_t requests) {
+    if (id != 0) {
+        uint8_t join[5] = {ACTION_JOIN};
+        uint32_t net_id = htonl(id);
+
+        memcpy(join + 1, &net_id, 4);
+
+        if (request(conn, join, sizeof(join), NULL, 0) != 0) {
+            fprintf(stderr, "[ERROR] %s: failed to join: %s\n", name, strerror(errno));
+            return 1;
+        }
+
+        usleep(10000);
+    }
+
+    uint8_t search[] = "\x02loadgen.bin";
+    uint8_t response[SEARCH_RESPONSE_SIZE];
+    uint64_t *samples = calloc(sizeof(uint64_t), requests);
+
+    if (samples == NULL) {
+        fprintf(stderr, "[ERROR] failed allocating samples\n");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+
+    for (size_t index = 0; index < requests; ++index) {
+        uint64_t sent = now_ns();
+
+        // sizeof includes the null terminator of the name
+        if (request(conn, search, sizeof(search), response, SEARCH_RESPONSE_SIZE) != 0) {
+            fprintf(stderr, "[ERROR] %s: request failed: %s\n", name, strerror(errno));
+
+            free(samples);
+
+            return 1;
+        }
+
+        samples[index] = now_ns() - sent;
+    }
+
+    uint64_t total = now_ns() - start;
+    uint64_t sum = 0;
+
+    qsort(samples, requests, sizeof(uint64_t), cmp_u64);
+
+    for (size_t index = 0; index < requests; ++index) {
+        sum += samples[index];
+    }
+
+    printf(
+        "%-6s %10lu %10.2f %10.2f %10.2f %10.2f %12.0f\n",
+        name,
+        requests,
+        (double)sum / requests / 1000.0,
+        samples[requests / 2] / 1000.0,
+        samples[requests * 99 / 100] / 1000.0,
+        samples[requests - 1] / 1000.0,
+        requests / (total / 1e9)
+    );
+
+    free(samples);
+
+    return 0;
+}
+
+int storm(const char *host, const char *port, size_t connections) {
+    // every connection needs a descriptor so raise the limit as far as we
+    // are allowed to
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        fprintf(stderr, "[ERROR] failed to resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    struct pollfd *pfds = calloc(sizeof(struct pollfd), connections);
+    size_t *received = calloc(sizeof(size_t), connections);
+    uint64_t *samples = calloc(sizeof(uint64_t), connections);
+
+    if (pfds == NULL || received == NULL || samples == NULL) {
+        fprintf(stderr, "[ERROR] failed allocating connection state\n");
+
+        free(pfds);
+        free(received);
+        free(samples);
+        freeaddrinfo(result);
+
+        return 1;
+    }
+
+    size_t remaining = 0;
+    size_t completed = 0;
+    size_t rejected = 0;
+    uint64_t start = now_ns();
+
+    for (size_t index = 0; index < connections; ++index) {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+        pfds[index].fd = -1;
+
+        if (s == -1) {
+            rejected += 1;
+            continue;
+        }
+
+        if (connect(s, result->ai_addr, result->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            close(s);
+            rejected += 1;
+            continue;
+        }
+
+        pfds[index].fd = s;
+        pfds[index].events = POLLOUT;
+        remaining += 1;
+    }
+
+    freeaddrinfo(result);
+
+    // give up on anything that has not been served after 30 seconds
+    uint64_t deadline = start + 30 * 1000000000ull;
+
+    while (remaining > 0 && now_ns() < deadline) {
+        if (poll(pfds, connections, 100) < 0) {
+            fprintf(stderr, "[ERROR] poll: %s\n", strerror(errno));
+            break;
+        }
+
+        for (size_t index = 0; index < connections; ++index) {
+            if (pfds[index].fd == -1 || pfds[index].revents == 0) {
+                continue;
+            }
+
+            bool done = false;
+            bool failed = false;
+
+            if (pfds[index].events == POLLOUT) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+
+                getsockopt(pfds[index].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+                // a reconnecting peer sends its JOIN and first SEARCH back
+                // to back
+                uint8_t req[5 + sizeof("loadgen.bin") + 1] = {ACTION_JOIN};
+                uint32_t id = htonl((uint32_t)(1000 + index));
+
+                memcpy(req + 1, &id, 4);
+                req[5] = ACTION_SEARCH;
+                memcpy(req + 6, "loadgen.bin", sizeof("loadgen.bin"));
+
+                if (err != 0 || send(pfds[index].fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+                    failed = true;
+                } else {
+                    pfds[index].events = POLLIN;
+                }
+            } else {
+                uint8_t response[SEARCH_RESPONSE_SIZE];
+                ssize_t got = recv(pfds[index].fd, response, SEARCH_RESPONSE_SIZE - received[index], 0);
+
+                if (got <= 0) {
+                    failed = got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                } else {
+                    received[index] += (size_t)got;
+                    done = received[index] == SEARCH_RESPONSE_SIZE;
+                }
+            }
+
+            if (done || failed) {
+                close(pfds[index].fd);
+
+                pfds[index].fd = -1;
+                remaining -= 1;
+
+                if (done) {
+                    samples[completed] = now_ns() - start;
+                    completed += 1;
+                } else {
+                    rejected += 1;
+                }
+            }
+        }
+    }
+
+    uint64_t total = now_ns() - start;
+
+    for (size_t index = 0; index < connections; ++index) {
+        if (pfds[index].fd != -1) {
+            close(pfds[index].fd);
+        }
+    }
+
+    // samples are already in completion order
+    printf("connections: %lu\n", connections);
+    printf("completed:   %lu\n", completed);
+    printf("rejected:    %lu\n", rejected);
+    printf("timed out:   %lu\n", remaining);
+    printf("total ms:    %.2f\n", total / 1e6);
+
+    if (completed > 0) {
+        printf("p50 ms:      %.2f\n", samples[completed / 2] / 1e6);
+        printf("p99 ms:      %.2f\n", samples[completed * 99 / 100] / 1e6);
+    }
+
+    free(pfds);
+    free(received);
+    free(samples);
+
+    return 0;
+}
+
+int request(struct conn *conn, const uint8_t *req, size_t len, uint8_t *resp, size_t resp_len) {
+    if (conn->type == TRANSPORT_SHM) {
+        while (!shm_queue_push(&conn->ring->requests, req, len)) {
+            sched_yield();
+        }
+
+        // the registry is only woken up if it has gone to sleep, otherwise
+        // it is already polling the ring
+        if (atomic_load_explicit(&conn->ring->server_sleeping, memory_order_seq_cst)) {
+            uint8_t doorbell = 0;
+
+            if (send(conn->sock, &doorbell, 1, MSG_NOSIGNAL) != 1) {
+                return -1;
+            }
+        }
+
+        if (resp_len == 0) {
+            return 0;
+        }
+
+        struct shm_slot *slot;
+        size_t spins = 0;
+
+        while ((slot = shm_queue_peek(&conn->ring->responses)) == NULL) {
+            if (++spins > spin_limit) {
+                sched_yield();
+            }
+        }
+
+        memcpy(resp, slot->data, slot->len < resp_len ? slot->len : resp_len);
+
+        shm_queue_pop(&conn->ring->responses);
+
+        return 0;
+    }
+
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t sent = send(conn->sock, req + total, len - total, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            return -1;
+        }
+
+        total += (size_t)sent;
+    }
+
+    if (resp_len == 0) {
+        return 0;
+    }
+
+    ssize_t received = recv(conn->sock, resp, resp_len, MSG_WAITALL);
+
+    if (received != (ssize_t)resp_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int connect_inet(const char *host, const char *port, int socktype) {
+    struct addrinfo hints;
+    struct addrinfo *rp, *result;
+    int s;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = socktype;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+            continue;
+        }
+
+        if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(s);
+    }
+
+    freeaddrinfo(result);
+
+    if (rp == NULL) {
+        return -1;
+    }
+
+    return s;
+}
+
+int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s == -1) {
+        return -1;
+    }
+
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+struct shm_ring* attach_ring(int sock) {
+    uint8_t attach = ACTION_SHM_ATTACH;
+
+    if (send(sock, &attach, 1, MSG_NOSIGNAL) != 1) {
+        return NULL;
+    }
+
+    uint8_t ack = 0;
+    struct iovec iov = { .iov_base = &ack, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) != 1 || ack != ACTION_SHM_ATTACH) {
+        return NULL;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return NULL;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    struct shm_ring *ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+
+    return ring;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t lhs = *(const uint64_t *)a;
+    uint64_t rhs = *(const uint64_t *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
@@ -1,11 +1,13 @@
 // EECE-446-SP-2024
 // David Cathers & Madison Webb
 
+// needed for recvmmsg and sendmmsg
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -14,129 +16,98 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX_PENDING 5
-#define BUFF_SIZE 2048
+#include "engine.h"
+#include "trace.h"
 
-#define IPLEN_AND_PORT 51
+// default size of the listen queue, can be changed with --backlog. the kernel
+// caps this at net.core.somaxconn
+#define DEFAULT_BACKLOG SOMAXCONN
 
-#define TEST_OUTPUT true
+// max number of connections accepted for a single readiness event of a
+// listening socket
+#define ACCEPT_BATCH 256
 
-const uint8_t VERBOSE = 1;
+// how often in ms the loop wakes up on its own to measure the load while
+// publishes are being shed
+#define LOAD_RECHECK_MS 50
 
-/**
- * handles incoming signals sent from the system
- */
-void handle_signal(int signo);
+// number of datagrams handled by a single recvmmsg/sendmmsg call
+#define UDP_BATCH 64
+// max number of batches drained for a single readiness event
+#define UDP_MAX_BATCHES 4
+// action + the max file name length handle_search accepts
+#define UDP_REQUEST_SIZE 101
 
-/**
- * the three different states for a connected client
- */
-enum client_state {
-    // the client is connected but not join joined or registered
-    CLIENT_UNKNOWN,
-    // the client has joined
-    CLIENT_JOINED,
-    // the client has registered
-    CLIENT_REGISTERED,
-};
+// max number of times the rings are polled before going back to pselect
+#define SHM_SPIN_MAX 4096
+// number of polls without any work before the server goes to sleep
+#define SHM_SPIN_IDLE 1024
 
 /**
- * relevant data we want to store about a connected client
+ * handles incoming signals sent from the system
  */
-struct client {
-    // determines if the current client struct is active or not
-    bool active;
-    // client id provided by the client
-    uint32_t id;
-    // type specified by client_state
-    int type;
-    // socket file descriptor
-    int sock;
-    // the socketaddr information of the connected client
-    struct sockaddr addr;
-    // number of files current stored in the server
-    size_t files_len;
-    // list of file names publish from the client
-    char **files;
-};
-
-enum server_output {
-    STDOUT_LOG,
-    FILE_LOG,
-};
+void handle_signal(int signo);
 
 /**
- * relevant state data we want to store for the server
+ * accepts a client for the server from the given listening socket
  */
-struct server {
-    // max number of active connections the server will handle
-    size_t max_conn;
-    // max number of files that a client can publish to the server
-    size_t max_files;
-    // total number of active clients
-    size_t active_clients;
-    // list of client structs
-    struct client *clients;
-    // server socket file descriptor
-    int listen_sock;
-    // all currently connected sockets
-    fd_set all_socks;
-    // the currently highest socket value
-    int max_socket;
-    // output type
-    int output_type;
-    // output stream
-    FILE* output;
-};
+void server_accept(struct server* s, int listen_sock);
 
 /**
- * free the allocated strings stored for a client
+ * returns the number of ms until the loop has to wake up on its own or -1
+ * if it can wait for socket activity
  */
-void clear_client_files(struct client *c);
+int64_t next_wakeup(struct server *server);
 
 /**
- * resets and frees allocated data for a client
+ * handles incoming client data
  */
-void clear_client(struct client *c);
+void handle_client(struct server* server, struct client* client);
 
 /**
- * closes the server output if necessary
+ * answers the SEARCH datagrams waiting on the udp socket in batches
  */
-void close_server_output(struct server* s);
+void handle_udp(struct server *server);
 
 /**
- * accepts a client for the server
+ * creates and binds a non blocking udp socket for the provided service.
+ * returns the socket or -1 on error
  */
-void server_accept(struct server* s);
+int bind_udp(struct server *server, const char *service);
 
 /**
- * attempts to find the desired string for the given client if the string is
- * found then it will return the pointer provided otherwise will return NULL
+ * busy polls the shared memory rings for a short time. returns true if there
+ * is still work coming in and the server should not block in pselect
  */
-struct client* search_client_files(struct server* server, const char* find, struct client* client);
+bool spin_rings(struct server *server);
 
 /**
- * handles incoming client data
+ * sets or clears the sleeping flag on every ring
  */
-void handle_client(struct server* server, struct client* client);
+void set_rings_sleeping(struct server *server, bool sleeping);
 
 /**
- * handles a join request sent by a client
+ * creates, binds and listens on a unix domain socket at the given path.
+ * returns the socket or -1 on error
  */
-void handle_join(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+int bind_unix(struct server *server, const char *path);
 
 /**
- * handles a publish request sent by a client
+ * connects to the primary registry specified as "host:port" and requests the
+ * replication stream. returns the connected socket or -1 on error
  */
-void handle_publish(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+int connect_primary(struct server *server, const char *primary);
 
 /**
- * handles a search request sent by a client
+ * reads incoming frames from the primary registry. if the primary goes away
+ * then this server promotes itself and keeps serving the mirrored catalogs
+ * for the grace period
  */
-void handle_search(struct server *server, struct client *client, uint8_t *buffer, size_t len);
+void handle_primary(struct server *server);
 
 /*
  * Create, bind and passive open a socket on a local interface for the provided service.
@@ -147,65 +118,43 @@ void handle_search(struct server *server, struct client *client, uint8_t *buffer
  */
 int bind_and_listen(struct server *server, const char *service);
 
-/**
- * retrieves the ipv4 address and port of the desired sockaddr_in
- */
-char* get_ipv4_port(struct sockaddr_in* addr, char* str, size_t len, bool inc_port);
-
-/**
- * retrives the ipv6 address and port of the desired sockaddr_in6
- */
-char* get_ipv6_port(struct sockaddr_in6* addr, char* str, size_t len, bool inc_port);
-
-/**
- * retrieves the ip address and port of the desired sockaddr
- */
-char* get_ip_port(struct sockaddr* addr, char* str, size_t len, bool inc_port);
-
-/**
- * attempts to send all the desired bytes to the specified socket
- */
-int send_bytes(int sock, const uint8_t *buf, size_t len);
-
-/**
- * prints out the given buffer to stdout
- */
-void print_buffer(FILE* output, const uint8_t *buf, size_t length, uint8_t flags);
-
-/**
- * logs the given message to the specified output for the server
- */
-void srv_log(struct server* server, const char* format, ...);
-
-/**
- * logs the given message to the specified output for the server and will also
- * print the "[INFO]" prefix
- */
-void srv_info(struct server* server, const char* format, ...);
-
-/**
- * logs the given message to the specified output for the server and will also
- * print the "[WARN]" prefix
- */
-void srv_warn(struct server* server, const char* format, ...);
-
-/**
- * logs the given message to the specified output for the server and will also
- * print the "[ERROR]" prefix
- */
-void srv_error(struct server* server, const char* format, ...);
-
-/**
- * logs the given message to the specified output for the server and will also
- * print the "[DEBUG]" prefix
- */
-void srv_debug(struct server* server, const char* format, ...);
-
 int main(int argc, char **argv) {
     char *listen_port = "5432";
+    char *standby_of = NULL;
+    char *udp_port = NULL;
+    char *unix_path = NULL;
+    bool quiet = false;
+    size_t max_conn = 50;
+    int backlog = DEFAULT_BACKLOG;
+    double rate = 0;
+    double burst = 0;
+    size_t slice = DEFAULT_SLICE;
+    uint64_t grace = DEFAULT_RESUME_GRACE;
+    char *locality_path = NULL;
+    uint64_t max_lag = DEFAULT_MAX_LAG;
+    size_t max_queue = 0;
+    size_t max_mem = 0;
+    size_t client_mem = 0;
+    char *record_path = NULL;
 
     static struct option long_options[] = {
         {"listen-port", required_argument, 0, 0},
+        {"standby-of", required_argument, 0, 0},
+        {"udp-port", required_argument, 0, 0},
+        {"unix-path", required_argument, 0, 0},
+        {"quiet", no_argument, 0, 0},
+        {"max-conn", required_argument, 0, 0},
+        {"backlog", required_argument, 0, 0},
+        {"client-rate", required_argument, 0, 0},
+        {"client-burst", required_argument, 0, 0},
+        {"client-slice", required_argument, 0, 0},
+        {"resume-grace", required_argument, 0, 0},
+        {"locality", required_argument, 0, 0},
+        {"max-lag", required_argument, 0, 0},
+        {"max-queue", required_argument, 0, 0},
+        {"max-mem", required_argument, 0, 0},
+        {"client-mem", required_argument, 0, 0},
+        {"record", required_argument, 0, 0},
         {0,0,0,0}
     };
 
@@ -224,6 +173,54 @@ int main(int argc, char **argv) {
             case 0:
                 listen_port = optarg;
                 break;
+            case 1:
+                standby_of = optarg;
+                break;
+            case 2:
+                udp_port = optarg;
+                break;
+            case 3:
+                unix_path = optarg;
+                break;
+            case 4:
+                quiet = true;
+                break;
+            case 5:
+                max_conn = strtoul(optarg, NULL, 10);
+                break;
+            case 6:
+                backlog = atoi(optarg);
+                break;
+            case 7:
+                rate = strtod(optarg, NULL);
+                break;
+            case 8:
+                burst = strtod(optarg, NULL);
+                break;
+            case 9:
+                slice = strtoul(optarg, NULL, 10);
+                break;
+            case 10:
+                grace = strtoull(optarg, NULL, 10);
+                break;
+            case 11:
+                locality_path = optarg;
+                break;
+            case 12:
+                max_lag = strtoull(optarg, NULL, 10);
+                break;
+            case 13:
+                max_queue = strtoul(optarg, NULL, 10);
+                break;
+            case 14:
+                max_mem = strtoul(optarg, NULL, 10);
+                break;
+            case 15:
+                client_mem = strtoul(optarg, NULL, 10);
+                break;
+            case 16:
+                record_path = optarg;
+                break;
             default:
                 break;
             }
@@ -270,15 +267,35 @@ int main(int argc, char **argv) {
     // server setup
     // ------------------------------------------------------------------------
     fd_set call_set;
+    fd_set write_set;
+
+    if (max_conn == 0 || max_conn >= FD_SETSIZE) {
+        fprintf(stderr, "[ERROR] --max-conn must be between 1 and %d\n", FD_SETSIZE - 1);
+        return 1;
+    }
+
+    if (backlog <= 0) {
+        fprintf(stderr, "[ERROR] --backlog must be greater than 0\n");
+        return 1;
+    }
+
+    if (rate < 0 || burst < 0 || slice == 0) {
+        fprintf(stderr, "[ERROR] --client-rate and --client-burst can not be negative and --client-slice must be greater than 0\n");
+        return 1;
+    }
+
+    // a bucket has to hold at least one token, default to a second's worth
+    if (rate > 0 && burst < 1) {
+        burst = rate < 1 ? 1 : rate;
+    }
 
-    struct server srv;
-    srv.max_conn = 50;
-    srv.max_files = 10;
-    srv.active_clients = 0;
+    static struct server srv;
     srv.output_type = STDOUT_LOG;
     srv.output = stdout;
 
-    if (TEST_OUTPUT) {
+    if (quiet) {
+        srv.output_type = NO_LOG;
+    } else if (TEST_OUTPUT) {
         char filename[1024];
         uint64_t ts = time(NULL);
 
@@ -297,46 +314,189 @@ int main(int argc, char **argv) {
         srv.output_type = FILE_LOG;
     }
 
-    srv.clients = calloc(sizeof(struct client), srv.max_conn);
+    if (!engine_init(&srv, max_conn)) {
+        close_server_output(&srv);
 
-    if (srv.clients == NULL) {
-        srv_error(&srv, "failed allocation client connection data: %s\n", strerror(errno));
+        return 1;
+    }
 
+    srv.backlog = backlog;
+    srv.rate = rate;
+    srv.burst = burst;
+    srv.slice = slice;
+    srv.grace = grace * 1000;
+    srv.max_lag = max_lag * 1000;
+    srv.max_queue = max_queue;
+    srv.max_mem = max_mem;
+    srv.client_mem = client_mem;
+
+    if (locality_path != NULL && !load_localities(&srv, locality_path)) {
+        engine_free(&srv);
         close_server_output(&srv);
 
         return 1;
     }
 
-    for (size_t index = 0; index < srv.max_conn; ++index) {
-        srv.clients[index].active = 0;
-        srv.clients[index].id = 0;
-        srv.clients[index].sock = 0;
-        srv.clients[index].files_len = 0;
-        srv.clients[index].files = NULL;
+    if (record_path != NULL) {
+        srv.record = fopen(record_path, "wb");
+
+        // records are small, let them pile up instead of a write per request
+        if (srv.record != NULL) {
+            setvbuf(srv.record, NULL, _IOFBF, 1 << 20);
+        }
+
+        if (srv.record == NULL || fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, srv.record) != RECORD_MAGIC_SIZE) {
+            srv_error(&srv, "failed to open recording %s: %s\n", record_path, strerror(errno));
+
+            engine_free(&srv);
+            close_server_output(&srv);
+
+            return 1;
+        }
     }
 
-    FD_ZERO(&srv.all_socks);
     FD_ZERO(&call_set);
 
     srv_info(&srv, "creating listening socket\n");
 
     srv.listen_sock = bind_and_listen(&srv, listen_port);
+
+    if (srv.listen_sock == -1) {
+        engine_free(&srv);
+        close_server_output(&srv);
+
+        return 1;
+    }
+
     FD_SET(srv.listen_sock, &srv.all_socks);
 
     srv.max_socket = srv.listen_sock;
 
+    if (udp_port != NULL) {
+        srv_info(&srv, "creating udp socket\n");
+
+        srv.udp_sock = bind_udp(&srv, udp_port);
+
+        if (srv.udp_sock == -1) {
+            close(srv.listen_sock);
+            engine_free(&srv);
+            close_server_output(&srv);
+
+            return 1;
+        }
+
+        FD_SET(srv.udp_sock, &srv.all_socks);
+
+        if (srv.udp_sock > srv.max_socket) {
+            srv.max_socket = srv.udp_sock;
+        }
+    }
+
+    if (unix_path != NULL) {
+        srv_info(&srv, "creating unix socket\n");
+
+        srv.unix_sock = bind_unix(&srv, unix_path);
+
+        if (srv.unix_sock == -1) {
+            close(srv.listen_sock);
+            engine_free(&srv);
+            close_server_output(&srv);
+
+            return 1;
+        }
+
+        FD_SET(srv.unix_sock, &srv.all_socks);
+
+        if (srv.unix_sock > srv.max_socket) {
+            srv.max_socket = srv.unix_sock;
+        }
+    }
+
+    if (standby_of != NULL) {
+        srv_info(&srv, "connecting to primary registry %s\n", standby_of);
+
+        srv.repl_sock = connect_primary(&srv, standby_of);
+
+        if (srv.repl_sock == -1) {
+            close(srv.listen_sock);
+            engine_free(&srv);
+            close_server_output(&srv);
+
+            return 1;
+        }
+
+        FD_SET(srv.repl_sock, &srv.all_socks);
+
+        if (srv.repl_sock > srv.max_socket) {
+            srv.max_socket = srv.repl_sock;
+        }
+    }
+
     // ------------------------------------------------------------------------
     // main loop
     // ------------------------------------------------------------------------
+    size_t ready = 0;
+
     while (1) {
+        engine_tick(&srv, clock_ms());
+
+        bool listing = false;
+
+        // the replication stream that did not fit in a standby's socket
+        // earlier goes out before anything new is queued
+        if (srv.standbys > 0) {
+            flush_standbys(&srv);
+        }
+
+        // so do the notifications of watchers that are slow to read
+        if (srv.backlogged > 0) {
+            flush_watchers(&srv);
+        }
+
+        // LIST responses are streamed a few pages at a time in between the
+        // requests of everyone else
+        if (srv.listing > 0) {
+            listing = run_listings(&srv);
+        }
+
         call_set = srv.all_socks;
+        write_set = srv.write_socks;
+
+        struct timespec wait = {0, 0};
+        struct timespec *timeout = NULL;
+        int64_t wakeup = -1;
+
+        // while the local peers are busy we keep polling their rings and
+        // only take a quick look at the sockets
+        if (listing || (srv.rings > 0 && spin_rings(&srv))) {
+            timeout = &wait;
+        } else if ((wakeup = next_wakeup(&srv)) >= 0) {
+            wait.tv_sec = wakeup / 1000;
+            wait.tv_nsec = (wakeup % 1000) * 1000000;
+            timeout = &wait;
+        }
+
+        // the round started when pselect returned last time, and ends now
+        // that we are about to go back to sleep
+        if (srv.woke_at != 0) {
+            update_load(&srv, clock_us() - srv.woke_at, ready + srv.deferred);
+        }
 
         srv_info(&srv, "waiting for activity\n");
 
         // we are going to use pselect as it will help to handle signal
         // interupts and if we ever pass timeouts to this we will not have to
         // worry about it changing our timeout struct
-        int num_s = pselect(srv.max_socket + 1, &call_set, NULL, NULL, NULL, &oldset);
+        int num_s = pselect(srv.max_socket + 1, &call_set, srv.listing > 0 || srv.standbys > 0 || srv.backlogged > 0 ? &write_set : NULL, NULL, timeout, &oldset);
+
+        srv.woke_at = clock_us();
+        ready = num_s > 0 ? (size_t)num_s : 0;
+
+        if (srv.rings > 0) {
+            set_rings_sleeping(&srv, false);
+        }
+
+        srv.now = clock_ms();
 
         if (num_s < 0) {
             if (errno == EINTR) {
@@ -353,23 +513,16 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            if (s == srv.listen_sock) {
-                server_accept(&srv);
+            if (s == srv.listen_sock || s == srv.unix_sock) {
+                server_accept(&srv, s);
+            } else if (s == srv.repl_sock) {
+                handle_primary(&srv);
+            } else if (s == srv.udp_sock) {
+                handle_udp(&srv);
             } else {
-                struct client *curr = NULL;
-
                 // if we do not find the client from the list of known clients
                 // then there is a logic bug somewhere
-                for (size_t index = 0; index < srv.max_conn; ++index) {
-                    if (!srv.clients[index].active) {
-                        continue;
-                    }
-
-                    if (srv.clients[index].sock == s) {
-                        curr = &srv.clients[index];
-                        break;
-                    }
-                }
+                struct client *curr = srv.by_sock[s];
 
                 if (curr == NULL) {
                     srv_error(&srv, "failed to find client based on socket: %d\n", s);
@@ -384,651 +537,521 @@ int main(int argc, char **argv) {
 
     close(srv.listen_sock);
 
-    for (size_t index = 0; index < srv.max_conn; ++index) {
-        if (!srv.clients[index].active) {
-            continue;
-        }
+    if (srv.repl_sock != -1) {
+        close(srv.repl_sock);
+    }
 
-        close(srv.clients[index].sock);
+    if (srv.udp_sock != -1) {
+        close(srv.udp_sock);
+    }
 
-        clear_client(&srv.clients[index]);
+    if (srv.unix_sock != -1) {
+        close(srv.unix_sock);
+        unlink(unix_path);
     }
 
-    free(srv.clients);
+    engine_free(&srv);
 
     close_server_output(&srv);
 
     return 0;
 }
 
-void srv_log(struct server* server, const char* format, ...) {
-    va_list ap;
-
-    va_start(ap, format);
-
-    vfprintf(server->output, format, ap);
-
-    va_end(ap);
-
-    if (server->output_type == FILE_LOG) {
-        fflush(server->output);
+void handle_signal(int signo) {
+    if (!TEST_OUTPUT) {
+        // dont do anything special, just log the signal
+        printf("[server] received signal %d\n", signo);
     }
 }
 
-void srv_info(struct server* server, const char* format, ...) {
-    va_list ap;
-
-    va_start(ap, format);
-
-    fprintf(server->output, "[INFO] ");
-    vfprintf(server->output, format, ap);
+void server_accept(struct server* server, int listen_sock) {
+    srv_info(server, "accepting new connections\n");
+
+    // drain the listen queue so a reconnect storm does not sit in the
+    // backlog waiting on one select call per connection
+    for (size_t accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+        // large enough for the unix socket address as well, only the first
+        // bytes are kept for the client
+        struct sockaddr_storage accepted_addr;
+        socklen_t client_len = sizeof(accepted_addr);
+
+        int client_sock = accept4(
+            listen_sock,
+            (struct sockaddr *)&accepted_addr,
+            &client_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+
+        if (client_sock == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
 
-    va_end(ap);
+            // the connection was reset before we got to it, move on to the
+            // next one in the queue
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
 
-    if (server->output_type == FILE_LOG) {
-        fflush(server->output);
-    }
-}
+            srv_error(server, "failed to accept client: %s\n", strerror(errno));
+            return;
+        }
 
-void srv_warn(struct server* server, const char* format, ...) {
-    va_list ap;
+        if (server->active_clients >= server->max_conn || client_sock >= FD_SETSIZE) {
+            srv_warn(server, "max server connections reached\n");
 
-    va_start(ap, format);
+            // reset the connection instead of going through the close
+            // handshake so the client knows right away to try elsewhere and
+            // we do not hold on to the socket in TIME_WAIT
+            struct linger reset = { .l_onoff = 1, .l_linger = 0 };
 
-    fprintf(server->output, "[WARN] ");
-    vfprintf(server->output, format, ap);
+            setsockopt(client_sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
 
-    va_end(ap);
+            if (close(client_sock) != 0) {
+                srv_error(server, "error closing connected socket: %s\n", strerror(errno));
+            }
 
-    if (server->output_type == FILE_LOG) {
-        fflush(server->output);
-    }
-}
+            continue;
+        }
 
-void srv_error(struct server* server, const char* format, ...) {
-    va_list ap;
+        struct sockaddr client_addr;
+        memcpy(&client_addr, &accepted_addr, sizeof(client_addr));
 
-    va_start(ap, format);
+        if (server->output_type != NO_LOG) {
+            // this is more for logging and checking that address are
+            // they are supposed to be when sent back in a search
+            char ip[IPLEN_AND_PORT];
 
-    fprintf(server->output, "[ERROR] ");
-    vfprintf(server->output, format, ap);
+            if (client_addr.sa_family == AF_UNIX) {
+                srv_info(server, "client addr: local\n");
+            } else if (get_ip_port(&client_addr, ip, IPLEN_AND_PORT, true) == NULL) {
+                srv_error(server, "failed to create ip string from client: %s\n", strerror(errno));
+            } else {
+                srv_info(server, "client addr: %s\n", ip);
+            }
+        }
 
-    va_end(ap);
+        if (engine_connect(server, client_sock, &client_addr) == NULL) {
+            srv_error(server, "failed to store client %d\n", client_sock);
 
-    if (server->output_type == FILE_LOG) {
-        fflush(server->output);
+            close(client_sock);
+        }
     }
 }
 
-void srv_debug(struct server* server, const char* format, ...) {
-    va_list ap;
+void handle_client(struct server* server, struct client* client) {
+    ssize_t read = recv(client->sock, client->cold->in_buf + client->cold->in_len, BUFF_SIZE - client->cold->in_len, 0);
+
+    TRACE3(client_read, client->cold->conn, client->sock, read);
 
-    va_start(ap, format);
+    if (read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
 
-    fprintf(server->output, "[DEBUG] ");
-    vfprintf(server->output, format, ap);
+    if (read <= 0) {
+        if (read == -1) {
+            srv_error(server, "client %d error: %s\n", client->sock, strerror(errno));
+        }
 
-    va_end(ap);
+        close_client(server, client);
 
-    if (server->output_type == FILE_LOG) {
-        fflush(server->output);
+        return;
     }
-}
 
-void handle_signal(int signo) {
-    if (!TEST_OUTPUT) {
-        // dont do anything special, just log the signal
-        printf("[server] received signal %d\n", signo);
+    if (client->type == CLIENT_STANDBY) {
+        srv_warn(server, "client %d: standby sent unexpected data\n", client->sock);
+        return;
     }
-}
 
-void clear_client_files(struct client *c) {
-    for (size_t index = 0; index < c->files_len; ++index) {
-        free(c->files[index]);
+    if (client->ring != NULL) {
+        // the bytes are only a doorbell, the requests are in the ring
+        process_client(server, client);
+        return;
     }
 
-    free(c->files);
-
-    // avoid dangling pointers
-    c->files = NULL;
-}
-
-void clear_client(struct client *c) {
-    clear_client_files(c);
+    client->cold->in_len += (size_t)read;
 
-    c->active = false;
-    c->id = 0;
-    c->sock = 0;
-    c->files_len = 0;
+    process_client(server, client);
 }
 
-void close_server_output(struct server* s) {
-    if (s->output_type != FILE_LOG) {
-        return;
-    }
+int64_t next_wakeup(struct server *server) {
+    int64_t wakeup = -1;
 
-    if (fclose(s->output) != 0) {
-        perror("[server] failed to close output file");
+    if (server->timers_len > 0) {
+        wakeup = server->timers[0].at > server->now ? (int64_t)(server->timers[0].at - server->now) : 0;
     }
-}
 
-void server_accept(struct server* server) {
-    srv_info(server, "accepting new connection\n");
+    for (size_t index = 0; index < server->max_conn && server->deferred > 0; ++index) {
+        struct client *c = &server->clients[index];
 
-    struct sockaddr client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    int client_sock = accept(server->listen_sock, &client_addr, &client_len);
+        // a listing client is woken up by its socket
+        if (!c->active || !c->deferred || c->listing) {
+            continue;
+        }
 
-    if (client_sock == -1) {
-        srv_error(server, "failed to accept client: %s\n", strerror(errno));
-        return;
-    }
+        int64_t wait = 0;
 
-    if (server->active_clients == server->max_conn - 1) {
-        srv_warn(server, "max server connections reached\n");
+        // only a throttled client has to wait, one that ran out of its slice
+        // goes again right away
+        if (server->rate > 0) {
+            double tokens = c->cold->tokens + (double)(server->now - c->cold->refilled_at) * server->rate / 1000.0;
 
-        if (close(client_sock) != 0) {
-            srv_error(server, "error closing connected socket: %s\n", strerror(errno));
-            return;
+            if (tokens < 1) {
+                wait = (int64_t)((1 - tokens) * 1000.0 / server->rate) + 1;
+            }
         }
-    }
-
-    {
-        // this is more for logging and checking that address are
-        // they are supposed to be when sent back in a search
-        char ip[IPLEN_AND_PORT];
 
-        if (get_ip_port(&client_addr, ip, IPLEN_AND_PORT, true) == NULL) {
-            srv_error(server, "failed to create ip string from client: %s\n", strerror(errno));
-        } else {
-            srv_info(server, "client addr: %s\n", ip);
+        if (wakeup == -1 || wait < wakeup) {
+            wakeup = wait;
         }
     }
 
-    FD_SET(client_sock, &server->all_socks);
-
-    if (client_sock > server->max_socket) {
-        server->max_socket = client_sock;
+    // the load is only measured when the loop runs, so keep it running while
+    // shedding or an idle server would never notice it has recovered
+    if (server->shedding && (wakeup == -1 || wakeup > LOAD_RECHECK_MS)) {
+        wakeup = LOAD_RECHECK_MS;
     }
 
-    for (size_t index = 0; index < server->max_conn; ++index) {
-        if (!server->clients[index].active) {
-            server->clients[index].active = true;
-            server->clients[index].sock = client_sock;
-            server->clients[index].addr = client_addr;
-            server->active_clients += 1;
-            break;
-        }
-    }
+    return wakeup;
 }
 
-void handle_client(struct server* server, struct client* client) {
-    uint8_t recv_buffer[BUFF_SIZE];
-    // the server currently makes the assumption that we will
-    // receive all the bytes necessary to handle the request
-    ssize_t read = recv(client->sock, recv_buffer, BUFF_SIZE, 0);
-
-    if (read <= 0) {
-        if (read == -1) {
-            srv_error(server, "client %d error: %s\n", client->sock, strerror(errno));
-        }
+bool spin_rings(struct server *server) {
+    size_t idle = server->spin ? 0 : SHM_SPIN_IDLE;
 
-        srv_info(server, "client: %d closing\n", client->sock);
+    for (size_t spin = 0; spin < SHM_SPIN_MAX && idle < SHM_SPIN_IDLE; ++spin) {
+        size_t handled = 0;
 
-        close(client->sock);
-
-        FD_CLR(client->sock, &server->all_socks);
-
-        clear_client(client);
-        server->active_clients -= 1;
-
-        return;
-    }
+        for (size_t index = 0; index < server->max_conn; ++index) {
+            if (server->clients[index].active && server->clients[index].ring != NULL) {
+                handled += process_client(server, &server->clients[index]);
+            }
+        }
 
-    srv_debug(server, "client %d data:\n", client->sock);
-
-    print_buffer(server->output, recv_buffer, (size_t)read, VERBOSE);
-
-    switch (recv_buffer[0]) {
-    case 0: // JOIN
-        handle_join(server, client, recv_buffer + 1, (size_t)read - 1);
-        break;
-    case 1: // PUBLISH
-        handle_publish(server, client, recv_buffer + 1, (size_t)read - 1);
-        break;
-    case 2: // SEARCH
-        handle_search(server, client, recv_buffer + 1, (size_t)read - 1);
-        break;
-    default:
-        srv_warn(server, "unknown command received from client: %u\n", recv_buffer[0]);
-        break;
+        if (handled == 0) {
+            idle += 1;
+        } else {
+            idle = 0;
+        }
     }
-}
 
-void handle_join(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
-    if (len != 4) {
-        srv_warn(server, "handle_join: bytes received is not 4\n");
-        return;
+    if (idle < SHM_SPIN_IDLE) {
+        return true;
     }
 
-    uint32_t received_id = 0;
+    // tell the peers to ring the doorbell and then check one more time in
+    // case a request came in before they could see the flag
+    set_rings_sleeping(server, true);
 
-    memcpy(&received_id, buffer, 4);
-    received_id = ntohl(received_id);
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *c = &server->clients[index];
 
-    srv_info(server, "handle_join: client joining registry. id: %u\n", received_id);
+        if (c->active && c->ring != NULL && process_client(server, c) != 0) {
+            set_rings_sleeping(server, false);
 
-    for (size_t index = 0; index < server->max_conn; ++index) {
-        if (!server->clients[index].active) {
-            continue;
+            return true;
         }
+    }
 
-        if (server->clients[index].id == received_id) {
-            // more for logging purposes
-            if (server->clients[index].sock != client->sock) {
-                if (client->type == CLIENT_JOINED) {
-                    srv_warn(server, "handle_join: client already registered\n");
-                } else {
-                    srv_warn(server, "handle_join: client has been REGISTERED\n");
-                }
-            } else {
-                srv_warn(server, "handle_join: client id already registered\n");
-            }
+    return false;
+}
 
-            break;
-        } else {
+void set_rings_sleeping(struct server *server, bool sleeping) {
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        struct client *c = &server->clients[index];
 
-            char ip[IPLEN_AND_PORT];
+        if (c->active && c->ring != NULL) {
+            atomic_store_explicit(&c->ring->server_sleeping, sleeping ? 1 : 0, memory_order_seq_cst);
+        }
+    }
+}
 
-            if (get_ip_port(&client->addr, ip, IPLEN_AND_PORT, true) == NULL) {
-                srv_error(server, "handle_join: failed to create ip string from client: %s\n", strerror(errno));
-                srv_info(server, "handle_join: client registered %u\n", received_id);
-            } else {
-                srv_info(server, "handle_join: client addr: %s -> %u\n", ip, received_id);
-            }
+void handle_udp(struct server *server) {
+    struct mmsghdr requests[UDP_BATCH];
+    struct mmsghdr responses[UDP_BATCH];
+    struct iovec request_iov[UDP_BATCH];
+    struct iovec response_iov[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    uint8_t request_buffers[UDP_BATCH][UDP_REQUEST_SIZE];
+    uint8_t response_buffers[UDP_BATCH][SEARCH_RESPONSE_SIZE];
+    size_t answered = 0;
+
+    // only drain a bounded number of batches so that the tcp clients are not
+    // starved during a flood of datagrams
+    for (size_t batch = 0; batch < UDP_MAX_BATCHES; ++batch) {
+        for (size_t index = 0; index < UDP_BATCH; ++index) {
+            request_iov[index].iov_base = request_buffers[index];
+            request_iov[index].iov_len = UDP_REQUEST_SIZE;
+
+            memset(&requests[index].msg_hdr, 0, sizeof(struct msghdr));
+            requests[index].msg_hdr.msg_name = &addrs[index];
+            requests[index].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            requests[index].msg_hdr.msg_iov = &request_iov[index];
+            requests[index].msg_hdr.msg_iovlen = 1;
+        }
 
-            if (TEST_OUTPUT) {
-                printf("TEST] JOIN %u\n", received_id);
-            }
+        int received = recvmmsg(server->udp_sock, requests, UDP_BATCH, MSG_DONTWAIT, NULL);
 
-            client->id = received_id;
-            client->type = CLIENT_JOINED;
+        if (received <= 0) {
+            if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                srv_error(server, "handle_udp: recvmmsg: %s\n", strerror(errno));
+            }
 
             break;
         }
-    }
-}
 
-void handle_publish(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
-    if (client->type == CLIENT_UNKNOWN) {
-        srv_warn(server, "handle_publish: client has not joined or registered\n");
-        return;
-    }
+        size_t to_send = 0;
 
-    if (len >= 1199) {
-        srv_warn(server, "handle_publish: bytes received is greater than 1200\n");
-        return;
-    }
+        for (int index = 0; index < received; ++index) {
+            uint8_t *request = request_buffers[index];
+            size_t len = requests[index].msg_len;
 
-    srv_info(server, "handle_publish: client %u publishing files\n", client->id);
+            // anything other than a search is silently dropped since udp
+            // clients have no state to join or publish with
+            if (len < 1 || request[0] != ACTION_SEARCH || (requests[index].msg_hdr.msg_flags & MSG_TRUNC)) {
+                continue;
+            }
 
-    size_t files_len = 0;
+            search_request(server, request + 1, len - 1, (struct sockaddr *)&addrs[index], response_buffers[to_send]);
 
-    if (len < 4) {
-        srv_warn(server, "handle_publish: too few bytes received\n");
-        return;
-    }
+            response_iov[to_send].iov_base = response_buffers[to_send];
+            response_iov[to_send].iov_len = SEARCH_RESPONSE_SIZE;
 
-    memcpy(&files_len, buffer, 4);
-    files_len = ntohl(files_len);
+            memset(&responses[to_send].msg_hdr, 0, sizeof(struct msghdr));
+            responses[to_send].msg_hdr.msg_name = &addrs[index];
+            responses[to_send].msg_hdr.msg_namelen = requests[index].msg_hdr.msg_namelen;
+            responses[to_send].msg_hdr.msg_iov = &response_iov[to_send];
+            responses[to_send].msg_hdr.msg_iovlen = 1;
 
-    if (files_len > server->max_files) {
-        srv_warn(server, "handle_publish: number of files is greater than max. given: %lu\n", files_len);
-        return;
-    }
+            to_send += 1;
+        }
 
-    // flag for indicating if we need to cleanup due to an error or issue from
-    // the client
-    bool clean_up = false;
-    // in the event that we have to clean up we will use this to keep track of
-    // what we have already allocated
-    size_t allocated = 0;
-    // moving pointer for our current location in the buffer
-    uint8_t *p = buffer + 4;
-    // pre-allocate the list and we will not re-allocate
-    char **files = calloc(sizeof(char *), files_len);
-
-    len -= 4;
-
-    // this is probably the portion that can have the most issue due to
-    // allocating strings and having to keep track of what bytes we are
-    // looking at
-    for (size_t count = 0; count < files_len; ++count) {
-        bool found_null = false;
-        size_t str_len = 0;
-
-        //srv_debug(server, "handle_publish: len? %lu\n", len);
-
-        for (; str_len < len; ++str_len) {
-            if (p[str_len] == 0) {
-                found_null = true;
-                break;
-            } else if (p[str_len] >= 128) {
-                srv_warn(server, "handle_publish: invalid ASCII character received from client\n");
+        size_t sent = 0;
 
-                clean_up = true;
+        while (sent < to_send) {
+            int result = sendmmsg(server->udp_sock, responses + sent, to_send - sent, 0);
 
+            if (result <= 0) {
+                // responses are best effort, the client will retry or fall
+                // back to tcp
+                srv_error(server, "handle_udp: sendmmsg: %s\n", strerror(errno));
                 break;
             }
-        }
-
-        if (!found_null) {
-            srv_warn(server, "handle_publish: non null terminated string given by client\n");
 
-            clean_up = true;
-
-            break;
+            sent += (size_t)result;
         }
 
-        char *str = calloc(sizeof(char), str_len);
-
-        if (str == NULL) {
-            srv_error(server, "handle_publish: failed allocating string\n");
-
-            clean_up = true;
+        answered += sent;
 
+        if (received < UDP_BATCH) {
             break;
         }
+    }
 
-        strncpy(str, (char *)p, str_len);
+    srv_info(server, "handle_udp: answered %lu searches\n", answered);
+}
 
-        files[allocated] = str;
-        allocated += 1;
+int bind_udp(struct server *server, const char *service) {
+    struct addrinfo hints;
+    struct addrinfo *rp, *result;
+    int s;
 
-        srv_info(server, "handle_publish: str: \"%s\" %lu\n", str, str_len);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_protocol = 0;
 
-        p += str_len + 1;
-        len -= str_len + 1;
+    if ((s = getaddrinfo(NULL, service, &hints, &result)) != 0) {
+        srv_error(server, "bind_udp: getaddrinfo: %s\n", gai_strerror(s));
+        return -1;
     }
 
-    if (clean_up) {
-        srv_log(server, "handle_publish: cleaning up allocated strings\n");
-
-        for (size_t index = 0; index < allocated; ++index) {
-            free(files[index]);
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if ((s = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol)) == -1) {
+            continue;
         }
 
-        free(files);
-    } else {
-        // on the off chance that they have already published files to the 
-        // server we will attempt to clean up any previous files
-        clear_client_files(client);
-
-        client->files_len = files_len;
-        client->files = files;
-
-        srv_info(server, "handle_publish: published files\n");
-
-        for (size_t index = 0; index < client->files_len; ++index) {
-            srv_log(server, "    %s\n", client->files[index]);
+        if (bind(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
         }
 
-        if (TEST_OUTPUT) {
-            printf("TEST] PUBLISH %lu", client->files_len);
+        close(s);
+    }
 
-            for (size_t index = 0; index < client->files_len; ++index) {
-                printf(" %s", client->files[index]);
-            }
+    freeaddrinfo(result);
 
-            printf("\n");
-        }
+    if (rp == NULL) {
+        srv_error(server, "bind_udp: failed to bind udp socket\n");
+        return -1;
     }
+
+    return s;
 }
 
-struct client* search_client_files(struct server* server, const char *find, struct client *client) {
-    // if we had string lengths before hand this could probably be simpler
-    for (size_t file_index = 0; file_index < client->files_len; ++file_index) {
-        bool invalid = false;
-        bool reached_end = false;
-        size_t index = 0;
+int connect_primary(struct server *server, const char *primary) {
+    char host[256];
+    const char *sep = strrchr(primary, ':');
 
-        srv_debug(server, "     checking \"%s\"\n", client->files[file_index]);
+    if (sep == NULL || (size_t)(sep - primary) >= sizeof(host)) {
+        srv_error(server, "connect_primary: expected HOST:PORT. given: %s\n", primary);
+        return -1;
+    }
 
-        while (1) {
-            if (client->files[file_index][index] == 0) {
-                reached_end = true;
-                break;
-            }
+    memcpy(host, primary, sep - primary);
+    host[sep - primary] = 0;
 
-            if (find[index] == 0) {
-                break;
-            }
+    struct addrinfo hints;
+    struct addrinfo *rp, *result;
+    int s;
 
-            if (find[index] != client->files[file_index][index]) {
-                invalid = true;
-                break;
-            }
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((s = getaddrinfo(host, sep + 1, &hints, &result)) != 0) {
+        srv_error(server, "connect_primary: getaddrinfo: %s\n", gai_strerror(s));
+        return -1;
+    }
 
-            index += 1;
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+            continue;
         }
 
-        if (!invalid && reached_end) {
-            return client;
+        if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
         }
+
+        close(s);
     }
 
-    return NULL;
-}
+    freeaddrinfo(result);
 
-void handle_search(struct server *server, struct client *client, uint8_t *buffer, size_t len) {
-    if (client->type == CLIENT_UNKNOWN) {
-        srv_warn(server, "handle_publish: client has not joined or registered\n");
-        return;
+    if (rp == NULL) {
+        srv_error(server, "connect_primary: failed to connect to %s\n", primary);
+        return -1;
     }
 
-    if (len >= 100) {
-        srv_warn(server, "handle_search: received too many bytes from client\n");
-        return;
-    }
+    uint8_t request = ACTION_REPLICATE;
 
-    uint8_t response[10] = {0};
+    if (send_bytes(s, &request, 1) != 0) {
+        srv_error(server, "connect_primary: failed to request replication: %s\n", strerror(errno));
 
-    // check to make sure that the string we are given is a valid ASCII string
-    for (size_t check = 0; check < len; ++check) {
-        if (buffer[check] >= 128) {
-            srv_warn(server, "handle_search: file name contains non ASCII characters\n");
+        close(s);
 
-            if (send_bytes(client->sock, response, 10) != 0) {
-                srv_error(server, "handle_search: error sending resposne: %s\n", strerror(errno));
-                return;
-            }
-        }
+        return -1;
     }
 
-    if (buffer[len - 1] != 0) {
-        srv_warn(server, "handle_search: non null terminated string from client\n");
+    return s;
+}
 
-        if (send_bytes(client->sock, response, 10) != 0) {
-            srv_error(server, "handle_search: error sending resposne: %s\n", strerror(errno));
-            return;
-        }
-    }
+void handle_primary(struct server *server) {
+    ssize_t read = recv(
+        server->repl_sock,
+        server->repl_buffer + server->repl_len,
+        REPL_BUFF_SIZE - server->repl_len,
+        0
+    );
 
-    struct client *found = NULL;
-    char *p = (char *)buffer;
+    if (read <= 0) {
+        if (read == -1) {
+            srv_error(server, "handle_primary: %s\n", strerror(errno));
+        }
 
-    srv_info(server, "handle_search: client %u searching files for %s\n", client->id, p);
+        // the mirrored clients are kept around so that searches continue to
+        // be answered while the peers fail over to this server. a primary
+        // resyncs a standby that falls behind instead of closing it, so the
+        // stream only ends when the primary is gone
+        srv_warn(server, "handle_primary: lost primary, promoting to primary\n");
 
-    for (size_t index = 0; index < server->max_conn; ++index) {
-        if (!server->clients[index].active) {
-            continue;
-        }
+        park_mirrors(server);
 
-        srv_debug(server, "handle_search: checking client: %u\n", server->clients[index].id);
+        close(server->repl_sock);
 
-        found = search_client_files(server, p, &server->clients[index]);
+        FD_CLR(server->repl_sock, &server->all_socks);
 
-        if (found != NULL) {
-            srv_info(server, "handle_search: found file. id: %u\n", found->id);
+        server->repl_sock = -1;
+        server->repl_len = 0;
 
-            break;
-        }
+        return;
     }
 
-    if (found == NULL) {
-        srv_info(server, "handle_search: failed to find file\n");
+    server->repl_len += (size_t)read;
 
-        if (TEST_OUTPUT) {
-            printf("TEST] SEARCH %s 0 0.0.0.0:0\n", p);
-        }
-    } else {
-        // since we do not care if the client connects with an v4 or v6
-        // address we have to check to make sure that the client is v4
-        if (found->addr.sa_family == AF_INET) {
-            uint32_t id = htonl(found->id);
-            memcpy(response, &id, 4);
-
-            struct sockaddr_in *v4 = (struct sockaddr_in *)&found->addr;
-            memcpy(response + 4, &v4->sin_addr.s_addr, 4);
-            memcpy(response + 8, &v4->sin_port, 2);
-
-            if (TEST_OUTPUT) {
-                char ip[IPLEN_AND_PORT];
-
-                if (get_ipv4_port(v4, ip, IPLEN_AND_PORT, true) == NULL) {
-                    srv_error(server, "handle_search: failed to create ipv4 string from client: %s\n", strerror(errno));
-                } else {
-                    printf("TEST] SEARCH %s %u %s\n", p, found->id, ip);
-                }
-            }
-        } else {
-            srv_warn(server, "handle_search: client is using non IPv4 address\n");
-        }
-    }
+    size_t offset = 0;
 
-    srv_info(server, "handle_search: sending response\n");
+    while (server->repl_len - offset >= REPL_HEADER_SIZE) {
+        uint8_t *frame = server->repl_buffer + offset;
+        uint32_t payload_len = 0;
 
-    if (send_bytes(client->sock, response, 10) != 0) {
-        srv_error(server, "handle_search: error sending resposne: %s\n", strerror(errno));
-    }
-}
+        memcpy(&payload_len, frame + 1, 4);
+        payload_len = ntohl(payload_len);
 
-char* get_ipv4_port(struct sockaddr_in* addr, char* str, size_t len, bool inc_port) {
-    if (inet_ntop(AF_INET, &addr->sin_addr, str, len) == NULL) {
-        return NULL;
-    }
+        if (payload_len > REPL_BUFF_SIZE - REPL_HEADER_SIZE) {
+            srv_error(server, "handle_primary: frame too large: %u\n", payload_len);
+
+            close(server->repl_sock);
+
+            FD_CLR(server->repl_sock, &server->all_socks);
 
-    if (inc_port) {
-        // short cut this since the minimum size of an IPv4 address is 7
-        // characters
-        size_t wrote = strlen(str + 7) + 7;
+            server->repl_sock = -1;
+            server->repl_len = 0;
 
-        if (wrote + 6 > len) {
-            return str;
+            return;
         }
 
-        if (snprintf(str + wrote, len - wrote, ":%u", ntohs(addr->sin_port)) < 0) {
-            return NULL;
-        } else {
-            return str;
+        if (server->repl_len - offset < REPL_HEADER_SIZE + payload_len) {
+            break;
         }
-    } else {
-        return str;
-    }
-}
 
-char* get_ipv6_port(struct sockaddr_in6* addr, char* str, size_t len, bool inc_port) {
-    if (inet_ntop(AF_INET6, &addr->sin6_addr, str, len) == NULL) {
-        return NULL;
+        apply_replication(server, frame[0], frame + REPL_HEADER_SIZE, payload_len);
+
+        offset += REPL_HEADER_SIZE + payload_len;
     }
 
-    if (inc_port) {
-        // the address could be between 3 and 45 characters for IPv6 so
-        // there is not much of a gain here
-        size_t wrote = strlen(str + 3) + 3;
+    memmove(server->repl_buffer, server->repl_buffer + offset, server->repl_len - offset);
+    server->repl_len -= offset;
+}
 
-        if (wrote + 6 > len) {
-            return str;
-        }
+int bind_unix(struct server *server, const char *path) {
+    struct sockaddr_un addr;
 
-        if (snprintf(str + wrote, len - wrote, ":%u", ntohs(addr->sin6_port)) < 0) {
-            return NULL;
-        } else {
-            return str;
-        }
-    } else {
-        return str;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        srv_error(server, "bind_unix: path is too long: %s\n", path);
+        return -1;
     }
-}
 
-char* get_ip_port(struct sockaddr* addr, char* str, size_t len, bool inc_port) {
-    if (addr->sa_family == AF_INET) {
-        struct sockaddr_in *v4 = (struct sockaddr_in *)addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-        return get_ipv4_port(v4, str, len, inc_port);
-    } else if (addr->sa_family == AF_INET6) {
-        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)addr;
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-        return get_ipv6_port(v6, str, len ,inc_port);
-    } else {
-        return NULL;
+    if (s == -1) {
+        srv_error(server, "bind_unix: socket: %s\n", strerror(errno));
+        return -1;
     }
-}
 
-// pulled from the h1-counter
-int send_bytes(int sock, const uint8_t *buff, size_t len) {
-    size_t total_sent = 0;
+    // a previous run that was killed will have left the socket file behind
+    unlink(path);
 
-    while (total_sent < len) {
-        ssize_t sent = send(sock, buff + total_sent, len - total_sent, 0);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        srv_error(server, "bind_unix: bind: %s\n", strerror(errno));
 
-        if (sent < 0) {
-            return -1;
-        }
+        close(s);
 
-        total_sent += (size_t)sent;
+        return -1;
     }
 
-    return 0;
-}
+    if (listen(s, server->backlog) == -1) {
+        srv_error(server, "bind_unix: failed to listen on socket: %s\n", strerror(errno));
 
-void print_buffer(FILE* output, const uint8_t *buff, size_t length, uint8_t flags) {
-    fprintf(output, "buffer:");
+        close(s);
 
-    for (size_t index = 0; index < length; ++index) {
-        if (buff[index] <= 0x0f) {
-            fprintf(output, " 0%x", buff[index]);
-        } else {
-            fprintf(output, " %x", buff[index]);
-        }
+        return -1;
     }
 
-    if ((flags & VERBOSE) == VERBOSE) {
-        fprintf(output, "\n      :");
-
-        for (size_t index = 0; index < length; ++index) {
-            if (buff[index] == '\n') {
-                // if the characters is \n then we will escape and display it
-                fprintf(output, " \\n");
-            } else if (buff[index] < 32) {
-                // vs trying to print the control characters we will just print
-                // CC for "control character"
-                fprintf(output, " CC");
-            } else if (buff[index] >= 128) {
-                // this is an extended ascii character but we are not going to
-                // print it
-                fprintf(output, " EE");
-            } else {
-                // a printable character
-                fprintf(output, "  %c", buff[index]);
-            }
-        }
-
-        fprintf(output, "\n");
-    } else {
-        fprintf(output, "\n");
-    }
+    return s;
 }
 
 int bind_and_listen(struct server* server, const char *service) {
@@ -1051,10 +1074,17 @@ int bind_and_listen(struct server* server, const char *service) {
 
     /* Iterate through the address list and try to perform passive open */
     for (rp = result; rp != NULL; rp = rp->ai_next) {
-        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+        // the listening socket is non blocking so that server_accept can
+        // drain the queue until it is empty
+        if ((s = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol)) == -1) {
             continue;
         }
 
+        // allow a restarted registry to bind right away while the previous
+        // connections are still in TIME_WAIT
+        int reuse = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
         if (bind(s, rp->ai_addr, rp->ai_addrlen) == 0) {
             //perror("[server] bind_and_listen: bind");
             break;
@@ -1064,10 +1094,14 @@ int bind_and_listen(struct server* server, const char *service) {
     }
 
     if (rp == NULL) {
+        srv_error(server, "bind_and_listen: failed to bind to %s\n", service);
+
+        freeaddrinfo(result);
+
         return -1;
     }
 
-    if (listen(s, MAX_PENDING) == -1) {
+    if (listen(s, server->backlog) == -1) {
         srv_error(server, "bind_and_listen: failed to listen on socket: %s\n", strerror(errno));
 
         close(s);
@@ -0,0 +1,651 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+
+// how long to wait for the response of a timed request
+#define RESPONSE_TIMEOUT_MS 1000
+// one slot per action code
+#define ACTIONS 256
+
+/**
+ * latencies in ns of the requests of one action
+ */
+struct samples {
+    uint64_t *ns;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * a recording loaded into memory
+ */
+struct recording {
+    uint8_t *data;
+    size_t len;
+};
+
+/**
+ * what was seen for one action, in the recording and in the replay
+ */
+struct action_stats {
+    struct samples recorded;
+    struct samples replayed;
+    // requests of the action that were sent
+    size_t sent;
+};
+
+/**
+ * reads the whole recording and checks its magic. returns false on error
+ */
+bool load_recording(const char *path, struct recording *rec);
+
+/**
+ * sends the requests of the recording to the registry following the recorded
+ * timing divided by speed, or as fast as possible if speed is 0
+ */
+int replay(struct recording *rec, const char *host, const char *port, double speed, struct action_stats *stats);
+
+/**
+ * adds the recorded latencies to the stats without sending anything
+ */
+void summarize(struct recording *rec, struct action_stats *stats);
+
+/**
+ * prints the latency percentiles of every action seen
+ */
+void report(struct action_stats *stats, bool replayed);
+
+/**
+ * size of the response the registry sends for a request of the action, 0 if
+ * there is none or its size is not known up front
+ */
+size_t response_size(uint8_t action);
+
+/**
+ * returns the name of the action for the report
+ */
+const char* action_name(uint8_t action);
+
+/**
+ * opens a tcp connection to the registry
+ */
+int connect_inet(const char *host, const char *port);
+
+/**
+ * sends all of the given bytes to the socket
+ */
+int send_all(int sock, const uint8_t *buf, size_t len);
+
+/**
+ * waits for len bytes from the socket. returns -1 on error or timeout
+ */
+int recv_all(int sock, uint8_t *buf, size_t len);
+
+/**
+ * throws away anything the registry sent that was not waited for, like
+ * notifications or the pages of a LIST
+ */
+void drain(int sock);
+
+/**
+ * appends a sample, dropping it if there is no memory
+ */
+void add_sample(struct samples *samples, uint64_t ns);
+
+/**
+ * returns the current monotonic time in nanoseconds
+ */
+uint64_t now_ns();
+
+/**
+ * compare function for qsort
+ */
+int cmp_u64(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    char *port = "5432";
+    double speed = 1;
+    bool summary = false;
+
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 0},
+        {"port", required_argument, 0, 0},
+        {"speed", required_argument, 0, 0},
+        {"summary", no_argument, 0, 0},
+        {0,0,0,0}
+    };
+
+    int option_index = 0;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        if (c != 0) {
+            optind = argc;
+            break;
+        }
+
+        switch (option_index) {
+        case 0:
+            host = optarg;
+            break;
+        case 1:
+            port = optarg;
+            break;
+        case 2:
+            speed = strtod(optarg, NULL);
+            break;
+        case 3:
+            summary = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [--host HOST] [--port PORT] [--speed N] [--summary] RECORDING\n", argv[0]);
+        fprintf(stderr, "  --speed 1 replays in real time, 2 twice as fast and 0 as fast as possible\n");
+        return 1;
+    }
+
+    if (speed < 0) {
+        fprintf(stderr, "[ERROR] --speed can not be negative\n");
+        return 1;
+    }
+
+    struct recording rec;
+
+    if (!load_recording(argv[optind], &rec)) {
+        return 1;
+    }
+
+    struct action_stats *stats = calloc(ACTIONS, sizeof(struct action_stats));
+
+    if (stats == NULL) {
+        fprintf(stderr, "[ERROR] failed allocating stats\n");
+        free(rec.data);
+        return 1;
+    }
+
+    int result = 0;
+
+    if (summary) {
+        summarize(&rec, stats);
+    } else {
+        result = replay(&rec, host, port, speed, stats);
+    }
+
+    if (result == 0) {
+        report(stats, !summary);
+    }
+
+    for (size_t action = 0; action < ACTIONS; ++action) {
+        free(stats[action].recorded.ns);
+        free(stats[action].replayed.ns);
+    }
+
+    free(stats);
+    free(rec.data);
+
+    return result;
+}
+
+bool load_recording(const char *path, struct recording *rec) {
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        fprintf(stderr, "[ERROR] failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    rec->data = NULL;
+    rec->len = 0;
+
+    size_t cap = 0;
+
+    while (true) {
+        if (rec->len == cap) {
+            cap = cap == 0 ? 1 << 20 : cap * 2;
+
+            uint8_t *data = realloc(rec->data, cap);
+
+            if (data == NULL) {
+                fprintf(stderr, "[ERROR] failed allocating the recording\n");
+
+                fclose(file);
+                free(rec->data);
+
+                return false;
+            }
+
+            rec->data = data;
+        }
+
+        size_t got = fread(rec->data + rec->len, 1, cap - rec->len, file);
+
+        if (got == 0) {
+            break;
+        }
+
+        rec->len += got;
+    }
+
+    fclose(file);
+
+    if (rec->len < RECORD_MAGIC_SIZE || memcmp(rec->data, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "[ERROR] %s is not a registry recording\n", path);
+
+        free(rec->data);
+
+        return false;
+    }
+
+    return true;
+}
+
+int replay(struct recording *rec, const char *host, const char *port, double speed, struct action_stats *stats) {
+    // a busy recording has a socket for every peer that was connected
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // sockets by the connection number of the recording, -1 if not open
+    int *socks = NULL;
+    size_t socks_len = 0;
+    size_t offset = RECORD_MAGIC_SIZE;
+    uint64_t recorded_us = 0;
+    uint64_t behind = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    uint8_t response[BUFF_SIZE];
+    uint64_t start = now_ns();
+
+    while (offset + RECORD_HEADER_SIZE <= rec->len) {
+        uint32_t since, conn, latency;
+        uint16_t len;
+
+        memcpy(&since, rec->data + offset, 4);
+        memcpy(&conn, rec->data + offset + 4, 4);
+        memcpy(&latency, rec->data + offset + 8, 4);
+        memcpy(&len, rec->data + offset + 12, 2);
+
+        since = ntohl(since);
+        conn = ntohl(conn);
+        latency = ntohl(latency);
+        len = ntohs(len);
+
+        const uint8_t *request = rec->data + offset + RECORD_HEADER_SIZE;
+
+        offset += RECORD_HEADER_SIZE + len;
+
+        if (offset > rec->len) {
+            fprintf(stderr, "[WARN] recording ends in the middle of a request\n");
+            break;
+        }
+
+        recorded_us += since;
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)(recorded_us * 1000 / speed);
+            uint64_t now = now_ns();
+
+            if (now < due) {
+                struct timespec wait = { (time_t)((due - now) / 1000000000), (long)((due - now) % 1000000000) };
+
+                nanosleep(&wait, NULL);
+            } else if (now - due > behind) {
+                behind = now - due;
+            }
+        }
+
+        if (conn >= socks_len) {
+            size_t grown = socks_len == 0 ? 1024 : socks_len;
+
+            while (grown <= conn) {
+                grown *= 2;
+            }
+
+            int *more = realloc(socks, grown * sizeof(int));
+
+            if (more == NULL) {
+                fprintf(stderr, "[ERROR] failed allocating sockets\n");
+                break;
+            }
+
+            for (size_t index = socks_len; index < grown; ++index) {
+                more[index] = -1;
+            }
+
+            socks = more;
+            socks_len = grown;
+        }
+
+        if (len == 0) {
+            if (socks[conn] != -1) {
+                close(socks[conn]);
+                socks[conn] = -1;
+            }
+
+            continue;
+        }
+
+        uint8_t action = request[0];
+
+        // replication and shared memory rings can not be replayed over a
+        // plain connection, the requests that came over a ring are sent
+        // over the socket instead
+        if (action == ACTION_REPLICATE || action == ACTION_SHM_ATTACH) {
+            skipped += 1;
+            continue;
+        }
+
+        add_sample(&stats[action].recorded, (uint64_t)latency * 1000);
+
+        if (socks[conn] == -1) {
+            socks[conn] = connect_inet(host, port);
+
+            if (socks[conn] == -1) {
+                failed += 1;
+                continue;
+            }
+        }
+
+        size_t expected = response_size(action);
+
+        drain(socks[conn]);
+
+        uint64_t sent_at = now_ns();
+
+        if (send_all(socks[conn], request, len) != 0) {
+            close(socks[conn]);
+            socks[conn] = -1;
+            failed += 1;
+            continue;
+        }
+
+        stats[action].sent += 1;
+
+        if (expected == 0) {
+            continue;
+        }
+
+        if (recv_all(socks[conn], response, expected) != 0) {
+            close(socks[conn]);
+            socks[conn] = -1;
+            failed += 1;
+            continue;
+        }
+
+        add_sample(&stats[action].replayed, now_ns() - sent_at);
+    }
+
+    for (size_t index = 0; index < socks_len; ++index) {
+        if (socks[index] != -1) {
+            close(socks[index]);
+        }
+    }
+
+    free(socks);
+
+    double took = (now_ns() - start) / 1e9;
+
+    printf("recorded:    %.2f s\n", recorded_us / 1e6);
+    printf("replayed:    %.2f s", took);
+
+    if (speed > 0) {
+        printf(" at %gx, at most %.2f ms behind schedule\n", speed, behind / 1e6);
+    } else {
+        printf(" as fast as possible\n");
+    }
+
+    printf("skipped:     %lu\n", skipped);
+    printf("failed:      %lu\n\n", failed);
+
+    return 0;
+}
+
+void summarize(struct recording *rec, struct action_stats *stats) {
+    size_t offset = RECORD_MAGIC_SIZE;
+
+    while (offset + RECORD_HEADER_SIZE <= rec->len) {
+        uint32_t latency;
+        uint16_t len;
+
+        memcpy(&latency, rec->data + offset + 8, 4);
+        memcpy(&len, rec->data + offset + 12, 2);
+
+        len = ntohs(len);
+
+        if (len > 0 && offset + RECORD_HEADER_SIZE < rec->len) {
+            uint8_t action = rec->data[offset + RECORD_HEADER_SIZE];
+
+            add_sample(&stats[action].recorded, (uint64_t)ntohl(latency) * 1000);
+        }
+
+        offset += RECORD_HEADER_SIZE + len;
+    }
+}
+
+void report(struct action_stats *stats, bool replayed) {
+    // the recorded latency is measured inside the registry from when the
+    // loop picked the request up. the replayed one is the round trip seen
+    // here so it also has the network in it
+    if (replayed) {
+        printf("%-12s %9s %21s %21s\n", "", "", "recorded us", "replayed us");
+        printf("%-12s %9s %10s %10s %10s %10s\n", "", "requests", "p50", "p99", "p50", "p99");
+    } else {
+        printf("%-12s %9s %21s\n", "", "", "recorded us");
+        printf("%-12s %9s %10s %10s %10s\n", "", "requests", "p50", "p99", "max");
+    }
+
+    for (size_t action = 0; action < ACTIONS; ++action) {
+        struct samples *rec = &stats[action].recorded;
+        struct samples *rep = &stats[action].replayed;
+
+        if (rec->len == 0) {
+            continue;
+        }
+
+        qsort(rec->ns, rec->len, sizeof(uint64_t), cmp_u64);
+
+        printf(
+            "%-12s %9lu %10.1f %10.1f",
+            action_name((uint8_t)action),
+            rec->len,
+            rec->ns[rec->len / 2] / 1000.0,
+            rec->ns[rec->len * 99 / 100] / 1000.0
+        );
+
+        if (!replayed) {
+            printf(" %10.1f\n", rec->ns[rec->len - 1] / 1000.0);
+        } else if (rep->len == 0) {
+            // nothing to wait for so only the recording can be shown
+            printf(" %10s %10s\n", "-", "-");
+        } else {
+            qsort(rep->ns, rep->len, sizeof(uint64_t), cmp_u64);
+
+            printf(" %10.1f %10.1f\n", rep->ns[rep->len / 2] / 1000.0, rep->ns[rep->len * 99 / 100] / 1000.0);
+        }
+    }
+}
+
+size_t response_size(uint8_t action) {
+    switch (action) {
+    case ACTION_SEARCH:
+        return SEARCH_RESPONSE_SIZE;
+    case ACTION_REGISTER:
+    case ACTION_RESUME:
+        return 9;
+    case ACTION_PUBLISH_IF:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+const char* action_name(uint8_t action) {
+    switch (action) {
+    case ACTION_JOIN: return "JOIN";
+    case ACTION_PUBLISH: return "PUBLISH";
+    case ACTION_SEARCH: return "SEARCH";
+    case ACTION_PUBLISH_TTL: return "PUBLISH_TTL";
+    case ACTION_HEARTBEAT: return "HEARTBEAT";
+    case ACTION_PUBLISH_META: return "PUBLISH_META";
+    case ACTION_PUBLISH_META_TTL: return "PUB_META_TTL";
+    case ACTION_SEARCH_META: return "SEARCH_META";
+    case ACTION_WATCH: return "WATCH";
+    case ACTION_UNWATCH: return "UNWATCH";
+    case ACTION_LIST: return "LIST";
+    case ACTION_PUBLISH_FC: return "PUBLISH_FC";
+    case ACTION_REGISTER: return "REGISTER";
+    case ACTION_RESUME: return "RESUME";
+    case ACTION_PUBLISH_IF: return "PUBLISH_IF";
+    case ACTION_STATS: return "STATS";
+    default: return "UNKNOWN";
+    }
+}
+
+int connect_inet(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *rp, *result;
+    int s;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+            continue;
+        }
+
+        if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(s);
+    }
+
+    freeaddrinfo(result);
+
+    if (rp == NULL) {
+        return -1;
+    }
+
+    // requests are small and the round trip is what is being measured
+    int one = 1;
+
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return s;
+}
+
+int send_all(int sock, const uint8_t *buf, size_t len) {
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t sent = send(sock, buf + total, len - total, MSG_NOSIGNAL);
+
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        total += (size_t)sent;
+    }
+
+    return 0;
+}
+
+int recv_all(int sock, uint8_t *buf, size_t len) {
+    size_t total = 0;
+
+    while (total < len) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+        if (poll(&pfd, 1, RESPONSE_TIMEOUT_MS) <= 0) {
+            return -1;
+        }
+
+        ssize_t got = recv(sock, buf + total, len - total, 0);
+
+        if (got <= 0) {
+            return -1;
+        }
+
+        total += (size_t)got;
+    }
+
+    return 0;
+}
+
+void drain(int sock) {
+    uint8_t buf[BUFF_SIZE];
+
+    while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+void add_sample(struct samples *samples, uint64_t ns) {
+    if (samples->len == samples->cap) {
+        size_t cap = samples->cap == 0 ? 1024 : samples->cap * 2;
+        uint64_t *more = realloc(samples->ns, cap * sizeof(uint64_t));
+
+        if (more == NULL) {
+            return;
+        }
+
+        samples->ns = more;
+        samples->cap = cap;
+    }
+
+    samples->ns[samples->len++] = ns;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,108 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// number of slots in each direction of the ring
+#define SHM_RING_SLOTS 16
+// large enough to hold the largest request the registry accepts
+#define SHM_SLOT_SIZE 2048
+
+/**
+ * a single message stored in a queue. the bytes are the same as what would
+ * be sent over a socket, [action][payload] for requests
+ */
+struct shm_slot {
+    uint32_t len;
+    uint8_t data[SHM_SLOT_SIZE];
+};
+
+/**
+ * single producer single consumer queue. head is only written by the
+ * producer and tail only by the consumer, they are kept on separate cache
+ * lines so the two sides do not fight over them
+ */
+struct shm_queue {
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    _Alignas(64) struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+/**
+ * the shared memory region passed from the registry to a local peer as a
+ * memfd over the unix socket
+ */
+struct shm_ring {
+    // peer -> registry
+    struct shm_queue requests;
+    // registry -> peer
+    struct shm_queue responses;
+    // set by the registry before it blocks in pselect. a producer that sees
+    // this set has to ring the doorbell by writing a byte to the unix socket
+    _Alignas(64) _Atomic uint32_t server_sleeping;
+};
+
+/**
+ * copies the message into the next free slot. returns false if the queue is
+ * full or the message is too large
+ */
+static inline bool shm_queue_push(struct shm_queue *q, const uint8_t *data, size_t len) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head - tail == SHM_RING_SLOTS || len > SHM_SLOT_SIZE) {
+        return false;
+    }
+
+    struct shm_slot *slot = &q->slots[head % SHM_RING_SLOTS];
+
+    slot->len = (uint32_t)len;
+    memcpy(slot->data, data, len);
+
+    // seq_cst so that the store is ordered before checking server_sleeping
+    atomic_store_explicit(&q->head, head + 1, memory_order_seq_cst);
+
+    return true;
+}
+
+/**
+ * returns the oldest message in the queue or NULL if it is empty. the slot
+ * stays valid until shm_queue_pop is called
+ */
+static inline struct shm_slot* shm_queue_peek(struct shm_queue *q) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return &q->slots[tail % SHM_RING_SLOTS];
+}
+
+/**
+ * releases the slot returned by shm_queue_peek back to the producer
+ */
+static inline void shm_queue_pop(struct shm_queue *q) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * checks if the queue has no room for another message
+ */
+static inline bool shm_queue_full(struct shm_queue *q) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    return head - tail == SHM_RING_SLOTS;
+}
+
+#endif
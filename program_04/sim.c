@@ -0,0 +1,783 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "engine.h"
+
+// the virtual clock starts here so 0 keeps meaning "not set" to the timers
+// of the engine
+#define SIM_EPOCH 1000
+// peers connect at random times over this many ms at the start of a run
+#define SIM_RAMP 5000
+// the reconnects after a storm are spread over this many ms
+#define SIM_STORM_SPREAD 2000
+// the republishes of a flood are spread over this many ms
+#define SIM_FLOOD_SPREAD 100
+
+/**
+ * the things that can happen in a simulation, kept in a heap ordered by
+ * virtual time
+ */
+enum sim_event_type {
+    // schedules the searches and drops of the next second
+    EV_SECOND,
+    // the peer connects and registers its catalog
+    EV_CONNECT,
+    // the connection of the peer drops
+    EV_DROP,
+    // the peer reconnects and resumes, or registers again if its catalog
+    // is gone
+    EV_RESUME,
+    // the peer publishes a new version of its catalog
+    EV_PUBLISH,
+    // a search for a random file of a random peer
+    EV_SEARCH,
+    // a share of the peers drops at the same time and reconnects right away
+    EV_STORM,
+    // a share of the peers republishes at about the same time
+    EV_FLOOD,
+};
+
+/**
+ * the requests timed by the simulation
+ */
+enum sim_action {
+    SIM_REGISTER,
+    SIM_RESUME,
+    SIM_PUBLISH,
+    SIM_SEARCH,
+    SIM_ACTIONS,
+};
+
+const char *SIM_ACTION_NAMES[SIM_ACTIONS] = {"REGISTER", "RESUME", "PUBLISH", "SEARCH"};
+
+enum peer_state {
+    PEER_OFFLINE,
+    PEER_ONLINE,
+    // the connection dropped and the peer is waiting to resume
+    PEER_DROPPED,
+};
+
+struct sim_event {
+    uint64_t at;
+    uint32_t peer;
+    uint8_t type;
+};
+
+/**
+ * what the simulation knows about one of its peers
+ */
+struct sim_peer {
+    struct client *client;
+    // handed out by the registry at REGISTER
+    uint64_t token;
+    // bumped on every publish, part of the names of the catalog
+    uint32_t version;
+    uint8_t state;
+};
+
+/**
+ * wall clock time taken by every request of one action
+ */
+struct samples {
+    uint64_t *ns;
+    size_t len;
+    size_t cap;
+};
+
+struct sim {
+    struct server *server;
+    struct sim_peer *peers;
+    size_t peers_len;
+    // joined peer that does all of the searching
+    struct client *searcher;
+    // min heap of pending events
+    struct sim_event *events;
+    size_t events_len;
+    size_t events_cap;
+    // state of the generator every random choice is drawn from
+    uint64_t random;
+    // virtual time in ms the run stops at
+    uint64_t end;
+    // searches and drops per virtual second
+    size_t searches;
+    size_t churn;
+    // percent of the peers taking part in the storm and the flood
+    size_t storm;
+    size_t flood;
+    struct samples samples[SIM_ACTIONS];
+    // hash of every response, the same seed has to give the same value
+    uint64_t fingerprint;
+    uint64_t requests;
+    uint64_t found;
+    uint64_t missed;
+    uint64_t resumed;
+    // resumes that came in after the grace period and registered again
+    uint64_t expired;
+    // connections that did not get a slot
+    uint64_t refused;
+    size_t peak_mem;
+    uint8_t request[BUFF_SIZE];
+    uint8_t response[BUFF_SIZE];
+};
+
+/**
+ * sets up the server and the peers and runs the events until the end of the
+ * virtual time. returns false if an allocation failed
+ */
+bool sim_run(struct sim *sim);
+
+/**
+ * frees the server and everything the simulation allocated
+ */
+void sim_free(struct sim *sim);
+
+/**
+ * prints throughput, memory and the latency of every action
+ */
+void sim_report(struct sim *sim, uint64_t real_ns);
+
+/**
+ * adds an event to the heap
+ */
+bool sim_push(struct sim *sim, uint64_t at, uint32_t peer, uint8_t type);
+
+/**
+ * removes and returns the earliest event of the heap
+ */
+struct sim_event sim_pop(struct sim *sim);
+
+/**
+ * handles a single event at the current virtual time
+ */
+void sim_handle(struct sim *sim, struct sim_event *event);
+
+/**
+ * hands a request to the engine for the given client, times it and folds the
+ * response into the fingerprint. returns the length of the response
+ */
+size_t sim_request(struct sim *sim, struct client *client, uint8_t action, size_t len);
+
+/**
+ * gives the peer a new connection. returns false if the server is full
+ */
+bool peer_connect(struct sim *sim, uint32_t peer);
+
+/**
+ * registers the catalog of the peer on its connection
+ */
+void peer_register(struct sim *sim, uint32_t peer);
+
+/**
+ * drops the connection of an online peer, it tries to resume after delay ms
+ */
+void peer_drop(struct sim *sim, uint32_t peer, uint64_t delay);
+
+/**
+ * reconnects a dropped peer and resumes its session
+ */
+void peer_resume(struct sim *sim, uint32_t peer);
+
+/**
+ * publishes the next version of the catalog of an online peer
+ */
+void peer_publish(struct sim *sim, uint32_t peer);
+
+/**
+ * searches for a random file of a random peer from the searcher
+ */
+void sim_search(struct sim *sim);
+
+/**
+ * writes [count][names] of the catalog of the peer to buf and returns its
+ * length
+ */
+size_t build_catalog(struct sim *sim, uint8_t *buf, size_t len, uint32_t peer);
+
+/**
+ * xorshift generator so that every run with the same seed makes the same
+ * choices
+ */
+uint64_t next_random(uint64_t *state);
+
+/**
+ * returns the current time of the monotonic clock in ns
+ */
+uint64_t now_ns();
+
+/**
+ * compare function for qsort
+ */
+int cmp_u64(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    static struct sim sim;
+    size_t peers = 100000;
+    uint64_t seed = 1;
+    uint64_t duration = 60;
+
+    sim.searches = 5;
+    sim.churn = 0;
+    sim.storm = 30;
+    sim.flood = 50;
+
+    static struct option long_options[] = {
+        {"peers", required_argument, 0, 0},
+        {"seed", required_argument, 0, 0},
+        {"duration", required_argument, 0, 0},
+        {"searches", required_argument, 0, 0},
+        {"churn", required_argument, 0, 0},
+        {"storm", required_argument, 0, 0},
+        {"flood", required_argument, 0, 0},
+        {0,0,0,0}
+    };
+
+    int option_index = 0;
+    bool churn_set = false;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        if (c != 0) {
+            fprintf(stderr, "usage: %s [--peers N] [--seed N] [--duration SECONDS] [--searches PER_SECOND] [--churn PER_SECOND] [--storm PERCENT] [--flood PERCENT]\n", argv[0]);
+            return 1;
+        }
+
+        switch (option_index) {
+        case 0:
+            peers = strtoul(optarg, NULL, 10);
+            break;
+        case 1:
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 2:
+            duration = strtoull(optarg, NULL, 10);
+            break;
+        case 3:
+            sim.searches = strtoul(optarg, NULL, 10);
+            break;
+        case 4:
+            sim.churn = strtoul(optarg, NULL, 10);
+            churn_set = true;
+            break;
+        case 5:
+            sim.storm = strtoul(optarg, NULL, 10);
+            break;
+        case 6:
+            sim.flood = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (peers == 0 || peers >= UINT32_MAX / 2 || duration == 0) {
+        fprintf(stderr, "[ERROR] --peers and --duration must be greater than 0\n");
+        return 1;
+    }
+
+    if (sim.storm > 100 || sim.flood > 100) {
+        fprintf(stderr, "[ERROR] --storm and --flood are percentages of the peers\n");
+        return 1;
+    }
+
+    // by default a peer in a thousand drops every second
+    if (!churn_set) {
+        sim.churn = peers / 1000;
+    }
+
+    sim.peers_len = peers;
+    sim.end = SIM_EPOCH + duration * 1000;
+    // 0 would stop the generator, the mix keeps nearby seeds apart
+    sim.random = seed * 0x9e3779b97f4a7c15 + 1;
+    sim.fingerprint = 0xcbf29ce484222325;
+
+    uint64_t start = now_ns();
+
+    if (!sim_run(&sim)) {
+        sim_free(&sim);
+        return 1;
+    }
+
+    sim_report(&sim, now_ns() - start);
+    sim_free(&sim);
+
+    return 0;
+}
+
+bool sim_run(struct sim *sim) {
+    struct server *server = calloc(1, sizeof(struct server));
+
+    sim->server = server;
+    sim->peers = calloc(sim->peers_len, sizeof(struct sim_peer));
+
+    if (server == NULL || sim->peers == NULL) {
+        fprintf(stderr, "[ERROR] failed allocating simulation state\n");
+        return false;
+    }
+
+    server->output_type = NO_LOG;
+    server->output = stdout;
+
+    // a dropped peer keeps its slot until it resumes on a new one, so every
+    // peer can need two at once
+    if (!engine_init(server, sim->peers_len * 2 + 1)) {
+        fprintf(stderr, "[ERROR] failed to set up the engine: %s\n", strerror(errno));
+
+        free(server);
+        sim->server = NULL;
+
+        return false;
+    }
+
+    server->seed = next_random(&sim->random);
+
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    engine_tick(server, SIM_EPOCH);
+
+    sim->searcher = engine_connect(server, -1, (struct sockaddr *)&addr);
+
+    uint32_t id = htonl((uint32_t)sim->peers_len + 1);
+
+    sim->request[0] = ACTION_JOIN;
+    memcpy(sim->request + 1, &id, 4);
+
+    engine_feed(server, sim->searcher, sim->request, 5, sim->response, sizeof(sim->response));
+
+    for (uint32_t peer = 0; peer < sim->peers_len; ++peer) {
+        if (!sim_push(sim, SIM_EPOCH + next_random(&sim->random) % SIM_RAMP, peer, EV_CONNECT)) {
+            return false;
+        }
+    }
+
+    uint64_t length = sim->end - SIM_EPOCH;
+
+    // the load starts once everyone had a chance to connect
+    if (!sim_push(sim, SIM_EPOCH + SIM_RAMP, 0, EV_SECOND) ||
+        (sim->storm > 0 && !sim_push(sim, SIM_EPOCH + length / 3, 0, EV_STORM)) ||
+        (sim->flood > 0 && !sim_push(sim, SIM_EPOCH + length * 2 / 3, 0, EV_FLOOD))) {
+        return false;
+    }
+
+    while (sim->events_len > 0) {
+        struct sim_event event = sim_pop(sim);
+
+        if (event.at >= sim->end) {
+            break;
+        }
+
+        if (event.at != server->now) {
+            engine_tick(server, event.at);
+        }
+
+        sim_handle(sim, &event);
+
+        if (server->mem > sim->peak_mem) {
+            sim->peak_mem = server->mem;
+        }
+    }
+
+    return true;
+}
+
+void sim_handle(struct sim *sim, struct sim_event *event) {
+    uint64_t now = sim->server->now;
+
+    switch (event->type) {
+    case EV_SECOND:
+        for (size_t index = 0; index < sim->searches; ++index) {
+            sim_push(sim, now + next_random(&sim->random) % 1000, 0, EV_SEARCH);
+        }
+
+        for (size_t index = 0; index < sim->churn; ++index) {
+            sim_push(sim, now + next_random(&sim->random) % 1000, (uint32_t)(next_random(&sim->random) % sim->peers_len), EV_DROP);
+        }
+
+        sim_push(sim, now + 1000, 0, EV_SECOND);
+        break;
+    case EV_CONNECT:
+        if (peer_connect(sim, event->peer)) {
+            peer_register(sim, event->peer);
+        }
+        break;
+    case EV_DROP:
+        // about half of the peers come back before their catalog is dropped
+        peer_drop(sim, event->peer, next_random(&sim->random) % (2 * sim->server->grace + 1));
+        break;
+    case EV_RESUME:
+        peer_resume(sim, event->peer);
+        break;
+    case EV_PUBLISH:
+        peer_publish(sim, event->peer);
+        break;
+    case EV_SEARCH:
+        sim_search(sim);
+        break;
+    case EV_STORM:
+        for (uint32_t peer = 0; peer < sim->peers_len; ++peer) {
+            if (next_random(&sim->random) % 100 < sim->storm) {
+                peer_drop(sim, peer, next_random(&sim->random) % SIM_STORM_SPREAD);
+            }
+        }
+        break;
+    case EV_FLOOD:
+        for (uint32_t peer = 0; peer < sim->peers_len; ++peer) {
+            if (next_random(&sim->random) % 100 < sim->flood) {
+                sim_push(sim, now + next_random(&sim->random) % SIM_FLOOD_SPREAD, peer, EV_PUBLISH);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+size_t sim_request(struct sim *sim, struct client *client, uint8_t action, size_t len) {
+    uint64_t start = now_ns();
+    size_t got = engine_feed(sim->server, client, sim->request, len, sim->response, sizeof(sim->response));
+    uint64_t took = now_ns() - start;
+
+    struct samples *samples = &sim->samples[action];
+
+    if (samples->len == samples->cap) {
+        size_t cap = samples->cap == 0 ? 1024 : samples->cap * 2;
+        uint64_t *ns = realloc(samples->ns, cap * sizeof(uint64_t));
+
+        if (ns != NULL) {
+            samples->ns = ns;
+            samples->cap = cap;
+        }
+    }
+
+    if (samples->len < samples->cap) {
+        samples->ns[samples->len++] = took;
+    }
+
+    sim->requests += 1;
+    sim->fingerprint = (sim->fingerprint ^ action) * 0x100000001b3;
+
+    for (size_t index = 0; index < got; ++index) {
+        sim->fingerprint = (sim->fingerprint ^ sim->response[index]) * 0x100000001b3;
+    }
+
+    return got;
+}
+
+bool peer_connect(struct sim *sim, uint32_t peer) {
+    struct sockaddr_in addr;
+
+    // every peer gets its own address so search responses can be told apart
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0a000000 | (peer & 0xffffff));
+    addr.sin_port = htons((uint16_t)(1024 + peer % 60000));
+
+    struct client *client = engine_connect(sim->server, -1, (struct sockaddr *)&addr);
+
+    sim->peers[peer].client = client;
+    sim->peers[peer].state = PEER_OFFLINE;
+
+    if (client == NULL) {
+        sim->refused += 1;
+        return false;
+    }
+
+    return true;
+}
+
+void peer_register(struct sim *sim, uint32_t peer) {
+    struct sim_peer *p = &sim->peers[peer];
+    uint32_t id = htonl(peer + 1);
+
+    sim->request[0] = ACTION_REGISTER;
+    memcpy(sim->request + 1, &id, 4);
+
+    size_t len = 5 + build_catalog(sim, sim->request + 5, sizeof(sim->request) - 5, peer);
+
+    if (sim_request(sim, p->client, SIM_REGISTER, len) != 9 || sim->response[0] != REGISTER_OK) {
+        close_client(sim->server, p->client);
+
+        p->client = NULL;
+
+        return;
+    }
+
+    memcpy(&p->token, sim->response + 1, 8);
+    p->token = be64toh(p->token);
+    p->state = PEER_ONLINE;
+}
+
+void peer_drop(struct sim *sim, uint32_t peer, uint64_t delay) {
+    struct sim_peer *p = &sim->peers[peer];
+
+    if (p->state != PEER_ONLINE) {
+        return;
+    }
+
+    close_client(sim->server, p->client);
+
+    p->client = NULL;
+    p->state = PEER_DROPPED;
+
+    sim_push(sim, sim->server->now + delay, peer, EV_RESUME);
+}
+
+void peer_resume(struct sim *sim, uint32_t peer) {
+    struct sim_peer *p = &sim->peers[peer];
+
+    if (p->state != PEER_DROPPED || !peer_connect(sim, peer)) {
+        return;
+    }
+
+    uint64_t token = htobe64(p->token);
+
+    sim->request[0] = ACTION_RESUME;
+    memcpy(sim->request + 1, &token, 8);
+
+    if (sim_request(sim, p->client, SIM_RESUME, 9) != 9) {
+        return;
+    }
+
+    if (sim->response[0] == REGISTER_OK) {
+        p->state = PEER_ONLINE;
+        sim->resumed += 1;
+    } else if (sim->response[0] == REGISTER_UNKNOWN_TOKEN) {
+        sim->expired += 1;
+
+        peer_register(sim, peer);
+    }
+}
+
+void peer_publish(struct sim *sim, uint32_t peer) {
+    struct sim_peer *p = &sim->peers[peer];
+
+    if (p->state != PEER_ONLINE) {
+        return;
+    }
+
+    p->version += 1;
+
+    sim->request[0] = ACTION_PUBLISH;
+
+    size_t len = 1 + build_catalog(sim, sim->request + 1, sizeof(sim->request) - 1, peer);
+
+    sim_request(sim, p->client, SIM_PUBLISH, len);
+}
+
+void sim_search(struct sim *sim) {
+    uint64_t pick = next_random(&sim->random);
+    uint32_t peer = (uint32_t)(pick % sim->peers_len);
+    struct sim_peer *p = &sim->peers[peer];
+
+    sim->request[0] = ACTION_SEARCH;
+
+    size_t len = 1 + (size_t)snprintf((char *)sim->request + 1, sizeof(sim->request) - 1, "p%u-v%u-f%lu", peer, p->version, (unsigned long)((pick >> 32) % sim->server->max_files)) + 1;
+
+    uint32_t found = 0;
+
+    if (sim_request(sim, sim->searcher, SIM_SEARCH, len) == SEARCH_RESPONSE_SIZE) {
+        memcpy(&found, sim->response, 4);
+    }
+
+    // a peer that is offline or waiting to resume can still be found while
+    // its catalog is parked
+    if (ntohl(found) == peer + 1) {
+        sim->found += 1;
+    } else {
+        sim->missed += 1;
+    }
+}
+
+size_t build_catalog(struct sim *sim, uint8_t *buf, size_t len, uint32_t peer) {
+    size_t files = sim->server->max_files;
+    uint32_t count = htonl((uint32_t)files);
+    size_t used = 4;
+
+    memcpy(buf, &count, 4);
+
+    for (size_t index = 0; index < files; ++index) {
+        used += (size_t)snprintf((char *)buf + used, len - used, "p%u-v%u-f%lu", peer, sim->peers[peer].version, (unsigned long)index) + 1;
+    }
+
+    return used;
+}
+
+bool sim_push(struct sim *sim, uint64_t at, uint32_t peer, uint8_t type) {
+    if (sim->events_len == sim->events_cap) {
+        size_t cap = sim->events_cap == 0 ? 1024 : sim->events_cap * 2;
+        struct sim_event *events = realloc(sim->events, cap * sizeof(struct sim_event));
+
+        if (events == NULL) {
+            fprintf(stderr, "[ERROR] failed allocating events\n");
+            return false;
+        }
+
+        sim->events = events;
+        sim->events_cap = cap;
+    }
+
+    size_t index = sim->events_len++;
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (sim->events[parent].at <= at) {
+            break;
+        }
+
+        sim->events[index] = sim->events[parent];
+        index = parent;
+    }
+
+    sim->events[index].at = at;
+    sim->events[index].peer = peer;
+    sim->events[index].type = type;
+
+    return true;
+}
+
+struct sim_event sim_pop(struct sim *sim) {
+    struct sim_event top = sim->events[0];
+    struct sim_event last = sim->events[--sim->events_len];
+    size_t index = 0;
+
+    while (true) {
+        size_t child = index * 2 + 1;
+
+        if (child >= sim->events_len) {
+            break;
+        }
+
+        if (child + 1 < sim->events_len && sim->events[child + 1].at < sim->events[child].at) {
+            child += 1;
+        }
+
+        if (last.at <= sim->events[child].at) {
+            break;
+        }
+
+        sim->events[index] = sim->events[child];
+        index = child;
+    }
+
+    if (sim->events_len > 0) {
+        sim->events[index] = last;
+    }
+
+    return top;
+}
+
+void sim_report(struct sim *sim, uint64_t real_ns) {
+    struct server *server = sim->server;
+    size_t online = 0;
+    size_t parked = 0;
+    struct rusage usage;
+
+    for (size_t index = 0; index < sim->peers_len; ++index) {
+        online += sim->peers[index].state == PEER_ONLINE;
+    }
+
+    for (size_t index = 0; index < server->max_conn; ++index) {
+        parked += server->clients[index].active && server->clients[index].parked;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    double real = real_ns / 1e9;
+    double virtual = (sim->end - SIM_EPOCH) / 1000.0;
+
+    printf("simulated:   %.0f s in %.2f s (%.0fx)\n", virtual, real, virtual / real);
+    printf("requests:    %lu (%.0f req/s)\n", sim->requests, sim->requests / real);
+    printf("peers:       %lu online, %lu parked\n", online, parked);
+    printf("resumed:     %lu, %lu registered again after the grace period\n", sim->resumed, sim->expired);
+    printf("refused:     %lu\n", sim->refused);
+    printf("searches:    %lu found, %lu missed\n", sim->found, sim->missed);
+    printf("client mem:  %.1f MB, peak %.1f MB\n", server->mem / 1e6, sim->peak_mem / 1e6);
+    printf("slots:       %.1f MB\n", server->max_conn * (sizeof(struct client) + sizeof(struct client_cold)) / 1e6);
+    printf("max rss:     %.1f MB\n", usage.ru_maxrss / 1024.0);
+    printf("fingerprint: %016lx\n\n", sim->fingerprint);
+
+    printf("%-8s %10s %10s %10s %10s %10s\n", "", "requests", "mean us", "p50 us", "p99 us", "max us");
+
+    for (size_t action = 0; action < SIM_ACTIONS; ++action) {
+        struct samples *samples = &sim->samples[action];
+
+        if (samples->len == 0) {
+            continue;
+        }
+
+        uint64_t sum = 0;
+
+        qsort(samples->ns, samples->len, sizeof(uint64_t), cmp_u64);
+
+        for (size_t index = 0; index < samples->len; ++index) {
+            sum += samples->ns[index];
+        }
+
+        printf(
+            "%-8s %10lu %10.2f %10.2f %10.2f %10.2f\n",
+            SIM_ACTION_NAMES[action],
+            samples->len,
+            (double)sum / samples->len / 1000.0,
+            samples->ns[samples->len / 2] / 1000.0,
+            samples->ns[samples->len * 99 / 100] / 1000.0,
+            samples->ns[samples->len - 1] / 1000.0
+        );
+    }
+}
+
+void sim_free(struct sim *sim) {
+    if (sim->server != NULL) {
+        engine_free(sim->server);
+        free(sim->server);
+    }
+
+    for (size_t action = 0; action < SIM_ACTIONS; ++action) {
+        free(sim->samples[action].ns);
+    }
+
+    free(sim->peers);
+    free(sim->events);
+}
+
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,96 @@
+// EECE-446-SP-2024
+// David Cathers & Madison Webb
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * static tracepoints for perf, bpftrace and anything else that reads
+ * SystemTap SDT notes, e.g.
+ *
+ *   bpftrace -e 'usdt:./registry:registry:request_start { @[arg1] = count(); }'
+ *
+ * a probe is a single nop in the code plus a note in the binary that says
+ * where the nop is and where its arguments live. the tracer swaps the nop for
+ * a breakpoint when it attaches so a probe costs nothing but the nop until
+ * then. every argument is passed as a 64 bit integer, pointers included.
+ *
+ * sys/sdt.h is used when it is installed. otherwise the notes are written
+ * here in the same format on x86-64 and aarch64, and anywhere else the probes
+ * compile to nothing. build with -DTRACE_DISABLED to leave them out entirely
+ */
+
+#if defined(TRACE_DISABLED)
+#define TRACE_NONE
+#elif defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TRACE_SDT
+#endif
+#endif
+
+#if !defined(TRACE_NONE) && !defined(TRACE_SDT) && !(defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__)))
+#define TRACE_NONE
+#endif
+
+#define TRACE_ARG(x) ((uint64_t)(uintptr_t)(x))
+
+#if defined(TRACE_NONE)
+
+#define TRACE(name) do { } while (0)
+#define TRACE1(name, a) do { (void)(a); } while (0)
+#define TRACE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define TRACE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+
+#elif defined(TRACE_SDT)
+
+#include <sys/sdt.h>
+
+#define TRACE(name) DTRACE_PROBE(registry, name)
+#define TRACE1(name, a) DTRACE_PROBE1(registry, name, TRACE_ARG(a))
+#define TRACE2(name, a, b) DTRACE_PROBE2(registry, name, TRACE_ARG(a), TRACE_ARG(b))
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(registry, name, TRACE_ARG(a), TRACE_ARG(b), TRACE_ARG(c))
+
+#else
+
+// the layout of a version 3 stapsdt note: the address of the nop, the
+// address of _.stapsdt.base so tools can tell if the binary was prelinked,
+// the semaphore (none), then the provider, name and argument strings. the
+// argument string is "8@<operand>" for every argument
+#define TRACE_NOTE(name, args)                                              \
+    "990: nop\n"                                                            \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+    ".balign 4\n"                                                           \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+    "991: .asciz \"stapsdt\"\n"                                             \
+    "992: .balign 4\n"                                                      \
+    "993: .8byte 990b\n"                                                    \
+    ".8byte _.stapsdt.base\n"                                               \
+    ".8byte 0\n"                                                            \
+    ".asciz \"registry\"\n"                                               \
+    ".asciz \"" #name "\"\n"                                                \
+    ".asciz \"" args "\"\n"                                                 \
+    "994: .balign 4\n"                                                      \
+    ".popsection\n"                                                         \
+    ".ifndef _.stapsdt.base\n"                                              \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                                \
+    ".hidden _.stapsdt.base\n"                                              \
+    "_.stapsdt.base: .space 1\n"                                            \
+    ".size _.stapsdt.base, 1\n"                                             \
+    ".popsection\n"                                                         \
+    ".endif\n"
+
+#define TRACE(name) \
+    __asm__ __volatile__(TRACE_NOTE(name, ""))
+#define TRACE1(name, a) \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%0") :: "nor"(TRACE_ARG(a)))
+#define TRACE2(name, a, b) \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%0 8@%1") :: "nor"(TRACE_ARG(a)), "nor"(TRACE_ARG(b)))
+#define TRACE3(name, a, b, c) \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%0 8@%1 8@%2") :: "nor"(TRACE_ARG(a)), "nor"(TRACE_ARG(b)), "nor"(TRACE_ARG(c)))
+
+#endif
+
+#endif